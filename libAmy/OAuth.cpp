@@ -9,15 +9,31 @@
  */
 
 #include "OAuth.h"		// self
-#include <b64/encode.h>		// base64-encoding
 #include <uriparser/Uri.h>	// Used for decoding urlencoded forms
-#include <Utility.h>		// alloc_error, url<encode/decode>
+#include <Utility.h>		// alloc_error
+#include <libink/WTURLEncoder.h>	// WTURLEncoder
+#include <libink/WTFormParser.h>	// WTFormParser
+#include <libink/WTBase64.h>		// WTBase64
+#include <openssl/hmac.h>	// HMAC
+#include <openssl/rand.h>	// RAND_bytes
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#	include <openssl/core_names.h>	// OSSL_MAC_PARAM_DIGEST
+#endif
 #include <string.h>		// strcspn, strlen, strncpy
 #include <stdlib.h>		// calloc, realloc, free
 #include <stdio.h>		// fprintf, stderr
 #include <ctype.h>		// tolower
 #include <errno.h>		// errnos
 #include <limits.h>		// ULLONG_MAX
+#ifndef _WIN32
+#	include <pthread.h>	// pthread_once, pthread_atfork
+#endif
+
+#ifdef _MSC_VER
+#	define WT_THREAD_LOCAL __declspec(thread)
+#else
+#	define WT_THREAD_LOCAL __thread
+#endif
 
 const char *sigmeth_enum_to_str(WTOAuthSigMethod method)
 {
@@ -32,204 +48,564 @@ const char *sigmeth_enum_to_str(WTOAuthSigMethod method)
 	}
 }
 
-bool WTOAuthConnection::gen_sigbase_and_auth(const char *req_type, const void *data)
+/*
+ * Keying HMAC hashes the key into inner and outer pads, which costs as much
+ * as signing a short base string.  Credentials rarely change, so that is
+ * done once in oauth_set_params, and each signature starts from a copy.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+struct WTOAuthHMAC
 {
-	char *base_uri; size_t uri_length; char *stripped_uri; size_t stripped_len;
-	WTDictionary *param_dict; WTSizedBuffer *params; char *next_param; char *enc_params;
-	char nonce[8], *timestamp; size_t timestamp_len;
-	char *encoded_uri; size_t sig_base_len;
-	char *key; unsigned char *signature; size_t key_len; unsigned int signature_len;
-	char *b64_sig;  size_t b64_sig_len = 28; char *enc_b64_sig;
-	char *auth_header; size_t auth_header_len;
-	
-	//
-	// Ensure we are needed/wanted
-	if(consumer_key == NULL && token == NULL) return false;
-	
-	
-	// 
-	// Calculate the length of the URI string
-	stripped_uri = strchr(uri, static_cast<int>('?'));
-	if(stripped_uri != NULL)
+	EVP_MAC_CTX *ctx;
+};
+#else
+struct WTOAuthHMAC
+{
+#	if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	HMAC_CTX *ctx;
+#	else
+	HMAC_CTX ctx;
+#	endif
+};
+#endif
+
+static WTOAuthHMAC *hmac_new(const char *key, size_t key_len)
+{
+	WTOAuthHMAC *hmac = new WTOAuthHMAC;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC *mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	OSSL_PARAM params[2];
+	
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA1"), 0);
+	params[1] = OSSL_PARAM_construct_end();
+	hmac->ctx = (mac == NULL ? NULL : EVP_MAC_CTX_new(mac));
+	EVP_MAC_free(mac);	// the context keeps its own reference
+	if(hmac->ctx == NULL || !EVP_MAC_init(hmac->ctx, reinterpret_cast<const unsigned char *>(key), key_len, params))
 	{
-		stripped_len = abs(uri - stripped_uri);
-		stripped_uri = static_cast<char *>(calloc(stripped_len + 1, sizeof(char)));
-		strncpy(stripped_uri, uri, stripped_len);
-		stripped_uri[stripped_len] = '\0';
-	} else {
-		stripped_uri = strdup(uri);
-		stripped_len = strlen(uri);
+		EVP_MAC_CTX_free(hmac->ctx);
+		delete hmac;
+		return NULL;
 	}
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+	hmac->ctx = HMAC_CTX_new();
+	if(hmac->ctx == NULL || !HMAC_Init_ex(hmac->ctx, key, static_cast<int>(key_len), EVP_sha1(), NULL))
+	{
+		HMAC_CTX_free(hmac->ctx);
+		delete hmac;
+		return NULL;
+	}
+#else
+	HMAC_CTX_init(&hmac->ctx);
+	HMAC_Init_ex(&hmac->ctx, key, static_cast<int>(key_len), EVP_sha1(), NULL);
+#endif
+	return hmac;
+}
+
+static void hmac_free(WTOAuthHMAC *hmac)
+{
+	if(hmac == NULL) return;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX_free(hmac->ctx);
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+	HMAC_CTX_free(hmac->ctx);
+#else
+	HMAC_CTX_cleanup(&hmac->ctx);
+#endif
+	delete hmac;
+}
+
+/* Sign data with a copy of the keyed context, leaving the original alone */
+static bool hmac_sign(const WTOAuthHMAC *hmac, const char *data, size_t length,
+		      unsigned char *signature, unsigned int *signature_len)
+{
+	bool ok;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX *ctx = EVP_MAC_CTX_dup(hmac->ctx);
+	size_t out_len = 0;
+	
+	ok = (ctx != NULL &&
+	      EVP_MAC_update(ctx, reinterpret_cast<const unsigned char *>(data), length) &&
+	      EVP_MAC_final(ctx, signature, &out_len, EVP_MAX_MD_SIZE));
+	*signature_len = static_cast<unsigned int>(out_len);
+	EVP_MAC_CTX_free(ctx);
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+	HMAC_CTX *ctx = HMAC_CTX_new();
+	
+	ok = (ctx != NULL && HMAC_CTX_copy(ctx, hmac->ctx) &&
+	      HMAC_Update(ctx, reinterpret_cast<const unsigned char *>(data), length) &&
+	      HMAC_Final(ctx, signature, signature_len));
+	HMAC_CTX_free(ctx);
+#else
+	HMAC_CTX ctx;
+	
+	HMAC_CTX_init(&ctx);
+	ok = (HMAC_CTX_copy(&ctx, const_cast<HMAC_CTX *>(&hmac->ctx)) &&
+	      HMAC_Update(&ctx, reinterpret_cast<const unsigned char *>(data), length) &&
+	      HMAC_Final(&ctx, signature, signature_len));
+	HMAC_CTX_cleanup(&ctx);
+#endif
+	return ok;
+}
+
+/* Percent-encode str into a new string */
+static char *encoded_dup(const char *str)
+{
+	size_t length = strlen(str);
+	size_t enc_length = WTURLEncoder::encoded_length(str, length);
+	char *encoded = static_cast<char *>(malloc(enc_length + 1));
+	if(encoded == NULL) alloc_error("OAuth credential", enc_length + 1);
+	WTURLEncoder::encode(str, length, encoded, enc_length + 1);
+	return encoded;
+}
+
+/* Parameters collected for the base string, already percent-encoded */
+struct oauth_params
+{
+	WTArena *arena;
+	WTFormField *fields;
+	size_t count;
+};
+
+/* Add a parameter, encoding it into the arena unless it needs no escapes */
+static void add_param(oauth_params *params, const char *name, size_t name_len,
+		      const char *value, size_t value_len)
+{
+	WTFormField *field = &params->fields[params->count++];
+	size_t enc_name_len = WTURLEncoder::encoded_length(name, name_len);
+	size_t enc_value_len = WTURLEncoder::encoded_length(value, value_len);
 	
-	uri_length  = strlen(protocol) + 3 + strlen(domain); // 3 is for "://"
-	uri_length += stripped_len;	// add the URI
-	uri_length++;			// add NUL byte
-	
-	
-	
-	// 
-	// Create the Base String URI
-	base_uri = static_cast<char *>(calloc(uri_length, sizeof(char)));
-	if(base_uri == NULL) alloc_error("OAuth base string URI buffer", uri_length);
-	snprintf(base_uri, uri_length, "%s://%s%s", protocol, domain, stripped_uri);
+	if(enc_name_len != name_len)
+	{
+		char *encoded = static_cast<char *>(params->arena->alloc(enc_name_len + 1));
+		WTURLEncoder::encode(name, name_len, encoded, enc_name_len + 1);
+		name = encoded;
+	}
+	if(enc_value_len != value_len)
+	{
+		char *encoded = static_cast<char *>(params->arena->alloc(enc_value_len + 1));
+		WTURLEncoder::encode(value, value_len, encoded, enc_value_len + 1);
+		value = encoded;
+	}
 	
+	field->name = WTStringView(name, enc_name_len);
+	field->value = WTStringView(value, enc_value_len);
+}
+
+static int add_form_param(const WTFormField *field, void *privdata)
+{
+	add_param(static_cast<oauth_params *>(privdata),
+		  field->name.data(), field->name.length(),
+		  field->value.data(), field->value.length());
+	return 0;
+}
+
+/* The most fields a form could hold: one more than its '&'s */
+static size_t count_fields(const char *form, size_t length)
+{
+	size_t count = 0;
+	for(const char *amp = form; amp != NULL; count++)
+	{
+		amp = static_cast<const char *>(memchr(amp, '&', length - (amp - form)));
+		if(amp != NULL) amp++;
+	}
+	return count;
+}
+
+/*
+ * Whether a Content-Type is a form whose parameters are signed.  Bodies with
+ * no type are sent as forms (it's WTConnection's default), so they count.
+ */
+static bool is_form_type(const char *type)
+{
+	static const char form_type[] = "application/x-www-form-urlencoded";
+	const size_t form_type_len = sizeof(form_type) - 1;
 	
+	if(type == NULL) return true;
+	while(*type == ' ') type++;
+	for(size_t next = 0; next < form_type_len; next++, type++)
+		if(tolower(static_cast<unsigned char>(*type)) != form_type[next]) return false;
 	
-	// 
-	// Generate nonce and timestamp
-	timestamp_len = snprintf(NULL, 0, "%ld", time(NULL)) + 1;
-	timestamp = static_cast<char *>(calloc(timestamp_len, sizeof(char)));
-	if(timestamp == NULL) alloc_error("OAuth timestamp buffer", timestamp_len);
-	snprintf(timestamp, timestamp_len, "%ld", time(NULL));
+	return (*type == '\0' || *type == ';' || *type == ' ');
+}
+
+static int compare_views(const WTStringView &a, const WTStringView &b)
+{
+	size_t shorter = (a.length() < b.length() ? a.length() : b.length());
+	int result = memcmp(a.data(), b.data(), shorter);
+	if(result != 0) return result;
+	return (a.length() < b.length() ? -1 : (a.length() > b.length() ? 1 : 0));
+}
+
+/* Order by encoded name, then encoded value, as RFC 5849 3.4.1.3.2 asks */
+static int compare_params(const void *a, const void *b)
+{
+	const WTFormField *first = static_cast<const WTFormField *>(a);
+	const WTFormField *second = static_cast<const WTFormField *>(b);
+	int result = compare_views(first->name, second->name);
+	return (result != 0 ? result : compare_views(first->value, second->value));
+}
+
+/* Percent-encode str onto the end of out, which has room */
+static inline char *put_encoded(char *out, const char *str, size_t length)
+{
+	return out + WTURLEncoder::encode(str, length, out, length * 3 + 1);
+}
+
+static inline char *put(char *out, const char *str, size_t length)
+{
+	memcpy(out, str, length);
+	return out + length;
+}
+
+#define PUT_LITERAL(out, str) put(out, str, sizeof(str) - 1)
+
+/*
+ * Nonces are NONCE_BYTES random bytes, in hex.  The bytes come from a
+ * per-thread pool that is refilled from OpenSSL's CSPRNG a block at a time,
+ * so most nonces cost no call into OpenSSL, let alone a syscall.
+ */
+#define NONCE_BYTES 16
+#define NONCE_POOL_SIZE (NONCE_BYTES * 32)
+
+static WT_THREAD_LOCAL unsigned char nonce_pool[NONCE_POOL_SIZE];
+static WT_THREAD_LOCAL size_t nonce_pool_left;
+
+#ifndef _WIN32
+/* A forked child must not hand out the bytes its parent is still using */
+static void empty_nonce_pool(void)
+{
+	nonce_pool_left = 0;
+}
+
+static pthread_once_t nonce_fork_once = PTHREAD_ONCE_INIT;
+
+static void register_nonce_fork_handler(void)
+{
+	pthread_atfork(NULL, NULL, &empty_nonce_pool);
+}
+#endif
+
+/* Write a nonce of 2 * NONCE_BYTES hex digits, and a \0, to nonce */
+static bool make_nonce(char *nonce)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	const unsigned char *bytes;
 	
-	srand(time(NULL));
-	snprintf(nonce, sizeof(nonce), "%02x%02x%02x%02x",
-		 rand() % 128, rand() % 128, rand() % 128, rand() % 128);
+	if(nonce_pool_left < NONCE_BYTES)
+	{
+#ifndef _WIN32
+		pthread_once(&nonce_fork_once, &register_nonce_fork_handler);
+#endif
+		if(RAND_bytes(nonce_pool, sizeof(nonce_pool)) != 1) return false;
+		nonce_pool_left = sizeof(nonce_pool);
+	}
 	
+	// Take from the end, and wipe what was used
+	nonce_pool_left -= NONCE_BYTES;
+	bytes = nonce_pool + nonce_pool_left;
+	for(size_t next = 0; next < NONCE_BYTES; next++)
+	{
+		nonce[next * 2] = hex_digits[bytes[next] >> 4];
+		nonce[next * 2 + 1] = hex_digits[bytes[next] & 0xF];
+	}
+	nonce[NONCE_BYTES * 2] = '\0';
+	memset(nonce_pool + nonce_pool_left, 0, NONCE_BYTES);
 	
+	return true;
+}
+
+libAPI WTOAuthSigner::WTOAuthSigner()
+{
+	consumer_key = token = enc_consumer_key = enc_token = signing_key = NULL;
+	signing_key_len = 0;
+	hmac = NULL;
+	sig_method = OAUTH_SIG_HMAC_SHA1;
+}
+
+libAPI WTOAuthSigner::~WTOAuthSigner()
+{
+	clear();
+}
+
+void WTOAuthSigner::clear(void)
+{
+	free(this->consumer_key);
+	free(this->token);
+	free(this->enc_consumer_key);
+	free(this->enc_token);
+	free(this->signing_key);
+	hmac_free(this->hmac);
+	this->consumer_key = this->token = this->enc_consumer_key = this->enc_token = NULL;
+	this->signing_key = NULL;
+	this->hmac = NULL;
+}
+
+libAPI bool WTOAuthSigner::set_credentials(const char *_consumer_key,
+					   const char *_consumer_secret,
+					   const char *_token,
+					   const char *_token_secret,
+					   WTOAuthSigMethod _sig_method)
+{
+	char *enc_consumer_secret, *enc_token_secret;
 	
-	// 
-	// Parameters
-	param_dict = new WTDictionary;
+	clear();
+	if(_consumer_key == NULL && _token == NULL) return false;
 	
-	next_param = (this->query_string == NULL ? NULL : this->query_string+1);
+	this->consumer_key = (_consumer_key ? strdup(_consumer_key) : NULL);
+	this->token = (_token ? strdup(_token) : NULL);
+	this->enc_consumer_key = (_consumer_key ? encoded_dup(_consumer_key) : NULL);
+	this->enc_token = (_token ? encoded_dup(_token) : NULL);
+	this->sig_method = _sig_method;
 	
-	while (next_param != NULL)
+	// Build the key and its HMAC once, rather than for every request
+	enc_consumer_secret = encoded_dup(_consumer_secret ? _consumer_secret : "");
+	enc_token_secret = encoded_dup(_token_secret ? _token_secret : "");
+	this->signing_key_len = strlen(enc_consumer_secret) + 1 + strlen(enc_token_secret);
+	this->signing_key = static_cast<char *>(malloc(this->signing_key_len + 1));
+	if(this->signing_key == NULL) alloc_error("OAuth signing key", this->signing_key_len + 1);
+	snprintf(this->signing_key, this->signing_key_len + 1, "%s&%s",
+		 enc_consumer_secret, enc_token_secret);
+	free(enc_consumer_secret);
+	free(enc_token_secret);
+	
+	if(this->sig_method == OAUTH_SIG_PLAINTEXT) return true;	// the key is the signature
+	this->hmac = hmac_new(this->signing_key, this->signing_key_len);
+	
+	return (this->hmac != NULL);
+}
+
+libAPI size_t WTOAuthSigner::sign(const char *method, const char *protocol,
+				  const char *domain, const char *path, size_t path_len,
+				  const char *query, size_t query_len,
+				  const char *form, size_t form_len,
+				  char *header, size_t size)
+{
+	char nonce[NONCE_BYTES * 2 + 1], timestamp[24], b64_sig[(EVP_MAX_MD_SIZE + 2) / 3 * 4 + 1];
+	char base_buffer[1024], *base, *out;
+	const char *sig_method_str = sigmeth_enum_to_str(this->sig_method);
+	const char *signature; size_t signature_len;
+	unsigned char digest[EVP_MAX_MD_SIZE]; unsigned int digest_len;
+	size_t protocol_len = strlen(protocol), domain_len = strlen(domain);
+	size_t method_len = strlen(method), base_len, header_len, sig_enc_len;
+	oauth_params params;
+	
+	if(this->consumer_key == NULL && this->token == NULL) return 0;
+	
+	this->scratch.reset();
+	if(!make_nonce(nonce))
 	{
-		char *name, *value;
-		
-		value = strchr(next_param, static_cast<int>('='));
-		if(value != NULL)
-		{
-			value[0] = '\0';	// Replace = with \0 for name
-			value++;
-		}
-		
-		name = next_param;
-		
-		next_param = strchr(value, static_cast<int>('&'));
-		if(next_param != NULL)
-		{
-			next_param[0] = '\0';	// Terminate the value (or name)
-			next_param++;
-		}
-		
-		param_dict->set(name, (value == NULL ? strdup("") : strdup(value)));
-		if(value != NULL) value[-1] = '=';
-		if(next_param != NULL) next_param[-1] = '&';
+		nonfatal_error("Couldn't generate an OAuth nonce");
+		return 0;
 	}
+	snprintf(timestamp, sizeof(timestamp), "%ld", static_cast<long>(time(NULL)));
 	
-	if(consumer_key != NULL)
-		param_dict->set("oauth_consumer_key", strdup(consumer_key));
-	if(token != NULL)
-		param_dict->set("oauth_token", strdup(token));
-	
-	param_dict->set("oauth_nonce", strdup(nonce));
-	param_dict->set("oauth_signature_method", strdup(sigmeth_enum_to_str(sig_method)));
-	param_dict->set("oauth_timestamp", strdup(timestamp));
-	param_dict->set("oauth_version", strdup("1.0"));
-	
-	params = param_dict->all("%s=%s&");
 	
+	// 
+	// Parameters: the oauth_* ones, then whatever is in the query and form
+	size_t capacity = 6 + count_fields(query, query_len) + count_fields(form, form_len);
+	params.arena = &this->scratch;
+	params.fields = static_cast<WTFormField *>(this->scratch.alloc(capacity * sizeof(WTFormField)));
+	params.count = 0;
+	
+	if(this->consumer_key != NULL)
+		add_param(&params, "oauth_consumer_key", 18, this->consumer_key, strlen(this->consumer_key));
+	add_param(&params, "oauth_nonce", 11, nonce, strlen(nonce));
+	add_param(&params, "oauth_signature_method", 22, sig_method_str, strlen(sig_method_str));
+	add_param(&params, "oauth_timestamp", 15, timestamp, strlen(timestamp));
+	if(this->token != NULL)
+		add_param(&params, "oauth_token", 11, this->token, strlen(this->token));
+	add_param(&params, "oauth_version", 13, "1.0", 3);
+	
+	// Only fields with escapes are copied (into the arena) to be decoded
+	if(query != NULL && query_len > 0)
+		WTFormParser::scan(query, query_len, &this->scratch, &add_form_param, &params);
+	if(form != NULL && form_len > 0)
+		WTFormParser::scan(form, form_len, &this->scratch, &add_form_param, &params);
+	
+	qsort(params.fields, params.count, sizeof(WTFormField), &compare_params);
 	
 	
 	// 
-	// Signature Base String generation
-	params->buffer[params->buffer_len - 2] = '\0';	// remove trailing &
-	encoded_uri = URLEncode(base_uri);
-	enc_params = URLEncode(params->buffer);
-	free(params->buffer);
-	free(params);
-	params = NULL;
-	sig_base_len = snprintf(NULL, 0, "%s&%s&%s",
-				req_type, encoded_uri, enc_params);
-	sig_base_len++;
-	sig_base = static_cast<char *>(calloc(sig_base_len, sizeof(char)));
-	if(sig_base == NULL) alloc_error("OAuth signature base string buffer", sig_base_len);
-	snprintf(sig_base, sig_base_len, "%s&%s&%s",
-		 req_type, encoded_uri, enc_params);
-	//fprintf(stderr, "OAUTH DEBUG: Signature base string is %s\n", sig_base);
-	//fflush(stderr);
+	// Signature base string: method&encoded URI&encoded parameters,
+	// where the parameters are encoded a second time.
+	base_len = method_len + 1 +
+		   WTURLEncoder::encoded_length(protocol, protocol_len) + 9 +	// %3A%2F%2F
+		   WTURLEncoder::encoded_length(domain, domain_len) +
+		   WTURLEncoder::encoded_length(path, path_len) + 1;
+	for(size_t next = 0; next < params.count; next++)
+	{
+		base_len += (next > 0 ? 3 : 0) +	// %26
+			    WTURLEncoder::encoded_length(params.fields[next].name.data(), params.fields[next].name.length()) + 3 +	// %3D
+			    WTURLEncoder::encoded_length(params.fields[next].value.data(), params.fields[next].value.length());
+	}
+	base = (base_len < sizeof(base_buffer) ? base_buffer
+					       : static_cast<char *>(this->scratch.alloc(base_len + 1)));
+	
+	out = put(base, method, method_len);
+	*out++ = '&';
+	out = put_encoded(out, protocol, protocol_len);
+	out = PUT_LITERAL(out, "%3A%2F%2F");
+	out = put_encoded(out, domain, domain_len);
+	out = put_encoded(out, path, path_len);
+	*out++ = '&';
+	for(size_t next = 0; next < params.count; next++)
+	{
+		if(next > 0) out = PUT_LITERAL(out, "%26");
+		out = put_encoded(out, params.fields[next].name.data(), params.fields[next].name.length());
+		out = PUT_LITERAL(out, "%3D");
+		out = put_encoded(out, params.fields[next].value.data(), params.fields[next].value.length());
+	}
+	*out = '\0';
+	//fprintf(stderr, "OAUTH DEBUG: Signature base string is %s\n", base);
 	
 	
 	// 
-	// Generate the real signature now.
-	key_len = snprintf(NULL, 0, "%s&%s", (consumer_secret == NULL ? "" : consumer_secret), (token_secret == NULL ? "" : token_secret));
-	key_len++;
-	key = static_cast<char *>(calloc(key_len, sizeof(char)));
-	if(key == NULL) alloc_error("OAuth private key", key_len);
-	snprintf(key, key_len, "%s&%s", (consumer_secret == NULL ? "" : consumer_secret), (token_secret == NULL ? "" : token_secret));
-	signature = static_cast<unsigned char *>(calloc(EVP_MAX_MD_SIZE, sizeof(char)));
-	if(signature == NULL) alloc_error("OAuth HMAC signature buffer", EVP_MAX_MD_SIZE);
-	HMAC(EVP_sha1(), static_cast<const void *>(const_cast<const char *>(key)), key_len - 1, reinterpret_cast<const unsigned char *>(const_cast<const char *>(sig_base)), sig_base_len - 1, signature, &signature_len);
-	
+	// The signature itself
+	if(this->sig_method == OAUTH_SIG_PLAINTEXT)
+	{
+		signature = this->signing_key;
+		signature_len = this->signing_key_len;
+	} else {
+		if(this->hmac == NULL || !hmac_sign(this->hmac, base, base_len, digest, &digest_len))
+		{
+			nonfatal_error("Couldn't compute the OAuth signature");
+			return 0;
+		}
+		signature_len = WTBase64::encode(digest, digest_len, b64_sig);
+		signature = b64_sig;
+	}
+	sig_enc_len = WTURLEncoder::encoded_length(signature, signature_len);
 	
 	
 	// 
-	// base64-encode it!  I love OAuth!
-	// You think this is bad?  Wait til you see the auth header code below.
-	b64_sig = static_cast<char *>(calloc(b64_sig_len, sizeof(char)));
-	if(b64_sig == NULL) alloc_error("base64 buffer", b64_sig_len);
-	base64::encoder b64encoder;
-	b64_sig_len = b64encoder.encode(reinterpret_cast<const char *>(signature), signature_len, b64_sig);
-	b64encoder.encode_end(b64_sig + b64_sig_len);
+	// Authorization[sic.] header, measured and then written in one pass
+	header_len = (sizeof("OAuth Realm=\"\",") - 1) +
+		     (sizeof(" oauth_nonce=\"\",") - 1) + strlen(nonce) +
+		     (sizeof(" oauth_signature_method=\"\",") - 1) + strlen(sig_method_str) +
+		     (sizeof(" oauth_timestamp=\"\",") - 1) + strlen(timestamp) +
+		     (sizeof(" oauth_version=\"1.0\",") - 1) +
+		     (sizeof(" oauth_signature=\"\"") - 1) + sig_enc_len;
+	if(this->enc_consumer_key != NULL)
+		header_len += (sizeof(" oauth_consumer_key=\"\",") - 1) + strlen(this->enc_consumer_key);
+	if(this->enc_token != NULL)
+		header_len += (sizeof(" oauth_token=\"\",") - 1) + strlen(this->enc_token);
+	if(header_len >= size)
+	{
+		if(size > 0) header[0] = '\0';
+		return header_len;
+	}
 	
+	out = PUT_LITERAL(header, "OAuth Realm=\"\",");
+	if(this->enc_consumer_key != NULL)
+	{
+		out = PUT_LITERAL(out, " oauth_consumer_key=\"");
+		out = put(out, this->enc_consumer_key, strlen(this->enc_consumer_key));
+		out = PUT_LITERAL(out, "\",");
+	}
+	out = PUT_LITERAL(out, " oauth_nonce=\"");
+	out = put(out, nonce, strlen(nonce));
+	out = PUT_LITERAL(out, "\", oauth_signature_method=\"");
+	out = put(out, sig_method_str, strlen(sig_method_str));
+	out = PUT_LITERAL(out, "\", oauth_timestamp=\"");
+	out = put(out, timestamp, strlen(timestamp));
+	out = PUT_LITERAL(out, "\",");
+	if(this->enc_token != NULL)
+	{
+		out = PUT_LITERAL(out, " oauth_token=\"");
+		out = put(out, this->enc_token, strlen(this->enc_token));
+		out = PUT_LITERAL(out, "\",");
+	}
+	out = PUT_LITERAL(out, " oauth_version=\"1.0\", oauth_signature=\"");
+	out = put_encoded(out, signature, signature_len);
+	out = PUT_LITERAL(out, "\"");
+	*out = '\0';
 	
+	return header_len;
+}
+
+bool WTOAuthConnection::gen_sigbase_and_auth(const char *req_type, const void *data,
+					     uint64_t length)
+{
+	char header[512], *auth_header;
+	const char *query = (this->query_string == NULL ? NULL : this->query_string + 1);
+	size_t path_len = (this->query_string == NULL ? strlen(this->uri) : this->query_string - this->uri);
+	size_t query_len = (query == NULL ? 0 : strlen(query));
+	const char *form = NULL;
+	size_t header_len;
+	
+	// Only form bodies are signed; anything else is left alone
+	if(data != NULL &&
+	   is_form_type(this->headers == NULL ? NULL :
+			static_cast<const char *>(this->headers->get("Content-Type"))))
+		form = static_cast<const char *>(data);
+	
+	header_len = this->signer.sign(req_type, this->protocol, this->domain, this->uri, path_len,
+				       query, query_len, form, static_cast<size_t>(length),
+				       header, sizeof(header));
+	
+	if(header_len == 0)
+	{
+		auth_header = NULL;
+	}
+	else if(header_len < sizeof(header))
+	{
+		auth_header = strdup(header);
+		if(auth_header == NULL) alloc_error("HTTP Authorization buffer", header_len + 1);
+	} else {
+		// Long credentials; sign again into a buffer that fits
+		auth_header = static_cast<char *>(malloc(header_len + 1));
+		if(auth_header == NULL) alloc_error("HTTP Authorization buffer", header_len + 1);
+		header_len = this->signer.sign(req_type, this->protocol, this->domain, this->uri, path_len,
+					       query, query_len, form, static_cast<size_t>(length),
+					       auth_header, header_len + 1);
+		if(header_len == 0)
+		{
+			free(auth_header);
+			auth_header = NULL;
+		}
+	}
 	
-	// 
-	// Authorization[sic.] header
-	enc_b64_sig = URLEncode(b64_sig);
-	free(b64_sig);
-	auth_header_len = snprintf(NULL, 0, "OAuth Realm=\"\",%s%s%s oauth_nonce=\"%s\", oauth_signature_method=\"%s\", oauth_timestamp=\"%s\",%s%s%s oauth_version=\"1.0\", oauth_signature=\"%s\"",
-				   (consumer_key == NULL ? "" : " oauth_consumer_key=\""), (consumer_key == NULL ? "" : consumer_key), (consumer_key == NULL ? "" : "\","),
-				   nonce, sigmeth_enum_to_str(sig_method), timestamp,
-				   (token == NULL ? "" : " oauth_token=\""), (token == NULL ? "" : token), (token == NULL ? "" : "\","),
-				   enc_b64_sig);
-	auth_header_len++;
-	auth_header = static_cast<char *>(calloc(auth_header_len, sizeof(char)));
-	if(auth_header == NULL) alloc_error("HTTP Authorization buffer", auth_header_len);
-	snprintf(auth_header, auth_header_len, "OAuth Realm=\"\",%s%s%s oauth_nonce=\"%s\", oauth_signature_method=\"%s\", oauth_timestamp=\"%s\",%s%s%s oauth_version=\"1.0\", oauth_signature=\"%s\"",
-		 (consumer_key == NULL ? "" : " oauth_consumer_key=\""), (consumer_key == NULL ? "" : consumer_key), (consumer_key == NULL ? "" : "\","),
-		 nonce, sigmeth_enum_to_str(sig_method), timestamp,
-		 (token == NULL ? "" : " oauth_token=\""), (token == NULL ? "" : token), (token == NULL ? "" : "\","),
-		 enc_b64_sig);
-	
-	http_header("Authorization", strdup(auth_header));
-	
-	free(auth_header);
-	free(signature);
-	free(key);
-	free(sig_base);
-	free(timestamp);
-	free(base_uri);
-	free(enc_params);
-	free(encoded_uri);
-	free(enc_b64_sig);
-	free(stripped_uri);
-	
-	delete param_dict;
-	
-	sig_base = NULL;
+	// On failure the last request's header mustn't go out again, as that
+	// would replay its nonce and signature.
+	http_header("Authorization", auth_header);
+	if(auth_header == NULL)
+	{
+		last_error = "The request could not be signed.";
+		delegate_status(WTHTTP_Error);
+		return false;
+	}
 	
 	return true;
 }
 
-void * WTOAuthConnection::download(uint64_t *length)
+bool WTOAuthConnection::download(WTResponseBuffer *response)
+{
+	if(!gen_sigbase_and_auth("GET")) return false;
+	return WTConnection::download(response);
+}
+
+bool WTOAuthConnection::upload(const void *data, uint64_t length, WTResponseBuffer *response)
 {
-	gen_sigbase_and_auth("GET");
-	return WTConnection::download(length);
+	if(!gen_sigbase_and_auth("POST", data, length)) return false;
+	return WTConnection::upload(data, length, response);
 }
 
-void * WTOAuthConnection::upload(const void *data, uint64_t *length)
+bool WTOAuthConnection::store(const void *data, uint64_t length, WTResponseBuffer *response)
 {
-	gen_sigbase_and_auth("POST", data);
-	return WTConnection::upload(data, length);
+	if(!gen_sigbase_and_auth("PUT", data, length)) return false;
+	return WTConnection::store(data, length, response);
 }
 
-void * WTOAuthConnection::store(const void *data, uint64_t *length)
+bool WTOAuthConnection::upload(WTBodySource *body, WTResponseBuffer *response)
 {
-	gen_sigbase_and_auth("PUT", data);
-	return WTConnection::store(data, length);
+	if(!gen_sigbase_and_auth("POST")) return false;
+	return WTConnection::upload(body, response);
+}
+
+bool WTOAuthConnection::store(WTBodySource *body, WTResponseBuffer *response)
+{
+	if(!gen_sigbase_and_auth("PUT")) return false;
+	return WTConnection::store(body, response);
 }
 
 libAPI bool WTOAuthConnection::oauth_set_params(const char *_consumer_key,
@@ -238,28 +614,14 @@ libAPI bool WTOAuthConnection::oauth_set_params(const char *_consumer_key,
 						const char *_token_secret,
 						WTOAuthSigMethod _sig_method)
 {
-	free(const_cast<char *>(consumer_key));
-	free(const_cast<char *>(consumer_secret));
-	free(const_cast<char *>(token));
-	free(const_cast<char *>(token_secret));
-	this->consumer_key = (_consumer_key ? strdup(_consumer_key) : NULL);
-	this->consumer_secret = (_consumer_secret ? strdup(_consumer_secret) : NULL);
-	this->token = (_token ? strdup(_token) : NULL);
-	this->token_secret = (_token_secret ? strdup(_token_secret) : NULL);
-	this->sig_method = _sig_method;
-	
-	return true;
+	return this->signer.set_credentials(_consumer_key, _consumer_secret,
+					    _token, _token_secret, _sig_method);
 }
 
 WTOAuthConnection::WTOAuthConnection(WTConnDelegate *_delegate) : WTConnection(_delegate)
 {
-	consumer_key = consumer_secret = token = token_secret = NULL;
 }
 
 WTOAuthConnection::~WTOAuthConnection()
 {
-	free(const_cast<char *>(this->consumer_key));
-	free(const_cast<char *>(this->consumer_secret));
-	free(const_cast<char *>(this->token));
-	free(const_cast<char *>(this->token_secret));
 }
@@ -12,12 +12,96 @@
 #define __LIBAMY_OAUTH_H__
 
 #include "connect.h"
+#include <libink/WTArena.h>
+
+/* The prepared HMAC for a set of credentials; see OAuth.cpp */
+struct WTOAuthHMAC;
 
 enum WTOAuthSigMethod {
 	OAUTH_SIG_PLAINTEXT,
 	OAUTH_SIG_HMAC_SHA1
 };
 
+/*!
+	@class		WTOAuthSigner
+	@brief		Signs requests with a set of OAuth 1.0 credentials.
+	@details	The signing key and its HMAC are prepared once, when the
+			credentials are set.  Each signature is then built in a
+			scratch arena that is reused from one request to the
+			next, so signing does not allocate once the arena has
+			grown to fit.
+	@note		This class does no locking; use one signer per thread.
+ */
+class WTOAuthSigner
+{
+public:
+	libAPI WTOAuthSigner();
+	libAPI ~WTOAuthSigner();
+	
+	/*!
+	@brief		Set the credentials to sign with.
+	@details	The parameters are as for
+			WTOAuthConnection::oauth_set_params.
+	@result		true if the credentials are set; false if there is
+			neither a consumer key nor a token, or the HMAC could
+			not be prepared.
+	 */
+	libAPI bool set_credentials(const char *consumer_key,
+				    const char *consumer_secret,
+				    const char *token,
+				    const char *token_secret,
+				    WTOAuthSigMethod sig_method);
+	/*!
+	@brief		Sign a request and write its Authorization header.
+	@param		method		The HTTP method, such as "GET".
+	@param		protocol	The scheme of the URL, such as "https".
+	@param		domain		The host of the URL.
+	@param		path		The path of the URL, without the query.
+	@param		path_len	The length of path.
+	@param		query		The query string, without the '?', or
+					NULL.  It is not modified.
+	@param		query_len	The length of query.
+	@param		form		An application/x-www-form-urlencoded
+					request body, whose parameters are
+					signed too, or NULL.  It is not
+					modified.
+	@param		form_len	The length of form.
+	@param		header		The buffer to write the header value
+					into.  May be NULL if size is 0.
+	@param		size		The size of header, including room for
+					the \0 terminator.
+	@result		The length of the header value, not including the \0
+			terminator, or 0 if the request couldn't be signed.  As
+			with snprintf, if this is not less than size nothing was
+			written; sign again with a larger buffer, which gives a
+			new nonce and timestamp.
+	 */
+	libAPI size_t sign(const char *method, const char *protocol,
+			   const char *domain, const char *path, size_t path_len,
+			   const char *query, size_t query_len,
+			   const char *form, size_t form_len,
+			   char *header, size_t size);
+private:
+	char *consumer_key;
+	char *token;
+	/*! consumer_key and token, percent-encoded */
+	char *enc_consumer_key;
+	char *enc_token;
+	WTOAuthSigMethod sig_method;
+	/*! "consumer_secret&token_secret", each percent-encoded */
+	char *signing_key;
+	size_t signing_key_len;
+	/*! HMAC already keyed with signing_key; cloned for each signature */
+	WTOAuthHMAC *hmac;
+	/*! Parameters and the base string; reset for every signature */
+	WTArena scratch;
+	
+	void clear(void);
+	
+	WTOAuthSigner(const WTOAuthSigner &);
+	WTOAuthSigner &operator=(const WTOAuthSigner &);
+};
+
 /*!
 	@class		WTOAuthConnection
 	@brief		Represents an OAuth authorised connection to the network.
@@ -60,39 +144,43 @@ public:
 				     const char *token_secret,
 				     WTOAuthSigMethod sig_method);
 
+	// The pointer-returning variants call through to the ones below.
+	using WTConnection::download;
+	using WTConnection::upload;
+	using WTConnection::store;
+
 	/*!
 	@brief		Download from the URL connected to.
-	@param		length	The length of the result. (Out)
-	@result		NULL if there is an error, there is no data, or the
-			object is not connected.  Otherwise, a pointer to
-			the data.
+	@param		response	Receives the response body. (Out)
+	@result		true if a response was received; false otherwise.
 	 */
-	libAPI void * download(uint64_t *length);
+	libAPI bool download(WTResponseBuffer *response);
 	/*!
 	@brief		Upload data to the URL connected to.
-	@param		data	The data to upload.
-	@param		length	The length of the data and result. (In/Out)
+	@param		data		The data to upload. (In)
+	@param		length		The length of the data. (In)
+	@param		response	Receives the response body. (Out)
+	 */
+	libAPI bool upload(const void *data, uint64_t length,
+			   WTResponseBuffer *response);
+	libAPI bool store(const void *data, uint64_t length,
+			  WTResponseBuffer *response);
+	/*!
+	@brief		Upload a body to the URL connected to as it is
+			produced.
+	@note		The body is not signed, so this is not suitable for
+			form bodies.
 	 */
-	libAPI void * upload(const void *data, uint64_t *length);
-	libAPI void * store(const void *data, uint64_t *length);
+	libAPI bool upload(WTBodySource *body, WTResponseBuffer *response);
+	libAPI bool store(WTBodySource *body, WTResponseBuffer *response);
 
 	libAPI virtual ~WTOAuthConnection();
 private:
-	/*! The client credential ID */
-	const char *consumer_key;
-	/*! The client credential privkey */
-	const char *consumer_secret;
-	/*! The requestor public key (if available) */
-	const char *token;
-	/*! The requestor private key (if available) */
-	const char *token_secret;
-	/*! The signature method */
-	WTOAuthSigMethod sig_method;
-	
-	/*! The signature base string */
-	char *sig_base;
+	/*! The credentials, and the means to sign with them */
+	WTOAuthSigner signer;
 	
-	bool gen_sigbase_and_auth(const char *req_type = "GET", const void *data = NULL);
+	bool gen_sigbase_and_auth(const char *req_type = "GET", const void *data = NULL,
+				  uint64_t length = 0);
 };
 
 #endif /*!__LIBAMY_OAUTH_H__*/
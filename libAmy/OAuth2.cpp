@@ -0,0 +1,500 @@
+/*
+ * OAuth2.cpp - implementation of OAuth 2.0 bearer tokens
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "OAuth2.h"		// self
+#include <libink/WTRWLock.h>	// WTRWLock
+#include <libink/WTURLEncoder.h>	// WTURLEncoder
+#include <Utility.h>		// alloc_error
+#include <string.h>		// memcpy, strdup, strlen, strstr
+#include <stdlib.h>		// malloc, free, strtol
+#include <vector>
+
+#ifdef _WIN32
+#	include <windows.h>	// Sleep, InterlockedExchange
+#else
+#	include <unistd.h>	// sleep
+#endif
+
+/* How long to leave an account alone after a failed background refresh */
+#define OAUTH2_RETRY_SECONDS 30
+
+struct WTOAuth2Account
+{
+	char *name;
+	/*! "Bearer <token>", or NULL before the first fetch */
+	char *header;
+	size_t header_len;
+	time_t expires;
+	/*! How long the token was issued for, in seconds */
+	long lifetime;
+	/*! Whether the token has been handed out since it was fetched.
+	    Set under the shared lock, so only through set_flag. */
+	volatile long used;
+	/*! No background refresh before this time */
+	time_t retry_after;
+	/*! How many fetches have been made, and whether the last failed */
+	unsigned long fetches;
+	bool fetch_failed;
+	/*! Guards everything above */
+	WTRWLock header_lock;
+	/*! Held while fetching, so each account has one fetch in flight */
+	mowgli_mutex_t refresh_lock;
+};
+
+/* Flags one thread sets while another reads them with no lock between
+   them (such as a token being marked used under its lock held shared) */
+#ifdef _WIN32
+#	define set_flag(f, v) InterlockedExchange(&(f), (v))
+#	define get_flag(f) InterlockedCompareExchange(&(f), 0, 0)
+#else
+#	define set_flag(f, v) __atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+#	define get_flag(f) __atomic_load_n(&(f), __ATOMIC_RELAXED)
+#endif
+
+static void sleep_seconds(long seconds)
+{
+#ifdef _WIN32
+	Sleep(seconds * 1000);
+#else
+	sleep(seconds);
+#endif
+}
+
+
+/*
+ * Pull a top-level field out of a token response.  These are flat JSON
+ * objects, so this doesn't need a full parser.  Returns the value
+ * (unescaped, if it was a string) allocated with malloc, or NULL.
+ */
+static char *json_field(const char *body, size_t length, const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *end = body + length, *at = body;
+	
+	while(at < end)
+	{
+		const char *quote = static_cast<const char *>(memchr(at, '"', end - at));
+		if(quote == NULL || static_cast<size_t>(end - quote) < name_len + 2) return NULL;
+		at = quote + 1;
+		if(memcmp(at, name, name_len) != 0 || at[name_len] != '"') continue;
+		
+		at += name_len + 1;
+		while(at < end && (*at == ' ' || *at == '\t' || *at == '\r' || *at == '\n')) at++;
+		if(at == end || *at != ':') continue;
+		at++;
+		while(at < end && (*at == ' ' || *at == '\t' || *at == '\r' || *at == '\n')) at++;
+		if(at == end) return NULL;
+		
+		char *value = static_cast<char *>(malloc(end - at + 1));
+		if(value == NULL) alloc_error("OAuth 2.0 token response field", end - at + 1);
+		size_t used = 0;
+		
+		if(*at == '"')
+		{
+			// Only the escapes a token or number could contain
+			for(at++; at < end && *at != '"'; at++)
+			{
+				if(*at == '\\' && at + 1 < end) at++;
+				value[used++] = *at;
+			}
+		} else {
+			while(at < end && *at != ',' && *at != '}' && *at != ' ' &&
+			      *at != '\r' && *at != '\n')
+				value[used++] = *at++;
+		}
+		value[used] = '\0';
+		return value;
+	}
+	
+	return NULL;
+}
+
+static char *encoded_copy(const char *str)
+{
+	size_t length = strlen(str);
+	size_t enc_length = WTURLEncoder::encoded_length(str, length);
+	char *encoded = static_cast<char *>(malloc(enc_length + 1));
+	if(encoded == NULL) alloc_error("OAuth 2.0 form field", enc_length + 1);
+	WTURLEncoder::encode(str, length, encoded, enc_length + 1);
+	return encoded;
+}
+
+libAPI WTOAuth2RefreshSource::WTOAuth2RefreshSource(const char *_token_url,
+						     const char *_client_id,
+						     const char *_client_secret)
+	: refresh_tokens(true)
+{
+	mowgli_mutex_create(&this->tokens_lock);
+	this->token_url = strdup(_token_url);
+	this->client_id = encoded_copy(_client_id);
+	this->client_secret = (_client_secret == NULL ? NULL : encoded_copy(_client_secret));
+}
+
+libAPI WTOAuth2RefreshSource::~WTOAuth2RefreshSource()
+{
+	free(this->token_url);
+	free(this->client_id);
+	free(this->client_secret);
+	mowgli_mutex_destroy(&this->tokens_lock);
+}
+
+libAPI void WTOAuth2RefreshSource::set_refresh_token(const char *account,
+						     const char *refresh_token)
+{
+	mowgli_mutex_lock(&this->tokens_lock);
+	this->refresh_tokens.set_copy(account, refresh_token);
+	mowgli_mutex_unlock(&this->tokens_lock);
+}
+
+libAPI bool WTOAuth2RefreshSource::fetch_token(const char *account, char **access_token,
+					       long *expires_in)
+{
+	const char *refresh_token;
+	char *enc_refresh_token = NULL, *body, *lifetime, *new_refresh_token;
+	size_t body_len;
+	uint16_t status;
+	WTResponseBuffer response;
+	WTConnection connection(NULL);
+	
+	// Copied under the lock, as another thread may replace it
+	mowgli_mutex_lock(&this->tokens_lock);
+	refresh_token = static_cast<const char *>(this->refresh_tokens.get(account));
+	if(refresh_token != NULL) enc_refresh_token = encoded_copy(refresh_token);
+	mowgli_mutex_unlock(&this->tokens_lock);
+	
+	if(enc_refresh_token == NULL) return false;
+	
+	body_len = snprintf(NULL, 0, "grant_type=refresh_token&refresh_token=%s&client_id=%s%s%s",
+			    enc_refresh_token, this->client_id,
+			    (this->client_secret == NULL ? "" : "&client_secret="),
+			    (this->client_secret == NULL ? "" : this->client_secret));
+	body = static_cast<char *>(malloc(body_len + 1));
+	if(body == NULL) alloc_error("OAuth 2.0 token request", body_len + 1);
+	snprintf(body, body_len + 1, "grant_type=refresh_token&refresh_token=%s&client_id=%s%s%s",
+		 enc_refresh_token, this->client_id,
+		 (this->client_secret == NULL ? "" : "&client_secret="),
+		 (this->client_secret == NULL ? "" : this->client_secret));
+	free(enc_refresh_token);
+	
+	if(!connection.connect(this->token_url))
+	{
+		free(body);
+		return false;
+	}
+	connection.http_header("Content-Type", strdup("application/x-www-form-urlencoded"));
+	connection.http_header("Accept", strdup("application/json"));
+	if(!connection.upload(body, body_len, &response) || response.data() == NULL)
+	{
+		free(body);
+		return false;
+	}
+	free(body);
+	
+	// Errors come back as JSON too, which mustn't be taken for a token
+	status = connection.get_last_status();
+	if(status < 200 || status >= 300)
+	{
+		nonfatal_error("OAuth 2.0 token endpoint refused the refresh token");
+		return false;
+	}
+	
+	*access_token = json_field(response.data(), response.length(), "access_token");
+	if(*access_token == NULL) return false;
+	
+	lifetime = json_field(response.data(), response.length(), "expires_in");
+	*expires_in = (lifetime == NULL ? 3600 : strtol(lifetime, NULL, 10));
+	free(lifetime);
+	
+	// The server may rotate the refresh token
+	new_refresh_token = json_field(response.data(), response.length(), "refresh_token");
+	if(new_refresh_token != NULL)
+	{
+		mowgli_mutex_lock(&this->tokens_lock);
+		this->refresh_tokens.set_copy(account, new_refresh_token);
+		mowgli_mutex_unlock(&this->tokens_lock);
+		free(new_refresh_token);
+	}
+	
+	return true;
+}
+
+
+libAPI WTOAuth2TokenManager::WTOAuth2TokenManager(WTOAuth2TokenSource *_source,
+						   long _refresh_ahead,
+						   long _check_interval)
+	: accounts(false)
+{
+	this->source = _source;
+	this->refresh_ahead = _refresh_ahead;
+	this->check_interval = (_check_interval < 1 ? 1 : _check_interval);
+	this->running = false;
+	this->stopping = 0;
+	mowgli_mutex_create(&this->accounts_lock);
+}
+
+libAPI WTOAuth2TokenManager::~WTOAuth2TokenManager()
+{
+	stop();
+	
+	const void **entries = this->accounts.allValues();
+	for(size_t next = 0; next < this->accounts.count(); next++)
+	{
+		WTOAuth2Account *entry = static_cast<WTOAuth2Account *>(const_cast<void *>(entries[next]));
+		mowgli_mutex_destroy(&entry->refresh_lock);
+		free(entry->name);
+		free(entry->header);
+		delete entry;
+	}
+	mowgli_mutex_destroy(&this->accounts_lock);
+}
+
+WTOAuth2Account *WTOAuth2TokenManager::find_account(const char *account)
+{
+	WTOAuth2Account *entry;
+	
+	mowgli_mutex_lock(&this->accounts_lock);
+	entry = static_cast<WTOAuth2Account *>(const_cast<void *>(this->accounts.get(account)));
+	if(entry == NULL)
+	{
+		entry = new WTOAuth2Account;
+		entry->name = strdup(account);
+		entry->header = NULL;
+		entry->header_len = 0;
+		entry->expires = 0;
+		entry->lifetime = 0;
+		entry->used = 0;
+		entry->retry_after = 0;
+		entry->fetches = 0;
+		entry->fetch_failed = false;
+		mowgli_mutex_create(&entry->refresh_lock);
+		this->accounts.set(account, entry);
+	}
+	mowgli_mutex_unlock(&this->accounts_lock);
+	
+	return entry;
+}
+
+/*
+ * Fetch a new token for entry, unless the one it has is good until
+ * needed_until.  That check is made again once the fetch lock is held, so
+ * threads that queue up behind a fetch use its token rather than fetching
+ * their own; if that fetch failed, they fail with it.
+ */
+bool WTOAuth2TokenManager::refresh(WTOAuth2Account *entry, time_t needed_until)
+{
+	char *access_token = NULL, *header;
+	long expires_in = 0;
+	size_t header_len;
+	unsigned long seen;
+	bool have_token, failed;
+	
+	entry->header_lock.lock_shared();
+	seen = entry->fetches;
+	entry->header_lock.unlock_shared();
+	
+	mowgli_mutex_lock(&entry->refresh_lock);
+	
+	entry->header_lock.lock_shared();
+	have_token = (entry->header != NULL && entry->expires > needed_until);
+	failed = (entry->fetches != seen && entry->fetch_failed);
+	entry->header_lock.unlock_shared();
+	if(have_token || failed)
+	{
+		mowgli_mutex_unlock(&entry->refresh_lock);
+		return have_token;
+	}
+	
+	if(!this->source->fetch_token(entry->name, &access_token, &expires_in) ||
+	   access_token == NULL)
+	{
+		entry->header_lock.lock();
+		entry->retry_after = time(NULL) + OAUTH2_RETRY_SECONDS;
+		entry->fetches++;
+		entry->fetch_failed = true;
+		entry->header_lock.unlock();
+		mowgli_mutex_unlock(&entry->refresh_lock);
+		return false;
+	}
+	
+	header_len = 7 + strlen(access_token);	// "Bearer "
+	header = static_cast<char *>(malloc(header_len + 1));
+	if(header == NULL) alloc_error("OAuth 2.0 Authorization header", header_len + 1);
+	memcpy(header, "Bearer ", 7);
+	memcpy(header + 7, access_token, header_len - 7 + 1);
+	free(access_token);
+	
+	entry->header_lock.lock();
+	free(entry->header);
+	entry->header = header;
+	entry->header_len = header_len;
+	entry->expires = time(NULL) + expires_in;
+	entry->lifetime = expires_in;
+	set_flag(entry->used, 0);
+	entry->fetches++;
+	entry->fetch_failed = false;
+	entry->header_lock.unlock();
+	
+	mowgli_mutex_unlock(&entry->refresh_lock);
+	return true;
+}
+
+libAPI char *WTOAuth2TokenManager::authorization(const char *account)
+{
+	WTOAuth2Account *entry = find_account(account);
+	char *header = NULL;
+	
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		entry->header_lock.lock_shared();
+		if(entry->header != NULL && entry->expires > time(NULL))
+		{
+			header = static_cast<char *>(malloc(entry->header_len + 1));
+			if(header == NULL) alloc_error("OAuth 2.0 Authorization header", entry->header_len + 1);
+			memcpy(header, entry->header, entry->header_len + 1);
+			set_flag(entry->used, 1);
+		}
+		entry->header_lock.unlock_shared();
+		
+		// Expired, or never fetched: fetch it now, or wait for the
+		// fetch already under way.
+		if(header != NULL || !refresh(entry, time(NULL))) break;
+	}
+	
+	return header;
+}
+
+libAPI void WTOAuth2TokenManager::invalidate(const char *account)
+{
+	WTOAuth2Account *entry = find_account(account);
+	
+	entry->header_lock.lock();
+	entry->expires = 0;
+	entry->header_lock.unlock();
+}
+
+void *WTOAuth2TokenManager::refresh_loop(mowgli_thread_t *thread, void *privdata)
+{
+	WTOAuth2TokenManager *manager = static_cast<WTOAuth2TokenManager *>(privdata);
+	std::vector<WTOAuth2Account *> entries;
+	
+	while(!get_flag(manager->stopping))
+	{
+		time_t now = time(NULL);
+		
+		// Accounts are never removed, so the entries stay valid
+		// after the lock is dropped.
+		mowgli_mutex_lock(&manager->accounts_lock);
+		const void **values = manager->accounts.allValues();
+		entries.clear();
+		for(size_t next = 0; next < manager->accounts.count(); next++)
+			entries.push_back(static_cast<WTOAuth2Account *>(const_cast<void *>(values[next])));
+		mowgli_mutex_unlock(&manager->accounts_lock);
+		
+		for(size_t next = 0; next < entries.size() && !get_flag(manager->stopping); next++)
+		{
+			WTOAuth2Account *entry = entries[next];
+			long ahead = manager->refresh_ahead;
+			bool due;
+			
+			// Only keep up tokens that are in use.  One that doesn't
+			// outlive refresh_ahead would be due again as soon as it
+			// was fetched, so it's refreshed halfway through instead.
+			entry->header_lock.lock_shared();
+			if(ahead >= entry->lifetime) ahead = entry->lifetime / 2;
+			due = (entry->header != NULL && get_flag(entry->used) &&
+			       entry->retry_after <= now && entry->expires - now <= ahead);
+			entry->header_lock.unlock_shared();
+			
+			if(due) manager->refresh(entry, now + ahead);
+		}
+		
+		for(long waited = 0; waited < manager->check_interval && !get_flag(manager->stopping); waited++)
+			sleep_seconds(1);
+	}
+	
+	return NULL;
+}
+
+libAPI bool WTOAuth2TokenManager::start(void)
+{
+	if(this->running) return true;
+	
+	set_flag(this->stopping, 0);
+	if(mowgli_thread_create(&this->refresh_thread, &WTOAuth2TokenManager::refresh_loop, this) != 0)
+		return false;
+	this->running = true;
+	
+	return true;
+}
+
+libAPI void WTOAuth2TokenManager::stop(void)
+{
+	if(!this->running) return;
+	
+	set_flag(this->stopping, 1);
+	mowgli_thread_join(&this->refresh_thread);
+	this->running = false;
+}
+
+
+libAPI WTOAuth2Connection::WTOAuth2Connection(WTOAuth2TokenManager *_manager,
+					       const char *_account,
+					       WTConnDelegate *_delegate)
+	: WTConnection(_delegate)
+{
+	this->manager = _manager;
+	this->account = strdup(_account);
+}
+
+libAPI WTOAuth2Connection::~WTOAuth2Connection()
+{
+	free(this->account);
+}
+
+bool WTOAuth2Connection::authorise(void)
+{
+	char *header = this->manager->authorization(this->account);
+	if(header == NULL) return false;
+	
+	http_header("Authorization", header);
+	return true;
+}
+
+libAPI bool WTOAuth2Connection::download(WTResponseBuffer *response)
+{
+	if(!authorise()) return false;
+	return WTConnection::download(response);
+}
+
+libAPI bool WTOAuth2Connection::upload(const void *data, uint64_t length,
+				       WTResponseBuffer *response)
+{
+	if(!authorise()) return false;
+	return WTConnection::upload(data, length, response);
+}
+
+libAPI bool WTOAuth2Connection::store(const void *data, uint64_t length,
+				      WTResponseBuffer *response)
+{
+	if(!authorise()) return false;
+	return WTConnection::store(data, length, response);
+}
+
+libAPI bool WTOAuth2Connection::upload(WTBodySource *body, WTResponseBuffer *response)
+{
+	if(!authorise()) return false;
+	return WTConnection::upload(body, response);
+}
+
+libAPI bool WTOAuth2Connection::store(WTBodySource *body, WTResponseBuffer *response)
+{
+	if(!authorise()) return false;
+	return WTConnection::store(body, response);
+}
@@ -0,0 +1,208 @@
+/*
+ * OAuth2.h - OAuth 2.0 bearer tokens for WTConnection
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBAMY_OAUTH2_H__
+#define __LIBAMY_OAUTH2_H__
+
+#include "connect.h"
+#include <libmowgli/mowgli.h>
+#include <time.h>
+
+/*!
+	@class		WTOAuth2TokenSource
+	@brief		Where a WTOAuth2TokenManager gets its access tokens.
+ */
+class WTOAuth2TokenSource
+{
+public:
+	virtual ~WTOAuth2TokenSource() {}
+	
+	/*!
+	@brief		Fetch a new access token for an account.
+	@details	This may be called from the manager's refresh thread,
+			but never for the same account from two threads at
+			once.
+	@param		account		The account to fetch a token for.
+	@param		access_token	Receives the token, allocated with
+					malloc. (Out)
+	@param		expires_in	Receives the lifetime of the token, in
+					seconds. (Out)
+	@result		true if a token was fetched; false otherwise.
+	 */
+	virtual bool fetch_token(const char *account, char **access_token,
+				 long *expires_in) = 0;
+};
+
+/*!
+	@class		WTOAuth2RefreshSource
+	@brief		Fetches access tokens with the refresh_token grant.
+	@details	Each account's refresh token is POSTed to the token
+			endpoint, as RFC 6749 section 6 describes.  If the
+			server issues a new refresh token, it replaces the old
+			one.
+ */
+class WTOAuth2RefreshSource : public WTOAuth2TokenSource
+{
+public:
+	/*!
+	@brief		Initialise the source.
+	@param		token_url	The URL of the token endpoint.
+	@param		client_id	The client identifier.
+	@param		client_secret	The client secret, or NULL for a
+					public client.
+	 */
+	libAPI WTOAuth2RefreshSource(const char *token_url, const char *client_id,
+				     const char *client_secret = NULL);
+	libAPI virtual ~WTOAuth2RefreshSource();
+	
+	/*!
+	@brief		Set the refresh token for an account.
+	 */
+	libAPI void set_refresh_token(const char *account, const char *refresh_token);
+	
+	libAPI virtual bool fetch_token(const char *account, char **access_token,
+					long *expires_in);
+private:
+	char *token_url;
+	char *client_id;
+	char *client_secret;
+	/*! Refresh tokens, by account */
+	WTDictionary refresh_tokens;
+	/*! Held while a refresh token is read or replaced, since the
+	    dictionary frees the old copy as soon as it's replaced */
+	mowgli_mutex_t tokens_lock;
+};
+
+/*!
+	@class		WTOAuth2TokenManager
+	@brief		Caches OAuth 2.0 access tokens, per account.
+	@details	Each account's "Bearer" Authorization header is built
+			once, when its token is fetched, so attaching it to a
+			request costs only a copy.
+			
+			Once ::start has been called, a background thread
+			refreshes tokens that have been used since they were
+			fetched and are within refresh_ahead seconds of
+			expiring (or half their lifetime, for tokens that don't
+			last that long), so requests don't wait on the token
+			endpoint, or get a 401 and retry.  Tokens nobody uses
+			are left to expire.  A request for a token that has
+			expired anyway fetches it there and then.  Either way,
+			only one fetch per account is in flight at once: any
+			other thread that needs the token waits for it, and
+			fails with it if it fails.
+	@note		All methods are safe to call from any thread.
+ */
+class WTOAuth2TokenManager
+{
+public:
+	/*!
+	@brief		Initialise the manager.
+	@param		source		Where tokens come from.  It must outlive
+					the manager.
+	@param		refresh_ahead	How many seconds before a token expires
+					to refresh it in the background.
+	@param		check_interval	How often, in seconds, the background
+					thread looks for tokens to refresh.
+	 */
+	libAPI WTOAuth2TokenManager(WTOAuth2TokenSource *source,
+				    long refresh_ahead = 300,
+				    long check_interval = 30);
+	/*!
+	@brief		Stop the refresh thread and free every token.
+	 */
+	libAPI ~WTOAuth2TokenManager();
+	
+	/*!
+	@brief		Start refreshing tokens in the background.
+	@result		true if the refresh thread is running.
+	 */
+	libAPI bool start(void);
+	/*!
+	@brief		Stop the refresh thread, if it is running.
+	 */
+	libAPI void stop(void);
+	
+	/*!
+	@brief		Retrieve the Authorization header for an account.
+	@result		"Bearer " and the account's access token, allocated
+			with malloc, ready to pass to WTConnection::http_header;
+			or NULL if no token could be fetched.
+	 */
+	libAPI char *authorization(const char *account);
+	/*!
+	@brief		Throw away an account's token, such as after the
+			server has rejected it, so the next request fetches a
+			new one.
+	 */
+	libAPI void invalidate(const char *account);
+private:
+	WTOAuth2TokenSource *source;
+	long refresh_ahead;
+	long check_interval;
+	
+	/*! struct WTOAuth2Account (see OAuth2.cpp), by account name */
+	WTDictionary accounts;
+	/*! Held while adding to, or walking, accounts */
+	mowgli_mutex_t accounts_lock;
+	
+	mowgli_thread_t refresh_thread;
+	bool running;
+	volatile long stopping;
+	
+	struct WTOAuth2Account *find_account(const char *account);
+	bool refresh(struct WTOAuth2Account *entry, time_t needed_until);
+	static void *refresh_loop(mowgli_thread_t *thread, void *privdata);
+	
+	WTOAuth2TokenManager(const WTOAuth2TokenManager &);
+	WTOAuth2TokenManager &operator=(const WTOAuth2TokenManager &);
+};
+
+/*!
+	@class		WTOAuth2Connection
+	@brief		A connection authorised with an OAuth 2.0 bearer token.
+	@details	Each request carries the account's current token from a
+			WTOAuth2TokenManager.
+ */
+class WTOAuth2Connection : public WTConnection
+{
+public:
+	/*!
+	@brief		Initialise the connection object.
+	@param		manager		The token manager.  It must outlive the
+					connection.
+	@param		account		The account whose token to send.
+	@param		delegate	The optional delegate object for this
+					connection.
+	 */
+	libAPI WTOAuth2Connection(WTOAuth2TokenManager *manager, const char *account,
+				  WTConnDelegate *delegate = NULL);
+	libAPI virtual ~WTOAuth2Connection();
+	
+	// The pointer-returning variants call through to the ones below.
+	using WTConnection::download;
+	using WTConnection::upload;
+	using WTConnection::store;
+	
+	libAPI bool download(WTResponseBuffer *response);
+	libAPI bool upload(const void *data, uint64_t length,
+			   WTResponseBuffer *response);
+	libAPI bool store(const void *data, uint64_t length,
+			  WTResponseBuffer *response);
+	libAPI bool upload(WTBodySource *body, WTResponseBuffer *response);
+	libAPI bool store(WTBodySource *body, WTResponseBuffer *response);
+private:
+	WTOAuth2TokenManager *manager;
+	char *account;
+	
+	bool authorise(void);
+};
+
+#endif /*!__LIBAMY_OAUTH2_H__*/
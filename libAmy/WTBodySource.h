@@ -0,0 +1,88 @@
+/*
+ * WTBodySource.h - interface of request body producers for WTConnection
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBAMY_WTBODYSOURCE_H__
+#define __LIBAMY_WTBODYSOURCE_H__
+
+#include <stdlib.h>	// size_t
+
+#ifndef WIN32
+#	include <stdint.h>
+#endif
+
+/*! The length of a body that isn't known until it has been produced */
+#define WTBODY_LENGTH_UNKNOWN	(~static_cast<uint64_t>(0))
+
+/*! Defined where bodies can be moved between descriptors with splice(2) */
+#ifdef __linux__
+#	define WTBODY_HAVE_SPLICE
+#endif
+
+/*!
+	@class		WTBodySource
+	@brief		Produces a request body a block at a time.
+	@details	WTConnection pulls the body from its source into a
+			fixed-size buffer and sends each block as it goes, so
+			the whole body never has to be held in memory.
+ */
+class WTBodySource
+{
+public:
+	virtual ~WTBodySource() {}
+
+	/*!
+	@brief		Retrieve the length of the body.
+	@result		The exact number of bytes read() will produce, or
+			WTBODY_LENGTH_UNKNOWN if that isn't known in advance
+			(in which case HTTP bodies are sent chunked).
+	 */
+	virtual uint64_t length(void) = 0;
+	/*!
+	@brief		Produce the next part of the body.
+	@param		buffer		The buffer to write into.
+	@param		size		The size of buffer.
+	@param		used		Receives the number of bytes written;
+					0 once the body has all been
+					produced. (Out)
+	@result		true if the body can continue; false if it could not
+			be produced, in which case the request is abandoned.
+	 */
+	virtual bool read(char *buffer, size_t size, size_t *used) = 0;
+	
+	/*!
+	@brief		Determine whether the next part of the body can be
+			moved with splice_to() rather than read().
+	@result		true while the body is at data held in a descriptor,
+			such as a socket, that can be spliced from.  The
+			default is false.
+	 */
+	virtual bool can_splice(void) { return false; }
+	/*!
+	@brief		Splice the next part of the body into a pipe, so it
+			never passes through user space.
+	@param		pipe		The pipe's write end.
+	@param		size		The most to move.
+	@param		used		Receives the number of bytes moved; 0
+					once the data that can be spliced has
+					run out, and read() takes over again.
+					(Out)
+	@result		true if the body can continue; false if it could not
+			be produced.
+	@notes		This is only called when can_splice() is true, and
+			only where WTBODY_HAVE_SPLICE is defined.
+	 */
+	virtual bool splice_to(int pipe, size_t size, size_t *used)
+	{
+		*used = 0;
+		return false;
+	}
+};
+
+#endif /*!__LIBAMY_WTBODYSOURCE_H__*/
@@ -0,0 +1,199 @@
+/*
+ * WTChunkedDecoder.cpp - implementation of HTTP chunked transfer decoding
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "WTChunkedDecoder.h"	// Self
+#include <Utility.h>		// alloc_error
+#include <string.h>		// memchr, memmove
+#include <stdlib.h>		// realloc, free
+
+// Nobody has a legitimate reason to send trailers longer than this.
+#define MAX_TRAILER_LINE 8192
+
+static int hex_value(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+libAPI WTChunkedDecoder::WTChunkedDecoder(WTDictionary *_trailers)
+{
+	this->state = CHUNK_SIZE;
+	this->remaining = 0;
+	this->have_digits = false;
+	this->trailers = _trailers;
+	this->line = NULL;
+	this->line_len = 0;
+	this->line_size = 0;
+}
+
+libAPI WTChunkedDecoder::~WTChunkedDecoder()
+{
+	free(this->line);
+}
+
+libAPI bool WTChunkedDecoder::finished(void) const
+{
+	return (this->state == BODY_DONE);
+}
+
+libAPI bool WTChunkedDecoder::failed(void) const
+{
+	return (this->state == BODY_ERROR);
+}
+
+void WTChunkedDecoder::end_trailer_line(void)
+{
+	char *sep, *value;
+
+	if(this->trailers == NULL) return;
+
+	this->line[this->line_len] = '\0';
+	sep = strchr(this->line, ':');
+	if(sep == NULL) return;	// Not a field; ignore it like parse_http_headers
+
+	sep[0] = '\0';
+	value = sep + 1;
+	while(*value == ' ' || *value == '\t') value++;
+
+	this->trailers->set_copy(this->line, value);
+}
+
+libAPI size_t WTChunkedDecoder::decode(const char *in, size_t len, char *out,
+				       size_t *consumed)
+{
+	size_t next = 0, written = 0;
+
+	while(next < len && this->state != BODY_DONE && this->state != BODY_ERROR)
+	{
+		char c = in[next];
+
+		switch(this->state)
+		{
+		case CHUNK_SIZE:
+		{
+			int digit = hex_value(c);
+			if(digit >= 0)
+			{
+				if(this->remaining > (~static_cast<uint64_t>(0) >> 4))
+				{
+					this->state = BODY_ERROR;
+					break;
+				}
+				this->remaining = (this->remaining << 4) | digit;
+				this->have_digits = true;
+				next++;
+				break;
+			}
+
+			if(!this->have_digits)
+			{
+				this->state = BODY_ERROR;
+				break;
+			}
+
+			// Anything after the size (";ext=val", whitespace, the
+			// CR) is skipped up to the end of the line.
+			this->state = CHUNK_EXTENSION;
+			break;
+		}
+		case CHUNK_EXTENSION:
+		{
+			const char *lf = static_cast<const char *>(memchr(in + next, '\n', len - next));
+			if(lf == NULL)
+			{
+				next = len;
+				break;
+			}
+			next = (lf - in) + 1;
+
+			this->have_digits = false;
+			if(this->remaining == 0)
+			{
+				// Last chunk; trailers (if any) follow.
+				this->line_len = 0;
+				this->state = TRAILER_LINE;
+			} else {
+				this->state = CHUNK_DATA;
+			}
+			break;
+		}
+		case CHUNK_DATA:
+		{
+			size_t bytes = len - next;
+			if(bytes > this->remaining)
+				bytes = static_cast<size_t>(this->remaining);
+
+			if(out + written != in + next)
+				memmove(out + written, in + next, bytes);
+
+			written += bytes;
+			next += bytes;
+			this->remaining -= bytes;
+
+			if(this->remaining == 0) this->state = CHUNK_DATA_END;
+			break;
+		}
+		case CHUNK_DATA_END:
+			if(c == '\n')
+			{
+				this->state = CHUNK_SIZE;
+			}
+			else if(c != '\r')
+			{
+				this->state = BODY_ERROR;
+				break;
+			}
+			next++;
+			break;
+		case TRAILER_LINE:
+			next++;
+			if(c == '\r') break;
+
+			if(c == '\n')
+			{
+				if(this->line_len == 0)
+				{
+					this->state = BODY_DONE;
+					break;
+				}
+				end_trailer_line();
+				this->line_len = 0;
+				break;
+			}
+
+			if(this->line_len + 1 >= MAX_TRAILER_LINE)
+			{
+				this->state = BODY_ERROR;
+				break;
+			}
+
+			if(this->trailers != NULL)
+			{
+				if(this->line_len + 1 >= this->line_size)
+				{
+					this->line_size = (this->line_size == 0 ? 128 : this->line_size * 2);
+					this->line = static_cast<char *>(realloc(this->line, this->line_size));
+					if(this->line == NULL) alloc_error("HTTP trailer line", this->line_size);
+				}
+				this->line[this->line_len] = c;
+			}
+			this->line_len++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if(consumed != NULL) *consumed = next;
+
+	return written;
+}
@@ -0,0 +1,107 @@
+/*
+ * WTChunkedDecoder.h - interface for HTTP chunked transfer decoding
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBAMY_WTCHUNKEDDECODER_H__
+#define __LIBAMY_WTCHUNKEDDECODER_H__
+
+#include <libink/WTDictionary.h>	// trailers
+#include <Utility.h>			// libAPI
+#include <stdlib.h>			// size_t
+
+#ifndef WIN32
+#	include <stdint.h>
+#endif
+
+/*!
+	@class		WTChunkedDecoder
+	@brief		Incremental decoder for HTTP/1.1 chunked bodies.
+	@details	Input may be fed in pieces of any size; the decoder
+			keeps its place between calls.  Chunk extensions are
+			skipped, and trailer fields are stored in a dictionary
+			if one is given.
+
+			Payload is written to an output pointer which may be
+			the same as (or lag behind) the input, so a received
+			body can be de-chunked in place without allocating.
+ */
+class WTChunkedDecoder
+{
+public:
+	/*!
+	@brief		Initialise the decoder.
+	@param		trailers	A memory-managed dictionary to receive
+					any trailer fields, or NULL to discard
+					them.
+	 */
+	libAPI WTChunkedDecoder(WTDictionary *trailers = NULL);
+	libAPI ~WTChunkedDecoder();
+
+	/*!
+	@brief		Decode some chunked data.
+	@param		in		The chunked data. (In)
+	@param		len		The number of bytes at in. (In)
+	@param		out		Where to write payload bytes.  This
+					may be equal to in, or any address
+					before it in the same buffer. (Out)
+	@param		consumed	The number of input bytes used; this is
+					less than len only once the body has
+					ended or malformed input has been met,
+					and then stops at where that happened.
+					(Out, optional)
+	@result		The number of payload bytes written to out.
+	 */
+	libAPI size_t decode(const char *in, size_t len, char *out,
+			     size_t *consumed = NULL);
+
+	/*!
+	@brief		Determine whether the terminating chunk and trailers
+			have been read.
+	 */
+	libAPI bool finished(void) const;
+	/*!
+	@brief		Determine whether malformed input was encountered.
+	@note		Once failed, ::decode does nothing.
+	 */
+	libAPI bool failed(void) const;
+private:
+	enum DecodeState
+	{
+		CHUNK_SIZE,
+		CHUNK_EXTENSION,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		TRAILER_LINE,
+		BODY_DONE,
+		BODY_ERROR
+	};
+
+	/*! Where we are in the body */
+	DecodeState state;
+	/*! Payload bytes left in the current chunk (or its size, while
+	    CHUNK_SIZE is being parsed) */
+	uint64_t remaining;
+	/*! Whether any hex digits have been read for the current size */
+	bool have_digits;
+	/*! Where trailer fields go */
+	WTDictionary *trailers;
+	/*! The trailer line being collected */
+	char *line;
+	/*! The length of the collected trailer line */
+	size_t line_len;
+	/*! The size of the line buffer */
+	size_t line_size;
+
+	void end_trailer_line(void);
+
+	WTChunkedDecoder(const WTChunkedDecoder &);
+	WTChunkedDecoder &operator=(const WTChunkedDecoder &);
+};
+
+#endif /*!__LIBAMY_WTCHUNKEDDECODER_H__*/
@@ -0,0 +1,117 @@
+/*
+ * WTResponseBuffer.cpp - implementation of owned response body buffers
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "WTResponseBuffer.h"	// Self
+#include <string.h>		// memmove
+#include <stdlib.h>		// free
+
+libAPI WTResponseBuffer::WTResponseBuffer()
+{
+	this->buffer = NULL;
+	this->body_offset = 0;
+	this->body_length = 0;
+}
+
+libAPI WTResponseBuffer::WTResponseBuffer(char *_buffer, size_t offset, uint64_t length)
+{
+	this->buffer = NULL;
+	reset(_buffer, offset, length);
+}
+
+#if __cplusplus >= 201103L
+libAPI WTResponseBuffer::WTResponseBuffer(WTResponseBuffer &&other)
+{
+	this->buffer = NULL;
+	this->body_offset = 0;
+	this->body_length = 0;
+	swap(other);
+}
+
+libAPI WTResponseBuffer &WTResponseBuffer::operator=(WTResponseBuffer &&other)
+{
+	if(this != &other)
+	{
+		reset();
+		swap(other);
+	}
+	return *this;
+}
+#endif
+
+libAPI WTResponseBuffer::~WTResponseBuffer()
+{
+	free(this->buffer);
+}
+
+libAPI char *WTResponseBuffer::data(void) const
+{
+	if(this->buffer == NULL) return NULL;
+	return this->buffer + this->body_offset;
+}
+
+libAPI uint64_t WTResponseBuffer::length(void) const
+{
+	return this->body_length;
+}
+
+libAPI size_t WTResponseBuffer::offset(void) const
+{
+	return this->body_offset;
+}
+
+libAPI void WTResponseBuffer::reset(char *_buffer, size_t offset, uint64_t length)
+{
+	if(this->buffer != _buffer) free(this->buffer);
+
+	this->buffer = _buffer;
+	if(_buffer == NULL)
+	{
+		this->body_offset = 0;
+		this->body_length = 0;
+		return;
+	}
+
+	this->body_offset = offset;
+	this->body_length = length;
+	this->buffer[offset + length] = '\0';
+}
+
+libAPI void WTResponseBuffer::swap(WTResponseBuffer &other)
+{
+	char *temp_buffer = other.buffer;
+	size_t temp_offset = other.body_offset;
+	uint64_t temp_length = other.body_length;
+
+	other.buffer = this->buffer;
+	other.body_offset = this->body_offset;
+	other.body_length = this->body_length;
+
+	this->buffer = temp_buffer;
+	this->body_offset = temp_offset;
+	this->body_length = temp_length;
+}
+
+libAPI void *WTResponseBuffer::release(void)
+{
+	char *result = this->buffer;
+
+	if(result != NULL && this->body_offset != 0)
+	{
+		// Slide the body (and its NUL) down to the front of the buffer
+		// so that the caller can free() what we hand back.
+		memmove(result, result + this->body_offset, this->body_length + 1);
+	}
+
+	this->buffer = NULL;
+	this->body_offset = 0;
+	this->body_length = 0;
+
+	return static_cast<void *>(result);
+}
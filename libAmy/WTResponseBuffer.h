@@ -0,0 +1,111 @@
+/*
+ * WTResponseBuffer.h - interface for owned response body buffers
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (c) 2011 Wilcox Technologies, LLC. All rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBAMY_WTRESPONSEBUFFER_H__
+#define __LIBAMY_WTRESPONSEBUFFER_H__
+
+#include <Utility.h>	// libAPI
+#include <stdlib.h>	// size_t
+
+#ifndef WIN32
+#	include <stdint.h>
+#endif
+
+/*!
+	@class		WTResponseBuffer
+	@brief		Owns a received response and exposes its body.
+	@details	The buffer that a response was received into is handed
+			over as-is; the body is described by an offset and a
+			length into it, so no copy is made when the body is
+			given to the caller.
+
+			The body is always followed by a NUL byte, so text
+			bodies may be used directly as C strings.
+
+			This object cannot be copied.  Ownership may be moved
+			with ::swap (or move construction/assignment where the
+			compiler supports it).
+ */
+class WTResponseBuffer
+{
+public:
+	/*!
+	@brief		Create an empty response buffer.
+	 */
+	libAPI WTResponseBuffer();
+	/*!
+	@brief		Create a response buffer that owns a received buffer.
+	@param		buffer		The malloc()d buffer to take ownership
+					of.
+	@param		offset		The offset of the body in buffer.
+	@param		length		The length of the body, not including
+					the NUL terminator.
+	 */
+	libAPI WTResponseBuffer(char *buffer, size_t offset, uint64_t length);
+#if __cplusplus >= 201103L
+	libAPI WTResponseBuffer(WTResponseBuffer &&other);
+	libAPI WTResponseBuffer &operator=(WTResponseBuffer &&other);
+#endif
+	libAPI ~WTResponseBuffer();
+
+	/*!
+	@brief		Retrieve the body.
+	@result		A pointer to the (NUL-terminated) body, or NULL if this
+			buffer is empty.
+	 */
+	libAPI char *data(void) const;
+	/*!
+	@brief		Retrieve the length of the body.
+	@result		The length of the body, not including the NUL byte.
+	 */
+	libAPI uint64_t length(void) const;
+	/*!
+	@brief		Retrieve the offset of the body in the owned buffer.
+	 */
+	libAPI size_t offset(void) const;
+
+	/*!
+	@brief		Replace the owned buffer.
+	@details	The previously owned buffer (if any) is free()d.  The
+			body is NUL-terminated in place.
+	@param		buffer		The malloc()d buffer to take ownership
+					of, or NULL to empty this object.
+	@param		offset		The offset of the body in buffer.
+	@param		length		The length of the body.  buffer must
+					have room for a NUL at offset+length.
+	 */
+	libAPI void reset(char *buffer = NULL, size_t offset = 0, uint64_t length = 0);
+	/*!
+	@brief		Exchange contents with another response buffer.
+	 */
+	libAPI void swap(WTResponseBuffer &other);
+	/*!
+	@brief		Give up ownership of the body.
+	@result		A pointer to the NUL-terminated body which must be
+			free()d by the caller, or NULL if this buffer is empty.
+	@note		If the body does not start at the beginning of the
+			owned buffer, it is moved down in place; no further
+			memory is allocated.  This exists for the pointer-based
+			download/upload API; prefer ::data where possible.
+	 */
+	libAPI void *release(void);
+private:
+	/*! The owned buffer */
+	char *buffer;
+	/*! Where the body starts in buffer */
+	size_t body_offset;
+	/*! The length of the body */
+	uint64_t body_length;
+
+	WTResponseBuffer(const WTResponseBuffer &);
+	WTResponseBuffer &operator=(const WTResponseBuffer &);
+};
+
+#endif /*!__LIBAMY_WTRESPONSEBUFFER_H__*/
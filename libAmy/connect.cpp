@@ -305,14 +305,25 @@ bool WTConnection::connect(const char *url)
 }
 
 void * WTConnection::download(uint64_t *length)
+{
+	WTResponseBuffer response;
+	
+	if(!this->download(&response))
+		return NULL;
+	
+	*length = response.length();
+	return response.release();
+}
+
+bool WTConnection::download(WTResponseBuffer *response)
 {
 	if(strcmp("http", this->protocol) == 0 || strcmp("https", this->protocol) == 0)
 	{
-		return download_http(length);
+		return download_http(response);
 	} else {
 		last_error = "Unimplemented upload for selected protocol";
 		delegate_status(WTHTTP_Error);
-		return NULL;
+		return false;
 	};
 }
 
@@ -322,24 +333,68 @@ size_t WTConnection::download_to(const char *filename)
 }
 
 void *WTConnection::upload(const void *data, uint64_t *length)
+{
+	WTResponseBuffer response;
+	
+	if(!this->upload(data, *length, &response))
+		return NULL;
+	
+	*length = response.length();
+	return response.release();
+}
+
+bool WTConnection::upload(const void *data, uint64_t length, WTResponseBuffer *response)
 {
 	if(strcmp("http", this->protocol) == 0 || strcmp("https", this->protocol) == 0)
 	{
-		return upload_http(data, length);
+		return upload_http(data, length, response);
 	} else {
 		last_error = "Unimplemented upload for selected protocol";
 		delegate_status(WTHTTP_Error);
-		return NULL;
+		return false;
+	};
+}
+
+bool WTConnection::upload(WTBodySource *body, WTResponseBuffer *response)
+{
+	if(strcmp("http", this->protocol) == 0 || strcmp("https", this->protocol) == 0)
+	{
+		return stream_internal_http("POST", body, response);
+	} else {
+		last_error = "Unimplemented upload for selected protocol";
+		delegate_status(WTHTTP_Error);
+		return false;
 	};
 }
 
 void *WTConnection::store(const void *data, uint64_t *length)
+{
+	WTResponseBuffer response;
+	
+	if(!this->store(data, *length, &response))
+		return NULL;
+	
+	*length = response.length();
+	return response.release();
+}
+
+bool WTConnection::store(const void *data, uint64_t length, WTResponseBuffer *response)
 {
 	if(strcmp("http", this->protocol) == 0 || strcmp("https", this->protocol) == 0)
 	{
-		return put_http(data, length);
+		return put_http(data, length, response);
 	} else {
-		return upload(data, length);
+		return upload(data, length, response);
+	};
+}
+
+bool WTConnection::store(WTBodySource *body, WTResponseBuffer *response)
+{
+	if(strcmp("http", this->protocol) == 0 || strcmp("https", this->protocol) == 0)
+	{
+		return stream_internal_http("PUT", body, response);
+	} else {
+		return upload(body, response);
 	};
 }
 
@@ -402,6 +457,11 @@ const char *WTConnection::get_last_error(void)
 	return this->last_error;
 }
 
+uint16_t WTConnection::get_last_status(void)
+{
+	return this->last_status;
+}
+
 WTConnection::WTConnection(WTConnDelegate *_delegate)
 {
 	this->connected = this->connecting = false;
@@ -415,6 +475,7 @@ WTConnection::WTConnection(WTConnDelegate *_delegate)
 	addr_info = NULL;
 	uri	= NULL;
 	last_error = NULL;
+	last_status = 0;
 	query_string = NULL;
 
 #ifndef NO_SSL
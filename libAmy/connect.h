@@ -42,6 +42,8 @@ int getaddrinfo(const char *, const char *, const struct addrinfo *, struct addr
 #endif
 
 #include "WTConnDelegate.h"
+#include "WTResponseBuffer.h"
+#include "WTBodySource.h"
 #include <libink/WTDictionary.h>
 #include <Utility.h>
 
@@ -106,6 +108,15 @@ public:
 	 */
 	libAPI virtual void * download(uint64_t *length);
 	/*!
+	@brief		Download from the URL connected to, without copying.
+	@param		response	Receives the response body. (Out)
+	@result		true if a response was received; false otherwise.
+	@note		The body is handed over in the buffer it was received
+			into; prefer this to the pointer-returning variant for
+			large bodies.
+	 */
+	libAPI virtual bool download(WTResponseBuffer *response);
+	/*!
 	@brief		Download from the connected URL to a file.
 	@param		filename	The name of the file to write. (In)
 	@result		The number of bytes written to the file.
@@ -118,6 +129,27 @@ public:
 	 */
 	libAPI virtual void * upload(const void *data, uint64_t *length);
 	/*!
+	@brief		Upload data to the URL connected to, without copying
+			the response.
+	@param		data		The data to upload. (In)
+	@param		length		The length of the data. (In)
+	@param		response	Receives the response body. (Out)
+	@result		true if a response was received; false otherwise.
+	 */
+	libAPI virtual bool upload(const void *data, uint64_t length,
+				   WTResponseBuffer *response);
+	/*!
+	@brief		Upload a body to the URL connected to as it is
+			produced.
+	@param		body		The source of the body. (In)
+	@param		response	Receives the response body. (Out)
+	@result		true if a response was received; false otherwise.
+	@note		Only one block of the body is held in memory at a
+			time.  If its length isn't known in advance, it is
+			sent with chunked transfer encoding.
+	 */
+	libAPI virtual bool upload(WTBodySource *body, WTResponseBuffer *response);
+	/*!
 	@brief		Store data to the URL connected to.
 	@param		data	The data to put. (In)
 	@param		lenth	The length of the result. (In/Out)
@@ -125,6 +157,26 @@ public:
 			uses the PUT verb instead of the POST verb.
 	 */
 	libAPI virtual void * store(const void *data, uint64_t *length);
+	/*!
+	@brief		Store data to the URL connected to, without copying
+			the response.
+	@param		data		The data to put. (In)
+	@param		length		The length of the data. (In)
+	@param		response	Receives the response body. (Out)
+	@result		true if a response was received; false otherwise.
+	 */
+	libAPI virtual bool store(const void *data, uint64_t length,
+				  WTResponseBuffer *response);
+	/*!
+	@brief		Store a body to the URL connected to as it is
+			produced.
+	@param		body		The source of the body. (In)
+	@param		response	Receives the response body. (Out)
+	@result		true if a response was received; false otherwise.
+	@notes		This is to upload(WTBodySource *, WTResponseBuffer *)
+			what store(const void *, ...) is to upload().
+	 */
+	libAPI virtual bool store(WTBodySource *body, WTResponseBuffer *response);
 
 	/*!
 	@brief		Set a header (HTTP only).
@@ -142,6 +194,12 @@ public:
 			have occurred during this object's lifetime.
 	 */
 	libAPI const char *get_last_error(void);
+	/*!
+	@brief		Retrieve the status code of the last response.
+	@result		The HTTP status code, or 0 if no response has been
+			received (or the protocol doesn't have them).
+	 */
+	libAPI uint16_t get_last_status(void);
 protected:
 	/*! Whether the connection is active */
 	bool connected;
@@ -175,6 +233,8 @@ protected:
 	char *query_string;
 	/*! The internal storage for errors */
 	const char *last_error;
+	/*! The status code of the last response */
+	uint16_t last_status;
 private:
 	/*!
 	@brief		Parse a URL string into its respective bits.
@@ -185,10 +245,15 @@ private:
 	
 	bool connect_https(void);
 	
-	void *upload_http(const void *data, uint64_t *length);
-	void *download_http(uint64_t *length);
-	void *put_http(const void *data, uint64_t *length);
-	void *upload_internal_http(const char *verb, const void *data, uint64_t *length);
+	bool upload_http(const void *data, uint64_t length, WTResponseBuffer *response);
+	bool download_http(WTResponseBuffer *response);
+	bool put_http(const void *data, uint64_t length, WTResponseBuffer *response);
+	bool upload_internal_http(const char *verb, const void *data, uint64_t length, WTResponseBuffer *response);
+	bool stream_internal_http(const char *verb, WTBodySource *body, WTResponseBuffer *response);
+	bool splice_http(WTBodySource *body, int *pipe_fds, uint64_t length, uint64_t *total);
+	bool send_http(const char *data, size_t *length, bool is_ssl);
+	bool send_head_http(const char *verb, uint64_t length, bool is_ssl);
+	bool receive_http(bool is_ssl, WTResponseBuffer *response);
 };
 
 #endif /*!__LIBAMY_CONNECT_H__*/
@@ -9,11 +9,23 @@
  */
 
 #include "connect.h"
+#include "WTChunkedDecoder.h"
 #include <libink/WTDictionary.h>
 #include <Utility.h>
 #include <assert.h>
 
+#ifdef WTBODY_HAVE_SPLICE
+#	include <fcntl.h>	// splice
+#	include <unistd.h>	// pipe, close
+#endif
+
 #define HTTP_BLOCK_SIZE 512
+/* Streamed bodies are sent this much at a time */
+#define HTTP_UPLOAD_BLOCK_SIZE 16384
+/* Room for a chunk's size line: its length in hex, and CRLF */
+#define HTTP_CHUNK_PREFIX 10
+/* Spliced bodies are moved this much at a time (a pipe's usual capacity) */
+#define HTTP_SPLICE_SIZE 65536
 
 #ifndef NO_SSL
 #	define SET_THE_ERROR \
@@ -48,8 +60,6 @@ void parse_http_headers(const char *http_response,
 	
 	while(1)
 	{
-		char *name = NULL;
-		char *value = NULL;
 		const char *sep = NULL;
 		const char *space = NULL;
 		size_t name_size, value_size;
@@ -95,22 +105,11 @@ void parse_http_headers(const char *http_response,
 		if(space == NULL) space = sep + 1;
 		
 		name_size = (sep - buffer);
-		name = static_cast<char *>(calloc(name_size + 1, 1));
-		if(name == NULL)
-			alloc_error("Header name", (name_size));
 		value_size = (header_length - (space + 1 /* no space */ - buffer));
-		value = static_cast<char *>(calloc(value_size + 1, 1));
-		if(value == NULL)
-			alloc_error("Header value", (value_size));
-		
-		strncpy(name, buffer, name_size);
-		name[name_size] = '\0';
-		strncpy(value, space + 1 /* no space */, value_size);
-		value[value_size] = '\0';
 		
-		(*(header_container))->set(name, value);
-		
-		free(name);
+		// Copied straight out of the response; no temporaries needed
+		(*(header_container))->set_copy(buffer, name_size,
+						space + 1 /* no space */, value_size);
 		
 		buffer += header_length;
 	};
@@ -118,88 +117,71 @@ void parse_http_headers(const char *http_response,
 	return;
 }
 
-void *parse_http_response(const char *resp, uint16_t *http_code, uint64_t *length)
+/*
+ * Takes ownership of resp, which must be resp_len bytes long with a NUL at
+ * resp[resp_len].  Unless the body needs decoding, it is left where it is
+ * and handed to body as an offset into resp.
+ */
+bool parse_http_response(char *resp, uint64_t resp_len, uint16_t *http_code,
+			 WTResponseBuffer *body)
 {
 	WTDictionary *headers;
 	int start_of_data = 0;
-	char *return_buffer = NULL;
 	const char *content_length = NULL;
 	
 	if(resp == NULL)
 	{
-		return NULL;
+		return false;
 	};
 	
-	headers = new WTDictionary;
+	// These only live as long as this call, so they go in one arena.
+	headers = new WTDictionary(true, WTDICT_OPT_HASHED | WTDICT_OPT_ARENA |
+				   WTDICT_OPT_UNLOCKED);
 	parse_http_headers(resp, &headers, http_code, &start_of_data);
 	content_length = static_cast<const char *>(headers->get("Content-Length"));
 	if(content_length == NULL)
 	{
 		const char *encoding = static_cast<const char *>(headers->get("Transfer-Encoding"));
-		if(encoding != NULL && strcmp(encoding, "chunked\r\n") == 0)
+		if(encoding != NULL && strstr(encoding, "chunked") != NULL)
 		{
-			uint64_t total_size = 0;
-			
-			resp += start_of_data;
-			
-			while(true)
-			{
-				uint32_t octet_off = strcspn(resp, "\n\0");
-				const_cast<char *>(resp)[octet_off] = '\0';
-				uint64_t octets = strtol(resp, NULL, 16);
-				if(octets == 0) break; // End of transfer
-				
-				// XXX Platform Dependent
-				// Yes Elizabeth, I really am that anal.
-				uint64_t bytes = octets;
-				
-				total_size += bytes;
-				
-				return_buffer = static_cast<char *>(realloc(return_buffer, sizeof(char) * total_size));
-				if(return_buffer == NULL)
-				{
-					free(return_buffer);
-					alloc_error("HTTP chunked buffer", total_size);
-				}
-				
-				memcpy(return_buffer + (total_size - bytes), resp + octet_off + 1, bytes);
-				
-				resp += (octet_off /* offset */ + 1 /*padding*/ + bytes/* skip what we copied */ + 2/* \r\n to separate */);
-			};
+			// De-chunk in place: the payload never grows, so it is
+			// compacted down over the chunk framing as we go.
+			WTChunkedDecoder dechunker(headers);
+			char *chunks = resp + start_of_data;
+			uint64_t total_size;
 			
-			return_buffer = static_cast<char *>(realloc(return_buffer, sizeof(char) * ++total_size));
-			if(return_buffer == NULL) alloc_error("HTTP response buffer", total_size);
-			return_buffer[total_size - 1] = '\0';
+			total_size = dechunker.decode(chunks, resp_len - start_of_data, chunks);
+			if(!dechunker.finished())
+				warning_error("chunked HTTP response ended early or was malformed");
 			
-			*length = total_size;
+			body->reset(resp, start_of_data, total_size);
 		}
 		else
 		{
-			resp += start_of_data;
-			*length = strlen(resp) + 1;
-			return_buffer = static_cast<char *>(calloc(*length, sizeof(char)));
-			if(return_buffer == NULL) alloc_error("HTTP response buffer", *length);
-			memcpy(return_buffer, resp, *length);
+			// Read until close; the body is the rest of what we got.
+			body->reset(resp, start_of_data, resp_len - start_of_data);
 		};
 	}
 	else
 	{
-		*length = strtol(content_length, NULL, 10);
-		return_buffer = static_cast<char *>(calloc(*length + 1, sizeof(char)));
-		if(return_buffer == NULL) alloc_error("HTTP response buffer", *length);
-		memcpy(return_buffer, resp + start_of_data, *length);
-		return_buffer[*length] = '\0';
+		uint64_t length = strtol(content_length, NULL, 10);
+		
+		// Don't trust the server further than the bytes it sent
+		if(length > resp_len - start_of_data)
+			length = resp_len - start_of_data;
+		
+		body->reset(resp, start_of_data, length);
 	};
 	
 	delete headers;
-	return static_cast<void *>(return_buffer);
+	return true;
 }
 
 void WTConnection::http_header(const char *header, char *data)
 {
 	if(this->headers == NULL)
 	{
-		this->headers = new WTDictionary;
+		this->headers = new WTDictionary(true, WTDICT_OPT_HASHED);
 	};
 	
 	this->headers->set(header, data);
@@ -274,13 +256,13 @@ bool WTConnection::connect_https(void)
 #endif
 }
 
-void *WTConnection::download_http(uint64_t *length)
+bool WTConnection::download_http(WTResponseBuffer *ret)
 {
-	char *request = NULL, *header_str = NULL, *response = NULL;
+	char *request = NULL;
 	size_t size_of_req = 0, req_sent = 0;
-	WTSizedBuffer *header_buff;
 	bool is_ssl, did_send;
 	
+	this->last_status = 0;
 	if(strcmp("https", this->protocol) == 0) is_ssl = true;
 	else is_ssl = false;
 	
@@ -288,13 +270,13 @@ void *WTConnection::download_http(uint64_t *length)
 	if(is_ssl)
 	{
 		fprintf(stderr, "BUG: SSL/TLS disabled (you shouldn't even be connected).\n");
-		return NULL;
+		return false;
 	}
 #endif
 	
 	if(this->headers == NULL)
 	{
-		this->headers = new WTDictionary;
+		this->headers = new WTDictionary(true, WTDICT_OPT_HASHED);
 	};
 		if(this->headers->get("User-Agent") == NULL)
 	{
@@ -316,24 +298,23 @@ void *WTConnection::download_http(uint64_t *length)
 		fprintf(stderr, "WTConnection: download before connect!  (order error)\n");
 		last_error = "You must be connected to download data.";
 		delegate_status(WTHTTP_Error);
-		return NULL;
+		return false;
 	};
 	
-	header_buff = this->headers->all();
-	header_str = header_buff->buffer;
-	
-	size_of_req = ( (15 /* GET  HTTP/1.1\r\n */
+	// The headers are written straight into the request, so size it exactly.
+	size_of_req = ( (13 /* GET  HTTP/1.1 */
 			 + strlen(this->uri)
-			 + (header_buff->buffer_len) /* All headers */
-			 + (this->headers->count() * 2) /* \r\n for each header */
-			 + 4 /* \r\n for end of headers */) * sizeof(char));
+			 + this->headers->allInto(NULL, 0) /* All headers */
+			 + 4 /* \r\n\r\n for end of headers */
+			 + 1 /* \0 */) * sizeof(char));
 	
 	request = static_cast<char *>(malloc(size_of_req));
 	if(request == NULL)
 		alloc_error("request buffer", size_of_req);
 	
-	req_sent = snprintf(request, size_of_req, "GET %s HTTP/1.1%s\r\n\r\n", this->uri, header_str);
-	WTSizedBufferFree(header_buff);
+	req_sent = snprintf(request, size_of_req, "GET %s HTTP/1.1", this->uri);
+	req_sent += this->headers->allInto(request + req_sent, size_of_req - req_sent);
+	req_sent += snprintf(request + req_sent, size_of_req - req_sent, "\r\n\r\n");
 	
 	delegate_status(WTHTTP_Transferring);
 #ifndef NO_SSL
@@ -354,96 +335,241 @@ void *WTConnection::download_http(uint64_t *length)
 		SET_THE_ERROR
 		
 		delegate_status(WTHTTP_Error);
-		return NULL;
+		return false;
 	};
 	
-	uint64_t total = 0;
+	return receive_http(is_ssl, ret);
+}
+
+bool WTConnection::upload_http(const void *data, uint64_t length, WTResponseBuffer *ret)
+{
+	return upload_internal_http("POST", data, length, ret);
+}
+
+bool WTConnection::put_http(const void *data, uint64_t length, WTResponseBuffer *ret)
+{
+	return upload_internal_http("PUT", data, length, ret);
+}
+
+bool WTConnection::upload_internal_http(const char *verb, const void *data, uint64_t length, WTResponseBuffer *ret)
+{
+	size_t data_sent = length;
+	bool is_ssl = (strcmp("https", this->protocol) == 0);
 	
-	while(1)
+	if(!send_head_http(verb, length, is_ssl)) return false;
+	
+	if(!send_http(static_cast<const char *>(data), &data_sent, is_ssl))
 	{
-		response = static_cast<char *>(realloc(response, total+HTTP_BLOCK_SIZE));
-		if(response == NULL) alloc_error("HTTP response buffer", total+HTTP_BLOCK_SIZE);
-		int read;
+		fprintf(stderr, "Sent %lu of %llu payload\n",
+			static_cast<long int>(data_sent), length);
 		
-#ifndef NO_SSL
-		if (is_ssl)
+		SET_THE_ERROR
+		
+		delegate_status(WTHTTP_Error);
+		return false;
+	};
+	
+	return receive_http(is_ssl, ret);
+}
+
+bool WTConnection::stream_internal_http(const char *verb, WTBodySource *body, WTResponseBuffer *ret)
+{
+	uint64_t length = body->length(), total = 0;
+	bool chunked = (length == WTBODY_LENGTH_UNKNOWN);
+	bool is_ssl = (strcmp("https", this->protocol) == 0);
+	char *block;
+	size_t used, to_send;
+	int pipe_fds[2] = { -1, -1 };
+	
+	if(!send_head_http(verb, length, is_ssl)) return false;
+	
+	block = static_cast<char *>(malloc(HTTP_UPLOAD_BLOCK_SIZE));
+	if(block == NULL) alloc_error("HTTP upload block", HTTP_UPLOAD_BLOCK_SIZE);
+	
+	// Chunks are framed in place: the body is read in after room for the
+	// size line, and the trailing CRLF goes after it, so each chunk is
+	// sent with one write.
+	char *data = block + (chunked ? HTTP_CHUNK_PREFIX : 0);
+	size_t space = HTTP_UPLOAD_BLOCK_SIZE - (chunked ? HTTP_CHUNK_PREFIX + 2 : 0);
+	
+	while(1)
+	{
+#ifdef WTBODY_HAVE_SPLICE
+		// Data that's already in a descriptor goes straight to the
+		// socket.  TLS has to encrypt it, so it can't be spliced there.
+		if(!is_ssl && body->can_splice())
 		{
-			read = BIO_read(this->ssl_socket, (response+total), HTTP_BLOCK_SIZE);
-		} else {
-#endif
-			read = recv(this->socket, (response+total), HTTP_BLOCK_SIZE, 0);
-#ifndef NO_SSL
-		}
+			if(!splice_http(body, pipe_fds, length, &total)) break;
+			continue;
+		};
 #endif
 		
-		if(read < 0)
+		if(!body->read(data, space, &used))
 		{
-			SET_THE_ERROR
-			
-			free(response);
+			last_error = "The request body could not be produced.";
+			break;
+		};
+		
+		char *start = data;
+		to_send = used;
+		if(chunked)
+		{
+			char size_line[HTTP_CHUNK_PREFIX + 1];
+			int prefix = snprintf(size_line, sizeof(size_line), "%lx\r\n",
+					      static_cast<unsigned long>(used));
 			
-			delegate_status(WTHTTP_Error);
-			return NULL;
+			start -= prefix;
+			memcpy(start, size_line, prefix);
+			// The last chunk is empty, with a blank line after it
+			memcpy(data + used, "\r\n", 2);
+			to_send += prefix + 2;
+		}
+		else if(used > length - total)
+		{
+			last_error = "The request body was longer than it claimed to be.";
+			break;
 		};
-		if(read == 0)
+		
+		total += used;
+		if(to_send > 0 && !send_http(start, &to_send, is_ssl))
 		{
-			// closed
-			response[total] = '\0';
+			SET_THE_ERROR
 			break;
 		};
-		total += read;
+		
+		if(used == 0)
+		{
+			if(!chunked && total != length)
+			{
+				last_error = "The request body was shorter than it claimed to be.";
+				break;
+			};
+			
+			free(block);
+#ifdef WTBODY_HAVE_SPLICE
+			if(pipe_fds[0] != -1)
+			{
+				close(pipe_fds[0]);
+				close(pipe_fds[1]);
+			};
+#endif
+			return receive_http(is_ssl, ret);
+		};
 	};
-	uint16_t http_code = 0;
-	void *ret = parse_http_response(response, &http_code, length);
-	// TODO: Deal with 3xx codes
-	if(http_code >= 400)
-	{
-		last_error = "Please try again later.";
-		delegate_status(WTHTTP_Error);
-	}
-	else
+	
+	// The server is still waiting for the rest of the body, so the
+	// connection can't be used again.
+	fprintf(stderr, "Sent %llu bytes of the body: %s\n",
+		static_cast<unsigned long long>(total), last_error);
+	free(block);
+#ifdef WTBODY_HAVE_SPLICE
+	if(pipe_fds[0] != -1)
 	{
-		delegate_status(WTHTTP_Finished);
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
 	};
-	free(response);
-	return ret;
+#endif
+	delegate_status(WTHTTP_Error);
+	return false;
 }
 
-void *WTConnection::upload_http(const void *data, uint64_t *length)
+bool WTConnection::splice_http(WTBodySource *body, int *pipe_fds, uint64_t length, uint64_t *total)
 {
-	return upload_internal_http("POST", data, length);
+#ifdef WTBODY_HAVE_SPLICE
+	bool chunked = (length == WTBODY_LENGTH_UNKNOWN);
+	size_t moved, framing;
+	ssize_t sent;
+	
+	if(pipe_fds[0] == -1 && pipe(pipe_fds) != 0)
+	{
+		last_error = strerror(errno);
+		pipe_fds[0] = -1;
+		return false;
+	};
+	
+	// The body goes into the pipe first, so how much there is to frame
+	// as a chunk is known before any of it is sent.
+	if(!body->splice_to(pipe_fds[1], HTTP_SPLICE_SIZE, &moved))
+	{
+		last_error = "The request body could not be produced.";
+		return false;
+	};
+	if(moved == 0) return true;
+	
+	if(chunked)
+	{
+		char size_line[HTTP_CHUNK_PREFIX + 1];
+		framing = snprintf(size_line, sizeof(size_line), "%lx\r\n",
+				   static_cast<unsigned long>(moved));
+		if(!send_http(size_line, &framing, false))
+		{
+			last_error = strerror(errno);
+			return false;
+		};
+	}
+	else if(moved > length - *total)
+	{
+		last_error = "The request body was longer than it claimed to be.";
+		return false;
+	};
+	
+	*total += moved;
+	while(moved > 0)
+	{
+		sent = splice(pipe_fds[0], NULL, this->socket, NULL, moved,
+			      SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(sent < 0 && errno == EINTR) continue;
+		if(sent <= 0)
+		{
+			last_error = strerror(errno);
+			return false;
+		};
+		moved -= sent;
+	};
+	
+	framing = 2;
+	if(chunked && !send_http("\r\n", &framing, false))
+	{
+		last_error = strerror(errno);
+		return false;
+	};
+	
+	return true;
+#else
+	last_error = "This system can't splice request bodies.";
+	return false;
+#endif
 }
 
-void *WTConnection::put_http(const void *data, uint64_t *length)
+bool WTConnection::send_http(const char *data, size_t *length, bool is_ssl)
 {
-	return upload_internal_http("PUT", data, length);
+#ifndef NO_SSL
+	if(is_ssl) return sendall_ssl(this->ssl_socket, data, length);
+#endif
+	return sendall(this->socket, data, length);
 }
 
-void *WTConnection::upload_internal_http(const char *verb, const void *data, uint64_t *length)
+bool WTConnection::send_head_http(const char *verb, uint64_t length, bool is_ssl)
 {
 	size_t size_of_initial;
 	char str_size_of_data[64];		// XXX magic number
-	size_t data_sent, initial_sent;
-	char *initial_crap, *response = NULL;
-	char *header_str;
-	WTSizedBuffer *header_buff;
-	bool sent_initial, sent_data;
-	bool is_ssl;
+	size_t initial_sent;
+	char *initial_crap;
+	bool sent_initial;
 	
-	if(strcmp("https", this->protocol) == 0) is_ssl = true;
-	else is_ssl = false;
+	this->last_status = 0;
 	
 #ifdef NO_SSL
 	if(is_ssl)
 	{
 		fprintf(stderr, "BUG: SSL/TLS disabled (you shouldn't even be connected).\n");
-		return NULL;
+		return false;
 	}
 #endif
 	
 	if(this->headers == NULL)
 	{
-		this->headers = new WTDictionary;
+		this->headers = new WTDictionary(true, WTDICT_OPT_HASHED);
 	};
 	
 	if(this->headers->get("User-Agent") == NULL)
@@ -468,72 +594,68 @@ void *WTConnection::upload_internal_http(const char *verb, const void *data, uin
 		fprintf(stderr, "WTConnection: upload before connect!  (order error)\n");
 		last_error = "You must be connected to upload data.";
 		delegate_status(WTHTTP_Error);
-		return NULL;
+		return false;
 	};
 	
-	data_sent = *length;
-	
-	snprintf(str_size_of_data, sizeof(str_size_of_data) - 1,
-		 "%llu", *length);
-	
-	header_buff = this->headers->all();
-	header_str = header_buff->buffer;
+	if(length == WTBODY_LENGTH_UNKNOWN)
+	{
+		snprintf(str_size_of_data, sizeof(str_size_of_data),
+			 "Transfer-Encoding: chunked");
+	} else {
+		snprintf(str_size_of_data, sizeof(str_size_of_data),
+			 "Content-Length: %llu", static_cast<unsigned long long>(length));
+	};
 	
-	size_of_initial = ( (16 /* POST  HTTP/1.1\r\n */
+	size_of_initial = ( (strlen(verb)
+			     + 10 /* "  HTTP/1.1" */
 			     + strlen(this->uri)
-			     + 16 /*strlen("Content-length: ") */
+			     + this->headers->allInto(NULL, 0) /* All headers */
+			     + 2 /* \r\n */
 			     + strlen(str_size_of_data)
-			     + header_buff->buffer_len /* All headers */
-			     + (this->headers->count() * 2) /* \r\n for each header */
-			     + 2 /* \r\n for end of headers */
-			     + 2 /* \r\n for beginning of data */) * sizeof(char));
+			     + 4 /* \r\n\r\n for end of headers */
+			     + 1 /* \0 */) * sizeof(char));
 	
 	initial_crap = static_cast<char *>(malloc(size_of_initial));
 	if(initial_crap == NULL)
 		alloc_error("initial headers", size_of_initial);
 	
 	initial_sent = snprintf(initial_crap, size_of_initial,
-		 "%s %s HTTP/1.1%s\r\nContent-Length: %s\r\n\r\n",
-		 verb, this->uri, header_str, str_size_of_data);
-		
-	WTSizedBufferFree(header_buff);
+		 "%s %s HTTP/1.1", verb, this->uri);
+	initial_sent += this->headers->allInto(initial_crap + initial_sent,
+					       size_of_initial - initial_sent);
+	initial_sent += snprintf(initial_crap + initial_sent,
+				 size_of_initial - initial_sent,
+				 "\r\n%s\r\n\r\n", str_size_of_data);
 
 	delegate_status(WTHTTP_Transferring);
 	
-#ifndef NO_SSL
-	if(is_ssl)
-	{
-		sent_initial = sendall_ssl(this->ssl_socket, initial_crap, &initial_sent);
-		if(sent_initial > 0) sent_data = sendall_ssl(this->ssl_socket, static_cast<const char *>(data), &data_sent);
-	} else {
-#endif
-		sent_initial = sendall(this->socket, initial_crap, &initial_sent);
-		if(sent_initial > 0) sent_data = sendall(this->socket, static_cast<const char *>(data), &data_sent);
-#ifndef NO_SSL
-	}
-#endif
+	sent_initial = send_http(initial_crap, &initial_sent, is_ssl);
 	
 	free(initial_crap);
 	
-	if(!sent_initial || !sent_data)
+	if(!sent_initial)
 	{
-		fprintf(stderr, "Sent %lu of %lu initial bytes, and %lu of %llu payload\n",
-			static_cast<long int>(initial_sent), static_cast<long int>(size_of_initial),
-			static_cast<long int>(data_sent), *length);
-		
-		free(response);
+		fprintf(stderr, "Sent %lu of %lu initial bytes\n",
+			static_cast<long int>(initial_sent), static_cast<long int>(size_of_initial));
 		
 		SET_THE_ERROR
 		
 		delegate_status(WTHTTP_Error);
-		return NULL;
+		return false;
 	};
 	
+	return true;
+}
+
+bool WTConnection::receive_http(bool is_ssl, WTResponseBuffer *ret)
+{
+	char *response = NULL;
 	uint64_t total = 0;
 	
 	while(1)
 	{
 		response = static_cast<char *>(realloc(response, total+HTTP_BLOCK_SIZE));
+		if(response == NULL) alloc_error("HTTP response buffer", total+HTTP_BLOCK_SIZE);
 		int read;
 		
 #ifndef NO_SSL
@@ -558,13 +680,13 @@ void *WTConnection::upload_internal_http(const char *verb, const void *data, uin
 				// cancelled, this is normal
 				last_error = "User cancelled operation.";
 				delegate_status(WTHTTP_Cancelled);
-				return NULL;
+				return false;
 			};
 			
 			SET_THE_ERROR
 			
 			delegate_status(WTHTTP_Error);
-			return NULL;
+			return false;
 		};
 		if(read == 0)
 		{
@@ -576,7 +698,9 @@ void *WTConnection::upload_internal_http(const char *verb, const void *data, uin
 	};
 	
 	uint16_t http_code = 0;
-	void *ret = parse_http_response(response, &http_code, length);
+	// parse_http_response owns response from here on
+	bool parsed = parse_http_response(response, total, &http_code, ret);
+	this->last_status = http_code;
 	// TODO: Deal with 3xx codes
 	if(http_code >= 400)
 	{
@@ -587,6 +711,5 @@ void *WTConnection::upload_internal_http(const char *verb, const void *data, uin
 	{
 		delegate_status(WTHTTP_Finished);
 	};
-	free(response);
-	return ret;
+	return parsed;
 }
@@ -9,7 +9,7 @@
  */
 
 #include "WTMIMEEncoder.h"	// Self
-#include <b64/encode.h>		// Encode to base64
+#include <libink/WTBase64.h>	// Encode to base64
 #include <errno.h>		// errno
 
 #ifndef _WIN32
@@ -27,6 +27,27 @@
 #	warning hostname code will probably not be functional
 #endif
 
+#if !defined(_WIN32) && !defined(__MWERKS__)
+#	include <sys/mman.h>	// mmap, madvise
+#	include <sys/stat.h>	// fstat
+#	define WTMIME_MMAP
+#	define wt_ftell ftello
+#	define wt_fseek fseeko
+#else
+#	define wt_ftell ftell
+#	define wt_fseek fseek
+#endif
+
+#ifndef _WIN32
+#	include <sys/socket.h>	// recv
+#else
+#	include <winsock2.h>	// recv
+#endif
+
+#ifdef WTBODY_HAVE_SPLICE
+#	include <fcntl.h>	// splice
+#endif
+
 
 // "BUT WAIT, awilcox@," you say.  "THERE'S A STATIC VAR, THIS METHOD IS
 // NOT THREAD-SAFE!"  Actually, curr_message is only used to generate a
@@ -69,27 +90,230 @@ char *hostname(void)
 }
 
 
-char *WTMIMEEncoder::_mimeify_data(const void *data, size_t len)
+char *WTMIMEEncoder::_new_boundary(void)
 {
-	size_t written = 0;
-	// We want to be absolutely safe with the length.  This is the max.
-	char *result = static_cast<char *>(calloc(len*2, sizeof(char)));
-	if(result == NULL) alloc_error("MIME attachment encoding buffer", len*2);
-	base64::encoder b64encoder;
+	// This is where we generate our shiny unique ID.
+	char *boundary = NULL;
 	
-	// Encode len bytes of data to result using base64, and return result.
-	written = b64encoder.encode(static_cast<const char *>(data), len, result);
-	b64encoder.encode_end(result+written);
-	return result;
+	// Grab the hostname
+	char *host = hostname();
+	// Set it to something witty and NetBSD-like if we don't have one
+	if(host == NULL) host = strdup("amnesiac");
+	
+	asprintf(&boundary, "%llu.%u.%lu@%s",
+		 ++curr_message, getpid(), time(NULL), host);
+	
+	free(host);
+	if(boundary == NULL) alloc_error("Unique message ID", 1);
+	
+	return boundary;
+}
+
+
+/*
+ * Find where a file attachment's data starts and how long it is.  Without a
+ * length in the attachment, the data runs to the end of the file; if the file
+ * can't seek (it's a pipe, say) the length is WTBODY_LENGTH_UNKNOWN.
+ */
+static void file_extent(WTMIMEAttachment *attach, uint64_t *start,
+			uint64_t *length)
+{
+	FILE *file = attach->data.file;
+	int64_t here = wt_ftell(file), end;
+	
+	*start = (here < 0 ? 0 : here);
+	*length = WTBODY_LENGTH_UNKNOWN;
+	
+	if(attach->length != 0)
+	{
+		*length = attach->length;
+		return;
+	}
+	
+	if(here < 0 || wt_fseek(file, 0, SEEK_END) != 0) return;
+	end = wt_ftell(file);
+	wt_fseek(file, here, SEEK_SET);
+	
+	if(end >= here) *length = end - here;
 }
 
-char *WTMIMEEncoder::_mimeify_file(FILE *file)
+/*
+ * Map length bytes of file, from start, to be read straight through.  Returns
+ * the mapping, with *data pointing at the first byte, or NULL if the file
+ * can't be mapped; then it has to be read instead.
+ */
+static void *map_file(FILE *file, uint64_t start, uint64_t length,
+		      const char **data, size_t *map_len)
 {
+#ifdef WTMIME_MMAP
+	uint64_t base = start - start % static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	struct stat info;
+	void *map;
+	
+	// Touching a page past the end of the file raises SIGBUS, so only map
+	// what is really there.
+	if(length == 0 || length == WTBODY_LENGTH_UNKNOWN ||
+	   length + (start - base) > static_cast<size_t>(-1) ||
+	   fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode) ||
+	   start + length > static_cast<uint64_t>(info.st_size))
+		return NULL;
+	
+	*map_len = length + (start - base);
+	map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, fileno(file), base);
+	if(map == MAP_FAILED) return NULL;
+	
+	// It's read once from front to back, so the kernel can read well ahead
+	// and drop the pages behind us.
+	madvise(map, *map_len, MADV_SEQUENTIAL);
+	
+	*data = static_cast<const char *>(map) + (start - base);
+	return map;
+#else
 	return NULL;
+#endif
 }
 
+static void unmap_file(void *map, size_t map_len)
+{
+#ifdef WTMIME_MMAP
+	if(map != NULL) munmap(map, map_len);
+#endif
+}
 
-void WTMIMEEncoder::_do_iteration(vector<WTMIMEAttachment *> attachments,
+/*
+ * Receive up to length bytes from a socket attachment.  With whole, keep
+ * going until there are length bytes or the peer stops sending; otherwise
+ * whatever arrives first will do, and *got is only 0 at the end.
+ */
+static bool read_socket(int socket, char *buffer, size_t length, bool whole,
+			size_t *got)
+{
+	*got = 0;
+	
+	while(*got < length)
+	{
+		int received = recv(socket, buffer + *got, length - *got, 0);
+		if(received < 0 && errno == EINTR) continue;
+		if(received < 0)
+		{
+			nonfatal_error(strerror(errno));
+			return false;
+		}
+		
+		*got += received;
+		if(received == 0 || !whole) break;
+	}
+	
+	return true;
+}
+
+/* The whole of a file or socket attachment's data, in memory */
+struct file_data
+{
+	const char *data;
+	size_t length;
+	
+	void *map;
+	size_t map_len;
+	char *copy;
+};
+
+/*
+ * Bring a file or socket attachment's data into memory: mapped if possible,
+ * otherwise read into a copy.  Either way a file is left after the data.
+ */
+static bool load_file(WTMIMEAttachment *attach, file_data *loaded)
+{
+	FILE *file = attach->data.file;
+	bool socket = (attach->datatype == MIME_DATATYPE_SOCKET);
+	uint64_t start, length = (attach->length ? attach->length : WTBODY_LENGTH_UNKNOWN);
+	
+	loaded->copy = NULL;
+	loaded->map = NULL;
+	
+	if(!socket)
+	{
+		file_extent(attach, &start, &length);
+		loaded->map = map_file(file, start, length, &loaded->data,
+				       &loaded->map_len);
+	}
+	if(loaded->map != NULL)
+	{
+		loaded->length = length;
+		wt_fseek(file, start + length, SEEK_SET);
+		return true;
+	}
+	
+	// Read it in as few calls as we can; without a length, double the
+	// buffer until the end turns up.
+	size_t size = (length == WTBODY_LENGTH_UNKNOWN ? 65536 : length), got = 0;
+	while(true)
+	{
+		char *grown = static_cast<char *>(realloc(loaded->copy, size + 1));
+		if(grown == NULL) alloc_error("MIME attachment file data", size + 1);
+		loaded->copy = grown;
+		
+		size_t read = 0;
+		if(!socket)
+			read = fread(loaded->copy + got, 1, size - got, file);
+		else if(!read_socket(attach->data.socket, loaded->copy + got,
+				     size - got, true, &read))
+		{
+			free(loaded->copy);
+			return false;
+		}
+		
+		got += read;
+		if(got < size || length != WTBODY_LENGTH_UNKNOWN) break;
+		size *= 2;
+	}
+	
+	if(!socket && ferror(file))
+	{
+		nonfatal_error(strerror(errno));
+		free(loaded->copy);
+		return false;
+	}
+	
+	loaded->data = loaded->copy;
+	loaded->length = got;
+	return true;
+}
+
+static void unload_file(file_data *loaded)
+{
+	unmap_file(loaded->map, loaded->map_len);
+	free(loaded->copy);
+}
+
+
+char *WTMIMEEncoder::_mimeify_data(const void *data, size_t len,
+				   size_t *encoded_len)
+{
+	// The encoded size is known exactly, so allocate just that (and the
+	// terminator) rather than a worst case.
+	size_t size = WTBase64::encoded_length(len, WTBASE64_MIME_LINE) + 1;
+	char *result = static_cast<char *>(malloc(size));
+	if(result == NULL) alloc_error("MIME attachment encoding buffer", size);
+	
+	*encoded_len = WTBase64::encode(data, len, result, WTBASE64_MIME_LINE);
+	result[*encoded_len] = '\0';
+	return result;
+}
+
+char *WTMIMEEncoder::_mimeify_file(WTMIMEAttachment *attach,
+				   size_t *encoded_len)
+{
+	file_data loaded;
+	if(!load_file(attach, &loaded)) return NULL;
+	
+	char *result = _mimeify_data(loaded.data, loaded.length, encoded_len);
+	unload_file(&loaded);
+	return result;
+}
+
+
+bool WTMIMEEncoder::_do_iteration(vector<WTMIMEAttachment *> attachments,
 				  char *boundary,
 				  char **result,
 				  uint64_t *result_len)
@@ -115,6 +339,22 @@ void WTMIMEEncoder::_do_iteration(vector<WTMIMEAttachment *> attachments,
 			 (attach->extra_disposition ? attach->extra_disposition : ""));
 		if(header == NULL) alloc_error("attachment headers", 1);
 		
+		// Bring in the data of file and socket attachments
+		const void *data = attach->data.buffer;
+		size_t data_len = attach->length;
+		file_data loaded;
+		
+		if(attach->datatype != MIME_DATATYPE_BUFFER)
+		{
+			if(!load_file(attach, &loaded))
+			{
+				free(header);
+				return false;
+			}
+			data = loaded.data;
+			data_len = loaded.length;
+		}
+		
 		// Encode this attachment
 		char *encoded_attach = NULL;
 		size_t encoded_size = 0;
@@ -124,14 +364,13 @@ void WTMIMEEncoder::_do_iteration(vector<WTMIMEAttachment *> attachments,
 		{
 			case MIME_TRANSFER_BASE64:
 				encoded_attach =
-					_mimeify_data(attach->data.buffer,
-						      attach->length);
-				encoded_size = strlen(encoded_attach);
+					_mimeify_data(data, data_len,
+						      &encoded_size);
 				break;
 			case MIME_TRANSFER_BINARY:
 			case MIME_TRANSFER_7BIT:
-				encoded_attach = (char *)(attach->data.buffer);
-				encoded_size = attach->length;
+				encoded_attach = (char *)(data);
+				encoded_size = data_len;
 				should_free_encoded = false;
 				break;
 			default:
@@ -157,6 +396,7 @@ void WTMIMEEncoder::_do_iteration(vector<WTMIMEAttachment *> attachments,
 		
 		free(header);
 		if(should_free_encoded) free(encoded_attach);
+		if(attach->datatype != MIME_DATATYPE_BUFFER) unload_file(&loaded);
 	}
 	
 	// At the end of the message, put the ending boundary
@@ -165,6 +405,7 @@ void WTMIMEEncoder::_do_iteration(vector<WTMIMEAttachment *> attachments,
 	char *result_end = *result + *result_len - bound_len - 7;
 	
 	snprintf(result_end, bound_len + 7, "--%s--\r\n", boundary);
+	return true;
 }
 
 
@@ -193,19 +434,7 @@ libAPI char *WTMIMEEncoder::encode_multiple(vector<WTMIMEAttachment *> attachmen
 	
 	
 	
-	// This is where we generate our shiny unique ID.
-	char *boundary = NULL;
-	
-	// Grab the hostname
-	char *host = hostname();
-	// Set it to something witty and NetBSD-like if we don't have one
-	if(host == NULL) host = strdup("amnesiac");
-	
-	asprintf(&boundary, "%llu.%u.%lu@%s",
-		 ++curr_message, getpid(), time(NULL), host);
-	
-	free(host);
-	if(boundary == NULL) alloc_error("Unique message ID", 1);
+	char *boundary = _new_boundary();
 	
 	
 	
@@ -230,15 +459,32 @@ libAPI char *WTMIMEEncoder::encode_multiple(vector<WTMIMEAttachment *> attachmen
 			 "reader, like MailScape, to read it.\n\n", boundary);
 		
 		// Handle attachments
-		_do_iteration(attachments, boundary, &result, &result_len);
+		if(!_do_iteration(attachments, boundary, &result, &result_len))
+		{
+			free(result);
+			result = NULL;
+		}
 	} else {
 		char *header = NULL;
 		char *result_moved;
 		WTMIMEAttachment *attach = attachments.at(0);
 		char *encoded_attach;
-		size_t result_len;
+		size_t result_len, encoded_len;
 		
 		// Create the MIME 1.0-compliant header for a single attachment
+		// Encode the attachment
+		if(attach->datatype != MIME_DATATYPE_BUFFER)
+			encoded_attach = _mimeify_file(attach, &encoded_len);
+		else
+			encoded_attach = _mimeify_data(attach->data.buffer,
+						       attach->length,
+						       &encoded_len);
+		if(encoded_attach == NULL)
+		{
+			free(boundary);
+			return NULL;
+		}
+		
 		asprintf(&header, "Content-type: %s\n"
 			 "Content-transfer-encoding: base64\n",
 			 (attach->type ? attach->type : "application/octet-stream"));
@@ -253,11 +499,8 @@ libAPI char *WTMIMEEncoder::encode_multiple(vector<WTMIMEAttachment *> attachmen
 		// Copy the headers to the end of the result
 		strncpy(result_moved, header, strlen(header));
 		
-		// Encode the attachment
-		encoded_attach = _mimeify_data(attach->data.buffer, attach->length);
-		
 		// Move up the result and resize it
-		result_len += strlen(encoded_attach);
+		result_len += encoded_len;
 		result = static_cast<char *> (realloc(result, result_len));
 		
 		// Move up the result to the end of the headers, and free the
@@ -266,7 +509,7 @@ libAPI char *WTMIMEEncoder::encode_multiple(vector<WTMIMEAttachment *> attachmen
 		free(header);
 		
 		// Copy the attachment into the result
-		strncpy(result_moved, encoded_attach, strlen(encoded_attach));
+		memcpy(result_moved, encoded_attach, encoded_len);
 		
 		// Set the NUL terminator, to be sure
 		result[result_len - 1] = '\0';
@@ -299,7 +542,7 @@ libAPI void *WTMIMEEncoder::encode_multiple_to_url(vector<WTMIMEAttachment *>att
 						   WTConnection *connection,
 						   uint64_t *result_len)
 {
-	void *response = NULL;
+	WTResponseBuffer response;
 	
 	// We need to ensure that we actually have at least one attachment.
 	if(attachments.size() <= 0)
@@ -308,57 +551,485 @@ libAPI void *WTMIMEEncoder::encode_multiple_to_url(vector<WTMIMEAttachment *>att
 		return NULL;
 	}
 	
+	char *boundary = _new_boundary();
 	
+	// The boundary has an '@' in it, which isn't allowed in a bare token
+	char *type = NULL;
+	asprintf(&type, "multipart/form-data; boundary=\"%s\"", boundary);
+	if(type == NULL) alloc_error("MIME Content-type header", 25);
 	
-	// This is where we generate our shiny unique ID.
-	char *boundary = NULL;
+	connection->http_header("MIME-Version", strdup("1.0"));
+	connection->http_header("Content-type", type);
 	
-	// Grab the hostname
-	char *host = hostname();
-	// Set it to something witty and NetBSD-like if we don't have one
-	if(host == NULL) host = strdup("amnesiac");
+	// The body is encoded as it is sent, a block at a time
+	WTMIMEBody body(attachments, boundary);
+	free(boundary);
 	
-	asprintf(&boundary, "%llu.%u.%lu@%s",
-		 ++curr_message, getpid(), time(NULL), host);
+	if(!connection->upload(&body, &response)) return NULL;
 	
-	free(host);
-	if(boundary == NULL) alloc_error("Unique message ID", 1);
+	*result_len = response.length();
+	return response.release();
+}
+
+
+#define WTMIME_BODY_HEAD		0	// The part's boundary and headers
+#define WTMIME_BODY_DATA		1	// The part's data
+#define WTMIME_BODY_DONE		2	// The closing boundary has been produced
+#define WTMIME_BODY_LAST		3	// The part's last line is pending
+
+libAPI WTMIMEBody::WTMIMEBody(const vector<WTMIMEAttachment *> &_attachments,
+			      const char *_boundary)
+	: attachments(_attachments)
+{
+	this->boundary = NULL;
+	if(_boundary != NULL && (this->boundary = strdup(_boundary)) == NULL)
+		alloc_error("MIME boundary", strlen(_boundary) + 1);
 	
+	this->part = 0;
+	this->state = WTMIME_BODY_HEAD;
+	this->offset = 0;
 	
+	this->pending = NULL;
+	this->pending_len = this->pending_pos = this->pending_size = 0;
 	
-	// Since headers are HTTP, we just set the result to NULL
-	// realloc can handle that
-	char *result = NULL;
-	*result_len = 0;
+	this->source = NULL;
+	this->source_len = 0;
+	this->mapping = NULL;
+	this->mapping_len = 0;
+	this->block = NULL;
+	this->block_size = 0;
 	
+	// Knowing the length up front means uploads can send Content-Length
+	// rather than being chunked, which some servers refuse.
+	this->total_length = plan();
+}
+
+libAPI WTMIMEBody::~WTMIMEBody()
+{
+	close_part();
+	free(this->boundary);
+	free(this->pending);
+	free(this->block);
+}
+
+/*
+ * Write part's boundary line and headers into buffer, like snprintf.  The
+ * size planning pass measures with this too, so the two can't disagree.
+ */
+static int format_part_head(char *buffer, size_t size, WTMIMEAttachment *attach,
+			    const char *boundary)
+{
+	return snprintf(buffer, size, "--%s\r\n"
+			"Content-type: %s\r\n"
+			"Content-transfer-encoding: %s\r\n"
+			"Content-disposition: %s%s\r\n"
+			"\r\n",
+			boundary,
+			(attach->type ? attach->type : "application/octet-stream"),
+			transfer_encodings[attach->transfer_enc],
+			content_dispositions[attach->disposition],
+			(attach->extra_disposition ? attach->extra_disposition : ""));
+}
+
+libAPI uint64_t WTMIMEBody::length(void)
+{
+	return this->total_length;
+}
+
+/* Work out the exact length of the body without producing any of it */
+uint64_t WTMIMEBody::plan(void)
+{
+	uint64_t total = 0;
 	
-	char *type = NULL;
-	asprintf(&type, "multipart/form-data; boundary=%s", boundary);
-	if(type == NULL) alloc_error("MIME Content-type header", 25);
+	for(size_t next = 0; next < this->attachments.size(); next++)
+	{
+		WTMIMEAttachment *attach = this->attachments.at(next);
+		uint64_t start, length = attach->length;
+		
+		if(attach->datatype == MIME_DATATYPE_FILE)
+			file_extent(attach, &start, &length);
+		else if(attach->datatype == MIME_DATATYPE_SOCKET && length == 0)
+			length = WTBODY_LENGTH_UNKNOWN;
+		if(length == WTBODY_LENGTH_UNKNOWN) return length;
+		
+		if(attach->transfer_enc == MIME_TRANSFER_BASE64)
+			total += WTBase64::encoded_length(length, WTBASE64_MIME_LINE);
+		else
+			total += length;
+		
+		if(this->boundary == NULL) continue;
+		total += format_part_head(NULL, 0, attach, this->boundary);
+		total += 2;	// CRLF before the next boundary
+	}
 	
-	connection->http_header("MIME-Version", strdup("1.0"));
-	connection->http_header("Content-type", type);
+	if(this->boundary == NULL) return total;
+	return total + strlen(this->boundary) + 6;	// --boundary--CRLF
+}
+
+/* Make room for size bytes of pending output, which replaces what was there */
+char *WTMIMEBody::reserve_pending(size_t size)
+{
+	if(size > this->pending_size)
+	{
+		char *grown = static_cast<char *>(realloc(this->pending, size));
+		if(grown == NULL) alloc_error("MIME body buffer", size);
+		this->pending = grown;
+		this->pending_size = size;
+	}
 	
-	// Handle attachments
-	_do_iteration(attachments, boundary, &result, result_len);
+	this->pending_len = size;
+	this->pending_pos = 0;
+	return this->pending;
+}
+
+/* Get ready to produce attach's data */
+void WTMIMEBody::open_part(WTMIMEAttachment *attach)
+{
+	uint64_t start;
 	
-	free(boundary);
+	this->offset = 0;
+	
+	if(attach->datatype == MIME_DATATYPE_BUFFER)
+	{
+		this->source = static_cast<const char *>(attach->data.buffer);
+		this->source_len = attach->length;
+		return;
+	}
+	
+	if(attach->datatype == MIME_DATATYPE_SOCKET)
+	{
+		this->source = NULL;
+		this->source_len = (attach->length ? attach->length : WTBODY_LENGTH_UNKNOWN);
+		return;
+	}
+	
+	file_extent(attach, &start, &this->source_len);
+	
+	this->source = NULL;
+	this->mapping = map_file(attach->data.file, start, this->source_len,
+				 &this->source, &this->mapping_len);
+	// The data isn't read through the FILE, so move it past by hand
+	if(this->mapping != NULL)
+		wt_fseek(attach->data.file, start + this->source_len, SEEK_SET);
+}
+
+void WTMIMEBody::close_part(void)
+{
+	unmap_file(this->mapping, this->mapping_len);
+	this->mapping = NULL;
+	this->source = NULL;
+}
+
+/* Move on from a part whose data has all been produced */
+void WTMIMEBody::finish_part(void)
+{
+	close_part();
+	// The CRLF before the next boundary belongs to it
+	if(this->boundary != NULL)
+		memcpy(reserve_pending(2), "\r\n", 2);
+	this->part++;
+	this->state = WTMIME_BODY_HEAD;
+}
+
+/*
+ * Produce as much of attach's data as fits in buffer.  Nothing is produced
+ * if buffer is too small for a whole line of base64; the caller then asks
+ * again with more room.
+ */
+bool WTMIMEBody::read_data(WTMIMEAttachment *attach, char *buffer, size_t size,
+			   size_t *used, bool *finished)
+{
+	// An unknown length is so large that it never limits what's taken
+	uint64_t remaining = this->source_len - this->offset;
+	bool base64 = (attach->transfer_enc == MIME_TRANSFER_BASE64);
+	const char *data;
+	size_t take = size, got;
+	bool ended = false;
+	
+	// Whole lines of base64 only, so that the pieces join up
+	if(base64) take = size / (WTBASE64_MIME_LINE + 2) * (WTBASE64_MIME_LINE / 4 * 3);
+	if(take > remaining) take = static_cast<size_t>(remaining);
+	got = take;
+	
+	if(attach->datatype != MIME_DATATYPE_BUFFER && this->mapping == NULL)
+	{
+		// The data isn't in memory, so read it; binary data can go
+		// straight into the caller's buffer.
+		char *into = buffer;
+		if(base64)
+		{
+			if(take > this->block_size)
+			{
+				char *grown = static_cast<char *>(realloc(this->block, take));
+				if(grown == NULL) alloc_error("MIME file block", take);
+				this->block = grown;
+				this->block_size = take;
+			}
+			into = this->block;
+		}
+		
+		if(attach->datatype == MIME_DATATYPE_SOCKET)
+		{
+			// Base64 waits for whole lines; binary sends what's come
+			if(!read_socket(attach->data.socket, into, take, base64, &got))
+				return false;
+			ended = (base64 ? got < take : take > 0 && got == 0);
+		} else {
+			got = fread(into, 1, take, attach->data.file);
+			if(got < take && ferror(attach->data.file))
+			{
+				nonfatal_error(strerror(errno));
+				return false;
+			}
+			ended = (got < take);
+		}
+		data = into;
+	} else {
+		data = this->source + this->offset;
+	}
+	
+	if(base64)
+		*used = WTBase64::encode(data, got, buffer, WTBASE64_MIME_LINE);
+	else
+	{
+		if(data != buffer) memcpy(buffer, data, got);
+		*used = got;
+	}
+	
+	this->offset += got;
+	*finished = (this->offset == this->source_len || ended);
+	return true;
+}
+
+libAPI bool WTMIMEBody::read(char *buffer, size_t size, size_t *used)
+{
+	size_t done = 0;
+	
+	while(done < size)
+	{
+		// First, whatever didn't fit last time
+		if(this->pending_pos < this->pending_len)
+		{
+			size_t take = this->pending_len - this->pending_pos;
+			if(take > size - done) take = size - done;
+			memcpy(buffer + done, this->pending + this->pending_pos, take);
+			this->pending_pos += take;
+			done += take;
+			continue;
+		}
+		
+		if(this->state == WTMIME_BODY_DONE) break;
+		
+		if(this->state == WTMIME_BODY_LAST)
+		{
+			finish_part();
+			continue;
+		}
+		
+		if(this->state == WTMIME_BODY_HEAD)
+		{
+			if(this->part == this->attachments.size())
+			{
+				this->state = WTMIME_BODY_DONE;
+				if(this->boundary == NULL) continue;
+				
+				size_t needed = strlen(this->boundary) + 6;
+				snprintf(reserve_pending(needed + 1), needed + 1,
+					 "--%s--\r\n", this->boundary);
+				this->pending_len = needed;
+				continue;
+			}
+			
+			WTMIMEAttachment *attach = this->attachments.at(this->part);
+			if(this->boundary != NULL)
+			{
+				int needed = format_part_head(NULL, 0, attach,
+							      this->boundary);
+				
+				format_part_head(reserve_pending(needed + 1), needed + 1,
+						 attach, this->boundary);
+				this->pending_len = needed;
+			}
+			this->state = WTMIME_BODY_DATA;
+			open_part(attach);
+			continue;
+		}
+		
+		// WTMIME_BODY_DATA.  Data that can be spliced is left for the
+		// connection to move itself.
+		if(done > 0 && can_splice()) break;
+		
+		WTMIMEAttachment *attach = this->attachments.at(this->part);
+		size_t wrote = 0;
+		bool finished = false;
+		
+		if(!read_data(attach, buffer + done, size - done, &wrote, &finished))
+			return false;
+		done += wrote;
+		
+		if(finished)
+			finish_part();
+		else if(wrote == 0) {
+			// Too little room for a line; produce one to hand out
+			// over the next calls.  If it was the last, the part is
+			// finished once it has all gone.
+			char *line = reserve_pending(WTBASE64_MIME_LINE + 2);
+			if(!read_data(attach, line, WTBASE64_MIME_LINE + 2, &wrote, &finished))
+				return false;
+			this->pending_len = wrote;
+			if(finished) this->state = WTMIME_BODY_LAST;
+		}
+	}
 	
-	response = connection->upload(reinterpret_cast<const void *>(result), result_len);
+	*used = done;
+	return true;
+}
+
+libAPI bool WTMIMEBody::can_splice(void)
+{
+#ifdef WTBODY_HAVE_SPLICE
+	if(this->state != WTMIME_BODY_DATA || this->pending_pos < this->pending_len)
+		return false;
 	
-	free(result);
-	return response;
+	// Base64 has to be encoded, so it passes through here
+	WTMIMEAttachment *attach = this->attachments.at(this->part);
+	return (attach->datatype == MIME_DATATYPE_SOCKET &&
+		attach->transfer_enc != MIME_TRANSFER_BASE64);
+#else
+	return false;
+#endif
+}
+
+libAPI bool WTMIMEBody::splice_to(int pipe, size_t size, size_t *used)
+{
+	*used = 0;
+#ifdef WTBODY_HAVE_SPLICE
+	WTMIMEAttachment *attach = this->attachments.at(this->part);
+	uint64_t remaining = this->source_len - this->offset;
+	ssize_t moved = 0;
+	
+	if(size > remaining) size = static_cast<size_t>(remaining);
+	while(size > 0 &&
+	      (moved = splice(attach->data.socket, NULL, pipe, NULL, size,
+			      SPLICE_F_MOVE)) < 0)
+	{
+		if(errno == EINTR) continue;
+		nonfatal_error(strerror(errno));
+		return false;
+	}
+	
+	this->offset += moved;
+	*used = moved;
+	
+	// Nothing moved means the peer has stopped sending
+	if(moved == 0 || this->offset == this->source_len) finish_part();
+	return true;
+#else
+	return false;
+#endif
 }
 
 
+#define WTMIME_FILE_BLOCK	(256 * 1024)	// Written to files at a time
+
+/*
+ * Write the whole of body to file, a block at a time, adding what was
+ * written to *total.  Returns false if the body couldn't be produced or
+ * written, leaving the message in the file cut short.
+ */
+static bool write_body(WTMIMEBody *body, FILE *file, size_t *total)
+{
+	char *block = static_cast<char *>(malloc(WTMIME_FILE_BLOCK));
+	if(block == NULL) alloc_error("MIME file block", WTMIME_FILE_BLOCK);
+	
+	size_t used, wrote;
+	bool result = true;
+	
+	// read() fills the whole block, and stdio hands a write that large
+	// straight to the system rather than copying it into its own buffer.
+	while((result = body->read(block, WTMIME_FILE_BLOCK, &used)) && used > 0)
+	{
+		wrote = fwrite(block, 1, used, file);
+		*total += wrote;
+		if(wrote < used)
+		{
+			nonfatal_error(strerror(errno));
+			result = false;
+			break;
+		}
+	}
+	
+	free(block);
+	return result;
+}
+
 libAPI size_t WTMIMEEncoder::encode_single_to_file(WTMIMEAttachment *attachment,
 						   FILE *file)
 {
-	return 0;
+	// We're lazy.  Just shove it in a vector and pretend there's multiple.
+	
+	vector<WTMIMEAttachment *> single;
+	single.push_back(attachment);
+	
+	return encode_multiple_to_file(single, file);
 }
 
 libAPI size_t WTMIMEEncoder::encode_multiple_to_file(vector<WTMIMEAttachment *> attachments,
 						     FILE *file)
 {
-	return 0;
+	char *boundary = NULL;
+	int head_len;
+	
+	// We need to ensure that we actually have at least one attachment.
+	if(attachments.size() <= 0)
+	{
+		nonfatal_error("No attachments");
+		return 0;
+	}
+	
+	// Like encode_multiple, a single attachment is the whole message
+	// rather than the only part of a multipart one.
+	if(attachments.size() > 1)
+	{
+		boundary = _new_boundary();
+		head_len = fprintf(file, "MIME-Version: 1.0\r\n"
+				   "Content-type: multipart/mixed; boundary=\"%s\"\r\n"
+				   "\r\nThis message was created by eScape in "
+				   "multi-part MIME format.\r\nUse a MIME 1.0-compliant "
+				   "reader, like MailScape, to read it.\r\n\r\n",
+				   boundary);
+	} else {
+		WTMIMEAttachment *attach = attachments.at(0);
+		head_len = fprintf(file, "MIME-Version: 1.0\r\n"
+				   "Content-type: %s\r\n"
+				   "Content-transfer-encoding: %s\r\n\r\n",
+				   (attach->type ? attach->type : "application/octet-stream"),
+				   transfer_encodings[attach->transfer_enc]);
+	}
+	
+	if(head_len < 0)
+	{
+		nonfatal_error(strerror(errno));
+		free(boundary);
+		return 0;
+	}
+	
+	// The message is encoded as it is written, so it's never all in memory
+	WTMIMEBody body(attachments, boundary);
+	free(boundary);
+	
+	size_t written = head_len;
+	
+	// A message cut short is no message, so it counts as nothing written
+	if(!write_body(&body, file, &written)) return 0;
+	
+	// What stdio accepted may not have reached the file.  There's no
+	// telling how much did, so a failed write is nothing written.
+	if(fflush(file) != 0 || ferror(file))
+	{
+		nonfatal_error(strerror(errno));
+		return 0;
+	}
+	
+	return written;
 }
@@ -35,13 +35,101 @@ public:
 	libAPI static size_t encode_multiple_to_file(vector<WTMIMEAttachment *> attachments,
 						     FILE *file);
 private:
-	static char *_mimeify_data(const void *data, size_t length);
-	static char *_mimeify_file(FILE *file);
-	static void _do_iteration(vector<WTMIMEAttachment *> attachments,
+	static char *_new_boundary(void);
+	static char *_mimeify_data(const void *data, size_t length,
+				   size_t *encoded_length);
+	static char *_mimeify_file(WTMIMEAttachment *attachment,
+				   size_t *encoded_length);
+	static bool _do_iteration(vector<WTMIMEAttachment *> attachments,
 				  char *boundary,
 				  char **result,
 				  uint64_t *result_len);
 };
 
+/*!
+	@class		WTMIMEBody
+	@brief		Produces a multipart/form-data body as it is sent.
+	@details	Each part's headers, its (encoded) data and the
+			boundaries between parts are written straight into the
+			buffer WTConnection sends from, so however large the
+			attachments are, only a few kilobytes are in use at a
+			time.
+
+			The attachments are not copied, and must stay valid
+			until the body has been read.  File attachments are
+			read from their current position, and mapped into
+			memory where the system allows so the data comes
+			straight from the page cache; a file must not shrink
+			while it is being read.  Socket attachments are read
+			until the peer stops sending, unless they have a
+			length; where the system allows, binary ones are
+			spliced from the socket to the connection without
+			being copied at all.
+ */
+class WTMIMEBody : public WTBodySource
+{
+public:
+	/*!
+	@brief		Initialise the body.
+	@param		attachments	The attachments, one part each.
+	@param		boundary	The boundary between the parts, or NULL
+					to produce just the data of a single
+					attachment, for a message that isn't
+					multipart.
+	 */
+	libAPI WTMIMEBody(const vector<WTMIMEAttachment *> &attachments,
+			  const char *boundary);
+	libAPI virtual ~WTMIMEBody();
+	
+	/*!
+	@brief		Retrieve the length of the body.
+	@result		The exact length of the body, worked out from the
+			attachments' lengths before any of it is produced, or
+			WTBODY_LENGTH_UNKNOWN if a file attachment has no
+			length and can't seek (such as a pipe), or a socket
+			attachment has no length.
+	 */
+	libAPI virtual uint64_t length(void);
+	libAPI virtual bool read(char *buffer, size_t size, size_t *used);
+	libAPI virtual bool can_splice(void);
+	libAPI virtual bool splice_to(int pipe, size_t size, size_t *used);
+private:
+	vector<WTMIMEAttachment *> attachments;
+	char *boundary;
+	
+	/*! The part being produced */
+	size_t part;
+	/*! What of that part is being produced (WTMIME_BODY_*) */
+	int state;
+	/*! How much of the part's data has been produced */
+	uint64_t offset;
+	/*! The length of the whole body */
+	uint64_t total_length;
+	
+	/*! Output that didn't fit the caller's buffer */
+	char *pending;
+	size_t pending_len, pending_pos, pending_size;
+	
+	/*! The part's data in memory: the buffer, or the file mapped in.
+	    NULL if the file is being read a block at a time instead. */
+	const char *source;
+	/*! The length of the part's data, or WTBODY_LENGTH_UNKNOWN */
+	uint64_t source_len;
+	/*! The mapping behind source, to unmap when the part is done */
+	void *mapping;
+	size_t mapping_len;
+	/*! Where file data is read to be base64-encoded */
+	char *block;
+	size_t block_size;
+	
+	uint64_t plan(void);
+	char *reserve_pending(size_t size);
+	void open_part(WTMIMEAttachment *attach);
+	void close_part(void);
+	void finish_part(void);
+	bool read_data(WTMIMEAttachment *attach, char *buffer, size_t size,
+		       size_t *used, bool *finished);
+};
+
 
 #endif /*!__LIBINK_WTMIMEENCODER_H__*/
@@ -0,0 +1,122 @@
+/*
+ * WTArena.cpp - implementation of region (bump) allocator
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "WTArena.h"
+#include <Utility.h> // alloc_error
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcpy, strlen
+
+/* Every allocation is rounded up to this, which is enough for any type
+   we store (pointers, size_t, double). */
+#define ARENA_ALIGN 16
+#define align_up(x) (((x) + (ARENA_ALIGN - 1)) & ~static_cast<size_t>(ARENA_ALIGN - 1))
+
+/* The block header is padded so the data after it stays aligned. */
+#define BLOCK_DATA(b) (reinterpret_cast<char *>(b) + align_up(sizeof(block)))
+
+libAPI WTArena::WTArena(size_t block_size)
+{
+	this->head = NULL;
+	this->block_size = block_size;
+}
+
+libAPI WTArena::~WTArena()
+{
+	while(this->head != NULL)
+	{
+		block *next = this->head->next;
+		free(this->head);
+		this->head = next;
+	}
+}
+
+WTArena::block *WTArena::new_block(size_t size)
+{
+	size_t total = align_up(sizeof(block)) + size;
+	block *fresh = static_cast<block *>(malloc(total));
+	if(fresh == NULL) alloc_error("arena block", total);
+	
+	fresh->next = NULL;
+	fresh->size = size;
+	fresh->used = 0;
+	
+	return fresh;
+}
+
+libAPI void *WTArena::alloc(size_t size)
+{
+	size = align_up(size == 0 ? 1 : size);
+	
+	if(this->head != NULL && this->head->size - this->head->used >= size)
+	{
+		void *result = BLOCK_DATA(this->head) + this->head->used;
+		this->head->used += size;
+		return result;
+	}
+	
+	if(size > this->block_size / 4)
+	{
+		/* Big allocations get a block to themselves, tucked in behind
+		   the current one so that it keeps filling up. */
+		block *big = new_block(size);
+		big->used = size;
+		if(this->head == NULL)
+		{
+			this->head = big;
+		} else {
+			big->next = this->head->next;
+			this->head->next = big;
+		}
+		return BLOCK_DATA(big);
+	}
+	
+	block *fresh = new_block(this->block_size);
+	fresh->next = this->head;
+	this->head = fresh;
+	fresh->used = size;
+	
+	return BLOCK_DATA(fresh);
+}
+
+libAPI char *WTArena::strndup(const char *str, size_t length)
+{
+	char *copy = static_cast<char *>(alloc(length + 1));
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+libAPI char *WTArena::strdup(const char *str)
+{
+	return this->strndup(str, strlen(str));
+}
+
+libAPI void WTArena::reset(void)
+{
+	if(this->head == NULL) return;
+	
+	// Keep the oldest block for reuse, unless it is a small one-off.
+	block *keep = this->head;
+	while(keep->next != NULL)
+	{
+		block *next = keep->next;
+		free(keep);
+		keep = next;
+	}
+	
+	if(keep->size < this->block_size)
+	{
+		free(keep);
+		keep = NULL;
+	} else {
+		keep->used = 0;
+	}
+	this->head = keep;
+}
@@ -0,0 +1,79 @@
+/*
+ * WTArena.h - interface for region (bump) allocator
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTARENA_H__
+#define __LIBINK_WTARENA_H__
+
+#include <Utility.h> // libAPI
+#include <stdlib.h> // size_t
+
+/*!
+	@brief		Region allocator.
+	@details	Memory is handed out by bumping a pointer through large
+			blocks, and is only given back all at once, by ::reset
+			or when the arena is destroyed.  This suits data that
+			lives and dies together, like the headers of a single
+			HTTP response.
+	@note		This class does no locking.
+ */
+class WTArena
+{
+public:
+	/*!
+	@brief		Construct a new, empty arena.
+	@param		block_size	The size of the blocks requested from
+					malloc.  Larger allocations get a block
+					of their own.
+	 */
+	libAPI WTArena(size_t block_size = 4096);
+	libAPI ~WTArena();
+	
+	/*!
+	@brief		Allocate memory from the arena.
+	@param		size		The number of bytes to allocate.
+	@result		Memory suitably aligned for any type.  It must not be
+			free()d; it is valid until the arena is reset.
+	 */
+	libAPI void *alloc(size_t size);
+	/*!
+	@brief		Copy a string into the arena.
+	@param		str		The string to copy.
+	@param		length		The number of bytes of str to copy.  The
+					copy is always NUL-terminated.
+	 */
+	libAPI char *strndup(const char *str, size_t length);
+	/*!
+	@brief		Copy a NUL-terminated string into the arena.
+	 */
+	libAPI char *strdup(const char *str);
+	/*!
+	@brief		Release everything allocated from the arena.
+	@details	The first block is kept for reuse.
+	 */
+	libAPI void reset(void);
+private:
+	struct block
+	{
+		block *next;
+		size_t size;
+		size_t used;
+	};
+	
+	/*! The block being allocated from; earlier blocks follow it */
+	block *head;
+	size_t block_size;
+	
+	block *new_block(size_t size);
+	
+	WTArena(const WTArena &);
+	WTArena &operator=(const WTArena &);
+};
+
+#endif/*!__LIBINK_WTARENA_H__*/
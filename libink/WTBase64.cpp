@@ -0,0 +1,441 @@
+/*
+ * WTBase64.cpp - implementation of base64 encoding routines
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "WTBase64.h"	// Self
+#include <string.h>	// memcpy, memmove
+
+// The vector routines are built with target attributes and picked at run
+// time, so the library itself does not require anything past the baseline.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#	define WT_B64_X86 1
+#	include <immintrin.h>
+#	define WT_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static const char alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* How many wrapped lines to encode at a time */
+#define WTBASE64_BATCH_LINES	64
+
+#define XX	0xFF	// not base64
+#define WS	0xFE	// whitespace, skipped
+#define PD	0xFD	// padding
+
+static const unsigned char values[256] = {
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,WS,WS,XX,XX,WS,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	WS,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,62,XX,XX,XX,63,	// space + /
+	52,53,54,55,56,57,58,59,60,61,XX,XX,XX,PD,XX,XX,	// 0-9 =
+	XX, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,	// A-O
+	15,16,17,18,19,20,21,22,23,24,25,XX,XX,XX,XX,XX,	// P-Z
+	XX,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,	// a-o
+	41,42,43,44,45,46,47,48,49,50,51,XX,XX,XX,XX,XX,	// p-z
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+	XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX
+};
+
+/*
+ * The vector kernels only handle whole blocks.  An encoder returns how many
+ * input bytes it consumed (a multiple of 3), having written 4 characters for
+ * every 3 of them; a decoder returns how many characters it consumed (a
+ * multiple of 4), stopping at the first block that holds anything but the
+ * 64 alphabet characters, and having written 3 bytes for every 4 of them.
+ */
+typedef size_t (*encode_kernel)(const unsigned char *in, size_t length, char *out);
+typedef size_t (*decode_kernel)(const unsigned char *in, size_t length, unsigned char *out);
+
+static size_t encode_none(const unsigned char *, size_t, char *)
+{
+	return 0;
+}
+
+static size_t decode_none(const unsigned char *, size_t, unsigned char *)
+{
+	return 0;
+}
+
+#ifdef WT_B64_X86
+/*
+ * These follow Wojciech Muła's SSSE3 base64 work: bytes are shuffled so that
+ * each 32-bit lane holds one 3 byte group, the four 6-bit indices are pulled
+ * apart with multiplies, and a 16 entry table maps index ranges to the
+ * offset that turns them into ASCII (and back).
+ */
+
+WT_TARGET("ssse3") static inline __m128i encode_lanes(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1));
+
+	__m128i ac = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)),
+				     _mm_set1_epi32(0x04000040));
+	__m128i bd = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)),
+				     _mm_set1_epi32(0x01000010));
+	__m128i indices = _mm_or_si128(ac, bd);
+
+	// 0 for a-z, 1-10 for 0-9, 11 and 12 for + and /, 13 for A-Z
+	__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+						  _mm_set1_epi8(13)));
+	__m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+					'0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					'0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					'/' - 63, 'A', 0, 0);
+
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range));
+}
+
+/*
+ * The 16 byte loops are inlined into the AVX2 kernels for their tails, so
+ * that they are VEX encoded there; mixing in legacy SSE code after 256-bit
+ * work costs a state transition on some processors.
+ */
+WT_TARGET("ssse3") static inline size_t encode_16(const unsigned char *in, size_t length, char *out)
+{
+	size_t pos = 0;
+
+	// Each load reads 16 bytes and uses 12 of them
+	for(; pos + 16 <= length; pos += 12, out += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+				 encode_lanes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos))));
+
+	return pos;
+}
+
+WT_TARGET("ssse3") static size_t encode_ssse3(const unsigned char *in, size_t length, char *out)
+{
+	return encode_16(in, length, out);
+}
+
+WT_TARGET("avx2") static inline __m256i both_lanes(__m128i lane)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lane), lane, 1);
+}
+
+WT_TARGET("avx2") static size_t encode_avx2(const unsigned char *in, size_t length, char *out)
+{
+	size_t pos = 0;
+	__m256i shuffle = both_lanes(_mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+						  4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i offsets = both_lanes(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+						   '/' - 63, 'A', 0, 0));
+
+	// Each lane takes 12 bytes: the low one from pos, the high from pos + 12
+	for(; pos + 28 <= length; pos += 24, out += 32)
+	{
+		__m256i chunk = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos))),
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos + 12)), 1);
+		chunk = _mm256_shuffle_epi8(chunk, shuffle);
+
+		__m256i ac = _mm256_mulhi_epu16(_mm256_and_si256(chunk, _mm256_set1_epi32(0x0FC0FC00)),
+						_mm256_set1_epi32(0x04000040));
+		__m256i bd = _mm256_mullo_epi16(_mm256_and_si256(chunk, _mm256_set1_epi32(0x003F03F0)),
+						_mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(ac, bd);
+
+		__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices),
+								_mm256_set1_epi8(13)));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out),
+				    _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range)));
+	}
+
+	return pos + encode_16(in + pos, length - pos, out);
+}
+
+WT_TARGET("ssse3") static inline size_t decode_16(const unsigned char *in, size_t length, unsigned char *out)
+{
+	size_t pos = 0;
+	__m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+				       0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	__m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+				       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	__m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					 0, 0, 0, 0, 0, 0, 0, 0);
+
+	for(; pos + 16 <= length; pos += 16, out += 12)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(chunk, 4), nibble);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(chunk, nibble));
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+
+		// The tables share a bit only for characters outside the alphabet
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF)
+			break;
+
+		// '/' is the one character its high nibble doesn't place
+		__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')),
+								       hi_nibbles));
+		__m128i indices = _mm_add_epi8(chunk, roll);
+
+		// Join 6-bit pairs, then 12-bit pairs, then drop the top bytes
+		__m128i packed = _mm_madd_epi16(_mm_maddubs_epi16(indices, _mm_set1_epi32(0x01400140)),
+						_mm_set1_epi32(0x00011000));
+		packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+								8, 14, 13, 12, -1, -1, -1, -1));
+
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out), packed);
+		int tail = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+		memcpy(out + 8, &tail, 4);
+	}
+
+	return pos;
+}
+
+WT_TARGET("ssse3") static size_t decode_ssse3(const unsigned char *in, size_t length, unsigned char *out)
+{
+	return decode_16(in, length, out);
+}
+
+WT_TARGET("avx2") static size_t decode_avx2(const unsigned char *in, size_t length, unsigned char *out)
+{
+	size_t pos = 0;
+	__m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i lut_lo = both_lanes(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+						  0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A));
+	__m256i lut_hi = both_lanes(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+						  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+	__m256i lut_roll = both_lanes(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+						    0, 0, 0, 0, 0, 0, 0, 0));
+	__m256i pack = both_lanes(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+						8, 14, 13, 12, -1, -1, -1, -1));
+
+	for(; pos + 32 <= length; pos += 32, out += 24)
+	{
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + pos));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(chunk, 4), nibble);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(chunk, nibble));
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+		if(!_mm256_testz_si256(lo, hi)) break;
+
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('/')),
+									     hi_nibbles));
+		__m256i indices = _mm256_add_epi8(chunk, roll);
+		__m256i packed = _mm256_madd_epi16(_mm256_maddubs_epi16(indices, _mm256_set1_epi32(0x01400140)),
+						   _mm256_set1_epi32(0x00011000));
+
+		// 12 bytes at the bottom of each lane; close the gap between them
+		packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(packed, pack),
+						     _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(packed));
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out + 16), _mm256_extracti128_si256(packed, 1));
+	}
+
+	return pos + decode_16(in + pos, length - pos, out);
+}
+#endif
+
+static encode_kernel encode_blocks = NULL;
+static decode_kernel decode_blocks = NULL;
+
+/* Pick the kernels for this processor.  Racing callers all pick the same. */
+static void choose_kernels()
+{
+	encode_kernel encoder = encode_none;
+	decode_kernel decoder = decode_none;
+
+#ifdef WT_B64_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		encoder = encode_avx2;
+		decoder = decode_avx2;
+	} else if(__builtin_cpu_supports("ssse3")) {
+		encoder = encode_ssse3;
+		decoder = decode_ssse3;
+	}
+#endif
+
+	decode_blocks = decoder;
+	encode_blocks = encoder;
+}
+
+/* Encode a run without line breaks, padding the end */
+static size_t encode_run(const unsigned char *in, size_t length, char *out)
+{
+	char *start = out;
+	size_t pos = encode_blocks(in, length, out);
+
+	out += pos / 3 * 4;
+	for(; pos + 3 <= length; pos += 3)
+	{
+		*out++ = alphabet[in[pos] >> 2];
+		*out++ = alphabet[((in[pos] & 0x03) << 4) | (in[pos + 1] >> 4)];
+		*out++ = alphabet[((in[pos + 1] & 0x0F) << 2) | (in[pos + 2] >> 6)];
+		*out++ = alphabet[in[pos + 2] & 0x3F];
+	}
+
+	if(pos + 1 == length)
+	{
+		*out++ = alphabet[in[pos] >> 2];
+		*out++ = alphabet[(in[pos] & 0x03) << 4];
+		*out++ = '=';
+		*out++ = '=';
+	} else if(pos + 2 == length) {
+		*out++ = alphabet[in[pos] >> 2];
+		*out++ = alphabet[((in[pos] & 0x03) << 4) | (in[pos + 1] >> 4)];
+		*out++ = alphabet[(in[pos + 1] & 0x0F) << 2];
+		*out++ = '=';
+	}
+
+	return out - start;
+}
+
+libAPI size_t WTBase64::encoded_length(size_t length, size_t line_length)
+{
+	size_t chars = (length + 2) / 3 * 4;
+
+	line_length -= line_length % 4;
+	if(line_length == 0) return chars;
+
+	return chars + 2 * ((chars + line_length - 1) / line_length);
+}
+
+libAPI size_t WTBase64::encode(const void *data, size_t length,
+			       char *buffer, size_t line_length)
+{
+	const unsigned char *in = static_cast<const unsigned char *>(data);
+	char *out = buffer;
+
+	if(encode_blocks == NULL) choose_kernels();
+
+	line_length -= line_length % 4;
+	if(line_length == 0) return encode_run(in, length, buffer);
+
+	// Encoding line by line leaves the kernels too little to do, so
+	// encode a batch of lines in one go at the end of the space they will
+	// take up, then move each line down into place.  A line and its CRLF
+	// never reach past the start of the next line still to be moved.
+	size_t batch_bytes = line_length / 4 * 3 * WTBASE64_BATCH_LINES;
+	while(length > 0)
+	{
+		size_t chunk = (length < batch_bytes ? length : batch_bytes);
+		size_t chars = (chunk + 2) / 3 * 4;
+		char *line = out + 2 * ((chars + line_length - 1) / line_length);
+
+		encode_run(in, chunk, line);
+		while(chars > 0)
+		{
+			size_t used = (chars < line_length ? chars : line_length);
+
+			memmove(out, line, used);
+			out += used;
+			line += used;
+			*out++ = '\r';
+			*out++ = '\n';
+			chars -= used;
+		}
+		in += chunk;
+		length -= chunk;
+	}
+
+	return out - buffer;
+}
+
+libAPI bool WTBase64::decode(const char *str, size_t length, void *buffer,
+			     size_t *decoded)
+{
+	const unsigned char *in = reinterpret_cast<const unsigned char *>(str);
+	unsigned char *out = static_cast<unsigned char *>(buffer);
+	unsigned long group = 0;
+	unsigned have = 0, padding = 0;
+	bool try_kernel = true;
+	size_t pos = 0;
+
+	if(decode_blocks == NULL) choose_kernels();
+
+	while(pos < length)
+	{
+		// Between groups, let the kernel take whatever it can.  It
+		// stops at line breaks and padding, which are handled below;
+		// once it has stopped there is no point trying again before
+		// the next line.
+		if(have == 0 && padding == 0)
+		{
+			if(try_kernel)
+			{
+				size_t used = decode_blocks(in + pos, length - pos, out);
+				pos += used;
+				out += used / 4 * 3;
+				try_kernel = false;
+			}
+
+			// Then whole groups, up to the line break
+			for(; pos + 4 <= length; pos += 4)
+			{
+				unsigned long a = values[in[pos]], b = values[in[pos + 1]],
+					      c = values[in[pos + 2]], d = values[in[pos + 3]];
+				if((a | b | c | d) & 0xC0) break;
+
+				group = (a << 18) | (b << 12) | (c << 6) | d;
+				*out++ = static_cast<unsigned char>(group >> 16);
+				*out++ = static_cast<unsigned char>(group >> 8);
+				*out++ = static_cast<unsigned char>(group);
+			}
+			group = 0;
+			if(pos == length) break;
+		}
+
+		unsigned char value = values[in[pos++]];
+		if(value == WS)
+		{
+			while(pos < length && values[in[pos]] == WS) pos++;
+			try_kernel = true;
+			continue;
+		}
+		if(value == XX) return false;
+		if(value == PD)
+		{
+			// Only "xx==" and "xxx=" may be padded
+			if(have < 2 || have + ++padding > 4) return false;
+			continue;
+		}
+		if(padding > 0) return false;
+
+		group = (group << 6) | value;
+		if(++have == 4)
+		{
+			*out++ = static_cast<unsigned char>(group >> 16);
+			*out++ = static_cast<unsigned char>(group >> 8);
+			*out++ = static_cast<unsigned char>(group);
+			group = 0;
+			have = 0;
+		}
+	}
+
+	// The padding may be left off, but not half of it
+	if(have == 1 || (padding > 0 && have + padding != 4)) return false;
+	if(have == 2)
+	{
+		*out++ = static_cast<unsigned char>(group >> 4);
+	} else if(have == 3) {
+		*out++ = static_cast<unsigned char>(group >> 10);
+		*out++ = static_cast<unsigned char>(group >> 2);
+	}
+
+	*decoded = out - static_cast<unsigned char *>(buffer);
+	return true;
+}
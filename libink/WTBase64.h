@@ -0,0 +1,72 @@
+/*
+ * WTBase64.h - interface for base64 encoding routines
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTBASE64_H__
+#define __LIBINK_WTBASE64_H__
+
+#include <Utility.h> // libAPI
+#include <stdlib.h> // size_t
+
+/*! The line length RFC 2045 sets for base64 in MIME bodies. */
+#define WTBASE64_MIME_LINE	76
+
+/*!
+	@brief		RFC 4648 base64 encoding and decoding.
+	@details	On x86 processors with SSSE3 or AVX2 the bulk of the
+			work is done with vector instructions, chosen when the
+			routines are first used; elsewhere a table is used.
+			None of these routines allocate; they write into memory
+			the caller supplies, and the output is not terminated.
+ */
+class WTBase64
+{
+public:
+	/*!
+	@brief		Measure the encoding of some data.
+	@param		length		The length of the data.
+	@param		line_length	The line length to wrap at, or 0 to
+						not wrap.  It must be a multiple of 4.
+	@result		The exact length of the encoding.
+	 */
+	libAPI static size_t encoded_length(size_t length, size_t line_length = 0);
+	/*!
+	@brief		Encode some data.
+	@param		data		The data to encode.
+	@param		length		The length of data.
+	@param		buffer		The buffer to write into.  It needs
+						encoded_length(length, line_length)
+						bytes.
+	@param		line_length	The line length to wrap at, or 0 to
+						not wrap.  It must be a multiple of 4.
+						Every line, including the last one,
+						ends with CRLF, so encodings of pieces
+						that are a multiple of line_length / 4
+						* 3 bytes long can be joined.
+	@result		The length of the encoding.
+	 */
+	libAPI static size_t encode(const void *data, size_t length,
+				    char *buffer, size_t line_length = 0);
+	/*!
+	@brief		Decode base64.
+	@param		str		The string to decode.  Whitespace (such
+						as line breaks) is skipped, and the
+						padding may be left off.
+	@param		length		The length of str.
+	@param		buffer		The buffer to write into.  It needs
+						length / 4 * 3 + 2 bytes.
+	@param		decoded		Receives the decoded length.
+	@result		true if str was valid base64, false otherwise.  If it
+			was not, the contents of buffer are undefined.
+	 */
+	libAPI static bool decode(const char *str, size_t length, void *buffer,
+				  size_t *decoded);
+};
+
+#endif/*!__LIBINK_WTBASE64_H__*/
@@ -0,0 +1,231 @@
+/*
+ * WTDict.h - typed dictionary with inline values
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTDICT_H__
+#define __LIBINK_WTDICT_H__
+
+#include <Utility.h> // alloc_error
+#include "WTHashTable.h" // WTHashKey, WTKeyEqual
+#include "WTString.h" // WTSmallString, WTStringView
+#include <stdlib.h> // calloc, free
+#include <string.h> // memset
+#include <vector>
+
+#ifndef _WIN32
+#	include <stdint.h>
+#endif
+
+/*!
+	@brief		Typed, case-insensitive dictionary.
+	@details	Unlike WTDictionary, values are stored in the
+			dictionary itself rather than as pointers to memory
+			the caller allocated.  Use WTDict<WTSmallString> for
+			strings (short ones cost no allocation at all),
+			WTDict<WTStringView> for strings that live elsewhere,
+			or any copyable type such as WTDict<long>.
+
+			Keys are compared as by WTDICT_OPT_HASHED: without
+			regard to ASCII case.  Entries are kept in insertion
+			order, except that removing a key moves the last entry
+			into its place.
+	@note		This class does no locking.  Pointers and iterators
+			into a WTDict are invalidated when a key is added or
+			removed.
+ */
+template <typename V>
+class WTDict
+{
+public:
+	/*! A key/value pair */
+	struct entry
+	{
+		entry(uint32_t hash, const char *key, size_t key_len, const V &value)
+			: hash(hash), key(key, key_len), value(value) {}
+
+		/*! The cached hash of key */
+		uint32_t hash;
+		WTSmallString key;
+		V value;
+	};
+	typedef typename std::vector<entry>::iterator iterator;
+	typedef typename std::vector<entry>::const_iterator const_iterator;
+
+	WTDict() : slots(NULL), mask(0) {}
+	WTDict(const WTDict &other) : entries(other.entries), slots(NULL), mask(0)
+	{
+		if(other.slots != NULL) rebuild(other.mask + 1);
+	}
+	~WTDict() { free(slots); }
+
+	WTDict &operator=(const WTDict &other)
+	{
+		if(&other != this)
+		{
+			entries = other.entries;
+			if(other.slots != NULL)
+			{
+				rebuild(other.mask + 1);
+			} else {
+				free(slots);
+				slots = NULL;
+				mask = 0;
+			}
+		}
+		return *this;
+	}
+
+	/*!
+	@brief		Retrieve the value for a key.
+	@result		A pointer to the stored value, or NULL if the key is
+			not present.
+	 */
+	V *get(const char *key)
+	{
+		size_t slot = find_slot(key, WTHashKey(key));
+		return (slots == NULL || slots[slot] == 0 ? NULL : &(entries[slots[slot] - 1].value));
+	}
+	const V *get(const char *key) const
+	{
+		return const_cast<WTDict *>(this)->get(key);
+	}
+
+	/*!
+	@brief		Set the value for a key, replacing any old value.
+	@result		The stored value.
+	 */
+	V &set(const char *key, const V &value)
+	{
+		size_t key_len;
+		uint32_t hash = WTHashKey(key, &key_len);
+
+		// Keep the load factor at or under 3/4
+		if(slots == NULL || (entries.size() + 1) * 4 > (mask + 1) * 3)
+			rebuild(slots == NULL ? 8 : (mask + 1) * 2);
+
+		size_t slot = find_slot(key, hash);
+		if(slots[slot] != 0)
+		{
+			V &stored = entries[slots[slot] - 1].value;
+			stored = value;
+			return stored;
+		}
+
+		entries.push_back(entry(hash, key, key_len, value));
+		slots[slot] = static_cast<uint32_t>(entries.size());
+		return entries.back().value;
+	}
+
+	/*!
+	@brief		Remove a key.
+	@result		true if the key was removed; false if it wasn't there.
+	 */
+	bool remove(const char *key)
+	{
+		size_t slot = find_slot(key, WTHashKey(key));
+		if(slots == NULL || slots[slot] == 0) return false;
+
+		size_t index = slots[slot] - 1;
+		size_t last = entries.size() - 1;
+
+		// Shift back anything that probed past the hole, as WTHashTable does
+		size_t hole = slot, next = slot;
+		while(true)
+		{
+			next = (next + 1) & mask;
+			if(slots[next] == 0) break;
+
+			size_t home = entries[slots[next] - 1].hash & mask;
+			bool stays = (hole <= next) ? (hole < home && home <= next)
+						    : (hole < home || home <= next);
+			if(stays) continue;
+
+			slots[hole] = slots[next];
+			hole = next;
+		}
+		slots[hole] = 0;
+
+		if(index != last)
+		{
+			// Move the last entry into the gap, and repoint its slot
+			size_t moved = entries[last].hash & mask;
+			while(slots[moved] != last + 1)
+				moved = (moved + 1) & mask;
+			slots[moved] = static_cast<uint32_t>(index + 1);
+
+			entries[index].hash = entries[last].hash;
+			entries[index].key.swap(entries[last].key);
+			entries[index].value = entries[last].value;
+		}
+		entries.pop_back();
+
+		return true;
+	}
+
+	/*!
+	@brief		Remove all keys.
+	 */
+	void clear(void)
+	{
+		entries.clear();
+		if(slots != NULL)
+			memset(slots, 0, (mask + 1) * sizeof(uint32_t));
+	}
+
+	/*!
+	@brief		Retrieve the number of keys.
+	 */
+	size_t count(void) const { return entries.size(); }
+
+	iterator begin(void) { return entries.begin(); }
+	iterator end(void) { return entries.end(); }
+	const_iterator begin(void) const { return entries.begin(); }
+	const_iterator end(void) const { return entries.end(); }
+private:
+	std::vector<entry> entries;
+	/*! Index into entries, plus one; 0 is an empty slot */
+	uint32_t *slots;
+	/*! The number of slots, less one */
+	size_t mask;
+
+	/* The slot holding key, or the empty slot where it would go */
+	size_t find_slot(const char *key, uint32_t hash) const
+	{
+		if(slots == NULL) return 0;
+
+		size_t slot = hash & mask;
+		while(slots[slot] != 0)
+		{
+			const entry &candidate = entries[slots[slot] - 1];
+			if(candidate.hash == hash && WTKeyEqual(candidate.key.c_str(), key))
+				break;
+			slot = (slot + 1) & mask;
+		}
+		return slot;
+	}
+
+	/* Resize the slot array to size (a power of two) and refill it */
+	void rebuild(size_t size)
+	{
+		free(slots);
+		slots = static_cast<uint32_t *>(calloc(size, sizeof(uint32_t)));
+		if(slots == NULL) alloc_error("dictionary slots", size * sizeof(uint32_t));
+		mask = size - 1;
+
+		for(size_t index = 0; index < entries.size(); index++)
+		{
+			size_t slot = entries[index].hash & mask;
+			while(slots[slot] != 0)
+				slot = (slot + 1) & mask;
+			slots[slot] = static_cast<uint32_t>(index + 1);
+		}
+	}
+};
+
+#endif/*!__LIBINK_WTDICT_H__*/
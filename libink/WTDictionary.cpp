@@ -8,263 +8,707 @@
  * License: NCSA-WT
  */
 
+#ifdef _WIN32
+#	include <windows.h>	// InterlockedIncrement, InterlockedDecrement, InterlockedCompareExchange
+#endif
+
 #include "WTDictionary.h"
+#include "WTHashTable.h" // the hashed backend
+#include "WTArena.h" // WTArena
 #include <Utility.h>
 #include <stdlib.h> // NULL, calloc, realloc, free
-#include <string.h> // strlen
+#include <string.h> // strlen, memcpy, memchr
 #include <assert.h> // assert
 
-void tear_down(const char *, void *, void *);
-int add_to_buffer(const char *, void *, void *);
+/*
+ * Everything a dictionary holds lives in a store, which copies of the
+ * dictionary share until one of them changes it.  A shared store is never
+ * modified; a writer detaches first, getting a store of its own whose
+ * parent is the shared one.  The parent keeps owning the values the child
+ * inherited, so the child's entries for them have no destructor.
+ */
+struct WTDictionaryStore
+{
+	/*! Dictionaries and child stores using this store */
+	volatile long references;
+	/*! The store this one was detached from, or NULL */
+	WTDictionaryStore *parent;
+	/*! WTDICT_OPT_HASHED and WTDICT_OPT_ARENA, for children */
+	unsigned int options;
+	/* Exactly one of these is set */
+	mowgli_patricia_t *dict;
+	WTHashTable *table;
+	WTArena *arena;
+	size_t count;
+	/* Kept in step with the backend: sorted for the patricia tree,
+	   insertion order (with swap-removal) for the hash table. */
+	size_t array_size;
+	WTDictionaryEntry **entry_array;
+	const char **key_array;
+	const void **value_array;
+};
 
-#define mtex_do_or_die(x) { int i = x; if(i != 0) {fprintf(stderr, "%d\n", i); fatal_error("mutex operation error")} }
+/* Copies release the store under their own locks, so the count is read
+   with acquire ordering: a store we find unshared has no other users left. */
+#ifdef _WIN32
+#	define reference_store(s) InterlockedIncrement(&((s)->references))
+#	define unreference_store(s) InterlockedDecrement(&((s)->references))
+#	define store_references(s) InterlockedCompareExchange(&((s)->references), 0, 0)
+#else
+#	define reference_store(s) __sync_add_and_fetch(&((s)->references), 1)
+#	define unreference_store(s) __sync_sub_and_fetch(&((s)->references), 1)
+#	define store_references(s) __atomic_load_n(&((s)->references), __ATOMIC_ACQUIRE)
+#endif
 
-libAPI WTDictionary::WTDictionary(bool manage_memory)
+static WTDictionaryStore *new_store(unsigned int options)
 {
-	mowgli_init();
-	mtex_do_or_die(mowgli_mutex_create(&(this->access_mutex)));
-	mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-	this->dict = mowgli_patricia_create(NULL);
-	mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));
-	this->_count = 0;
-	this->manager = manage_memory;
-	this->vectors_valid = true;
-	this->key_array = NULL;
-	this->value_array = NULL;
+	WTDictionaryStore *store = static_cast<WTDictionaryStore *>(calloc(1, sizeof(WTDictionaryStore)));
+	if(store == NULL) alloc_error("dictionary store", sizeof(WTDictionaryStore));
+	
+	store->references = 1;
+	store->options = options;
+	if(options & WTDICT_OPT_HASHED)
+		store->table = new WTHashTable;
+	else
+		store->dict = mowgli_patricia_create(NULL);
+	if(options & WTDICT_OPT_ARENA)
+		store->arena = new WTArena;
+	
+	return store;
+}
+
+static inline void release_value(WTDictionaryEntry *entry)
+{
+	if(entry->destructor != NULL)
+		entry->destructor(const_cast<void *>(entry->value));
+}
+
+/* The key is stored right after the entry, so the two are one allocation. */
+static WTDictionaryEntry *new_entry(WTDictionaryStore *store,
+				    const char *key, size_t key_len,
+				    const void *value,
+				    WTDictionaryDestructor destructor)
+{
+	size_t entry_len = sizeof(WTDictionaryEntry) + key_len + 1;
+	WTDictionaryEntry *entry;
+	
+	if(store->arena != NULL)
+	{
+		entry = static_cast<WTDictionaryEntry *>(store->arena->alloc(entry_len));
+	} else {
+		entry = static_cast<WTDictionaryEntry *>(malloc(entry_len));
+		if(entry == NULL) alloc_error("dictionary entry", entry_len);
+	}
+	
+	char *key_copy = reinterpret_cast<char *>(entry + 1);
+	memcpy(key_copy, key, key_len);
+	key_copy[key_len] = '\0';
+	
+	entry->key = key_copy;
+	entry->key_len = key_len;
+	entry->value = value;
+	entry->destructor = destructor;
+	entry->index = 0;
+	
+	return entry;
+}
+
+static inline void free_entry(WTDictionaryStore *store, WTDictionaryEntry *entry)
+{
+	// Arena entries go when the arena is reset
+	if(store->arena == NULL) free(entry);
+}
+
+static WTDictionaryEntry *find_entry(WTDictionaryStore *store, const char *key)
+{
+	if(store->table != NULL)
+	{
+		WTHashSlot *slot = store->table->find(key);
+		return (slot == NULL ? NULL : static_cast<WTDictionaryEntry *>(slot->value));
+	}
+	
+	return static_cast<WTDictionaryEntry *>(mowgli_patricia_retrieve(store->dict, key));
+}
+
+/* Whether setting key to value would leave the store as it is */
+static bool unchanged_by(WTDictionaryStore *store, const char *key, const void *value)
+{
+	WTDictionaryEntry *entry = find_entry(store, key);
+	return (entry == NULL ? value == NULL : entry->value == value);
+}
+
+static void insert_entry(WTDictionaryStore *store, WTDictionaryEntry *entry)
+{
+	size_t position = store->count;
+	
+	if(store->table != NULL)
+		store->table->insert(entry->key, entry);
+	else
+		mowgli_patricia_add(store->dict, entry->key, entry);
+	
+	if(store->array_size == store->count)
+	{
+		store->array_size = (store->array_size == 0 ? 8 : store->array_size * 2);
+		store->entry_array = static_cast<WTDictionaryEntry **>(realloc(store->entry_array, store->array_size * sizeof(WTDictionaryEntry *)));
+		store->key_array = static_cast<const char **>(realloc(store->key_array, store->array_size * sizeof(const char *)));
+		store->value_array = static_cast<const void **>(realloc(store->value_array, store->array_size * sizeof(const void *)));
+		if(store->entry_array == NULL || store->key_array == NULL || store->value_array == NULL)
+			alloc_error("dictionary arrays", store->array_size * sizeof(void *));
+	}
+	
+	if(store->table == NULL)
+	{
+		/* Keep the arrays in the same (strcmp) order as the tree: find
+		   the first key that sorts after ours and slide the rest up.
+		   Keys often arrive in order, so try the end first. */
+		size_t low = 0, high = store->count;
+		if(high > 0 && strcmp(store->key_array[high - 1], entry->key) < 0)
+			low = high;
+		while(low < high)
+		{
+			size_t middle = low + (high - low) / 2;
+			if(strcmp(store->key_array[middle], entry->key) < 0)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		position = low;
+		
+		size_t moving = store->count - position;
+		memmove(store->entry_array + position + 1, store->entry_array + position, moving * sizeof(WTDictionaryEntry *));
+		memmove(store->key_array + position + 1, store->key_array + position, moving * sizeof(const char *));
+		memmove(store->value_array + position + 1, store->value_array + position, moving * sizeof(const void *));
+		for(size_t next = position + 1; next <= store->count; next++)
+			store->entry_array[next]->index = next;
+	}
+	
+	store->entry_array[position] = entry;
+	store->key_array[position] = entry->key;
+	store->value_array[position] = entry->value;
+	entry->index = position;
+	++(store->count);
+}
+
+static void remove_entry(WTDictionaryStore *store, WTDictionaryEntry *entry)
+{
+	size_t position = entry->index;
+	
+	if(store->table != NULL)
+		store->table->remove(entry->key);
+	else
+		mowgli_patricia_delete(store->dict, entry->key);
+	
+	--(store->count);
+	
+	if(store->table == NULL)
+	{
+		// Close the gap, keeping the arrays sorted.
+		size_t moving = store->count - position;
+		memmove(store->entry_array + position, store->entry_array + position + 1, moving * sizeof(WTDictionaryEntry *));
+		memmove(store->key_array + position, store->key_array + position + 1, moving * sizeof(const char *));
+		memmove(store->value_array + position, store->value_array + position + 1, moving * sizeof(const void *));
+		for(size_t next = position; next < store->count; next++)
+			store->entry_array[next]->index = next;
+	}
+	 else if(position != store->count)
+	{
+		// Order doesn't matter; move the last entry into the gap.
+		store->entry_array[position] = store->entry_array[store->count];
+		store->key_array[position] = store->key_array[store->count];
+		store->value_array[position] = store->value_array[store->count];
+		store->entry_array[position]->index = position;
+	}
+	
+	free_entry(store, entry);
 }
 
-void tear_down(const char *key, void *data, void *privdata)
+static void release_store(WTDictionaryStore *store)
 {
-	WTDictionary *dict = static_cast<WTDictionary *>(privdata);
-	bool special = false;
-	for(unsigned int i = 0; i < dict->special_keys.size(); i++)
+	while(store != NULL && unreference_store(store) == 0)
 	{
-		if(strcasecmp(dict->special_keys.at(i), key) == 0)
+		WTDictionaryStore *parent = store->parent;
+		
+		for(size_t next = 0; next < store->count; next++)
 		{
-			special = true;
-			break;
+			WTDictionaryEntry *entry = store->entry_array[next];
+			release_value(entry);
+			free_entry(store, entry);
 		}
+		if(store->dict != NULL) mowgli_patricia_destroy(store->dict, NULL, NULL);
+		delete store->table;
+		delete store->arena;
+		free(store->entry_array);
+		free(store->key_array);
+		free(store->value_array);
+		free(store);
+		
+		// The parent may have been kept alive only by us
+		store = parent;
 	}
+}
+
+libAPI WTDictionary::WTDictionary(bool manage_memory, unsigned int options)
+{
+	mowgli_init();
+	this->store = new_store(options & (WTDICT_OPT_HASHED | WTDICT_OPT_ARENA));
+	this->manager = manage_memory;
+	this->locking = !(options & WTDICT_OPT_UNLOCKED);
+}
+
+libAPI WTDictionary::WTDictionary(const char *const *keys, const void *const *values,
+				  size_t count, bool manage_memory,
+				  unsigned int options)
+{
+	mowgli_init();
+	this->store = new_store(options & (WTDICT_OPT_HASHED | WTDICT_OPT_ARENA));
+	this->manager = manage_memory;
+	this->locking = !(options & WTDICT_OPT_UNLOCKED);
+	
+	// Nobody else can see us yet, so there is nothing to lock.
+	WTDictionaryDestructor destructor = policy_destructor(WTDICT_KEY_DEFAULT);
+	for(size_t next = 0; next < count; next++)
+		if(keys[next] != NULL) store_value(keys[next], values[next], destructor);
+}
+
+libAPI WTDictionary::WTDictionary(const WTDictionary &old)
+{
+	WTDictionary &source = const_cast<WTDictionary &>(old);
+	
+	source.read_lock();
+	this->store = source.store;
+	reference_store(this->store);
+	source.read_unlock();
+	
+	this->manager = source.manager;
+	this->locking = source.locking;
+}
+
+libAPI WTDictionary &WTDictionary::operator=(const WTDictionary &old)
+{
+	WTDictionary &source = const_cast<WTDictionary &>(old);
+	WTDictionaryStore *shared;
+	
+	if(&source == this) return *this;
+	
+	source.read_lock();
+	shared = source.store;
+	reference_store(shared);
+	source.read_unlock();
+	
+	write_lock();
+	release_store(this->store);
+	this->store = shared;
+	this->manager = source.manager;
+	write_unlock();
 	
-	if(dict->manager && !special)
-		free(data);
-	else if(!dict->manager && special)
-		free(data);
+	// Not under the lock, which has to be unlocked the way it was locked
+	this->locking = source.locking;
+	
+	return *this;
 }
 
 libAPI WTDictionary::~WTDictionary()
 {
-	clear();
-	mowgli_patricia_destroy(this->dict, NULL, NULL);
-	mowgli_mutex_destroy(&(this->access_mutex));
-	free(value_array);
-	free(key_array);
+	release_store(this->store);
 }
 
-libAPI void WTDictionary::clear(void)
+void WTDictionary::read_lock(void)
 {
-	mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-	mowgli_patricia_destroy(this->dict, tear_down, this);
-	this->_count = 0;
-	keys.clear();
-	values.clear();
-	this->vectors_valid = true;
-	this->dict = mowgli_patricia_create(NULL);
-	mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));
+	if(this->locking) this->access_lock.lock_shared();
 }
 
-libAPI void WTDictionary::set(const char *key, const void *value, WTDictionaryMemoryPolicy managed)
+void WTDictionary::read_unlock(void)
 {
-	const void *old_value;
-	bool old_special = false, new_special = false;
-	vector<const char *>::iterator special_iter;
+	if(this->locking) this->access_lock.unlock_shared();
+}
+
+void WTDictionary::write_lock(void)
+{
+	if(this->locking) this->access_lock.lock();
+}
+
+void WTDictionary::write_unlock(void)
+{
+	if(this->locking) this->access_lock.unlock();
+}
+
+/* Called under the write lock before changing anything. */
+void WTDictionary::detach(void)
+{
+	WTDictionaryStore *shared = this->store;
 	
-	if(key == NULL)
+	if(store_references(shared) == 1)
 		return;
 	
-	for(vector<const char *>::iterator iter = special_keys.begin();
-	    iter != special_keys.end();
-	    iter++)
+	/* Copy the entries, but not the values: the shared store still owns
+	   those, and our reference to it becomes the child's parent link. */
+	WTDictionaryStore *child = new_store(shared->options);
+	child->parent = shared;
+	for(size_t next = 0; next < shared->count; next++)
 	{
-		const char *val = *iter;
-		if(strcasecmp(val, key) == 0)
+		WTDictionaryEntry *entry = shared->entry_array[next];
+		insert_entry(child, new_entry(child, entry->key, entry->key_len,
+					      entry->value, NULL));
+	}
+	
+	this->store = child;
+}
+
+libAPI void WTDictionary::clear(void)
+{
+	WTDictionaryStore *store;
+	
+	write_lock();
+	store = this->store;
+	if(store_references(store) > 1)
+	{
+		// Nothing to copy; just stop sharing.
+		this->store = new_store(store->options);
+		release_store(store);
+	} else {
+		for(size_t next = 0; next < store->count; next++)
 		{
-			old_special = true;
-			special_iter = iter;
-			break;
+			WTDictionaryEntry *entry = store->entry_array[next];
+			release_value(entry);
+			free_entry(store, entry);
 		}
+		if(store->arena != NULL) store->arena->reset();
+		if(store->table != NULL)
+		{
+			store->table->clear();
+		} else {
+			mowgli_patricia_destroy(store->dict, NULL, NULL);
+			store->dict = mowgli_patricia_create(NULL);
+		}
+		store->count = 0;
 	}
+	write_unlock();
+}
+
+WTDictionaryDestructor WTDictionary::policy_destructor(WTDictionaryMemoryPolicy managed)
+{
+	bool owned;
 	
-	if(manager)
+	if(managed == WTDICT_KEY_DEFAULT)
+		owned = this->manager;
+	else
+		owned = (managed == WTDICT_KEY_MANAGED);
+	
+	return (owned ? &free : NULL);
+}
+
+libAPI void WTDictionary::set(const char *key, const void *value, WTDictionaryMemoryPolicy managed)
+{
+	set(key, value, policy_destructor(managed));
+}
+
+libAPI void WTDictionary::set(const char *key, const void *value, WTDictionaryDestructor destructor)
+{
+	if(key == NULL)
+		return;
+	
+	/* The lookup and the change happen under the same write lock; going
+	   through get() here would mean taking the lock twice, and another
+	   writer could sneak in between. */
+	write_lock();
+	// Nothing to do shouldn't cost a shared store being copied
+	if(!unchanged_by(this->store, key, value))
 	{
-		if(managed == WTDICT_KEY_UNMANAGED)
-			new_special = true;
-	} else {
-		if(managed == WTDICT_KEY_MANAGED)
-			new_special = true;
+		detach();
+		store_value(key, value, destructor);
 	}
+	write_unlock();
+}
+
+libAPI void WTDictionary::set_many(const char *const *keys, const void *const *values,
+				   size_t count, WTDictionaryMemoryPolicy managed)
+{
+	WTDictionaryDestructor destructor = policy_destructor(managed);
 	
-	if((old_value = get(key)) == NULL)
+	write_lock();
+	for(size_t next = 0; next < count; next++)
+	{
+		if(keys[next] == NULL || unchanged_by(this->store, keys[next], values[next]))
+			continue;
+		detach();
+		store_value(keys[next], values[next], destructor);
+	}
+	write_unlock();
+}
+
+/* Called under the write lock, after detach. */
+void WTDictionary::store_value(const char *key, const void *value, WTDictionaryDestructor destructor)
+{
+	WTDictionaryEntry *entry;
+	
+	if((entry = find_entry(this->store, key)) == NULL)
 	{
 		// we can't delete something that doesn't exist
-		if(value == NULL) return;
-
-		/* do not allow reads while adding to the dict */
-		mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-		mowgli_patricia_add(this->dict, key, const_cast<void *>(value));
-		++(this->_count);
-		this->vectors_valid = false;
-		if(!old_special && new_special) special_keys.push_back(key);
-		else if(old_special && !new_special) special_keys.erase(special_iter);
-		mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));
-		return;
+		if(value != NULL)
+			insert_entry(this->store, new_entry(this->store, key, strlen(key), value, destructor));
 	}
-	 else
+	 else if(entry->value != value) /* If the value is the same as before, just skip. */
 	{
-		/* If the value is the same as before, just skip. */
-		if(old_value == value)
-			return;
-		
-		/* XXX This makes corgi sad.  We're in a critical section for
-		   a LONG ARSE TIME with this.  We have to retrieve the old,
-		   free it, delete it, decrement, and then add and increment
-		   (if applicable).  But it MUST be locked, because otherwise
-		   Very Bad Things happen. */
-		mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-		if(manager && !old_special)
-		{
-			free(mowgli_patricia_retrieve(this->dict, key));
-		} else if(!manager && old_special) {
-			free(mowgli_patricia_retrieve(this->dict, key));
-		};
-		mowgli_patricia_delete(this->dict, key);
-		--(this->_count);
+		// The old value goes according to the policy it was set with.
+		release_value(entry);
 		if(value != NULL)
 		{
-			mowgli_patricia_add(this->dict, key, const_cast<void *>(value));
-			++(this->_count);
-		};
-		this->vectors_valid = false;
-		if(old_special != new_special)
-		{
-			if(old_special) special_keys.erase(special_iter);
-			else special_keys.push_back(key);
+			// Replace in place; only a delete gives up the entry.
+			entry->value = value;
+			entry->destructor = destructor;
+			this->store->value_array[entry->index] = value;
+		} else {
+			remove_entry(this->store, entry);
 		}
-		mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));
-		
-		return;
 	};
 }
 
+libAPI void WTDictionary::set_copy(const char *key, const char *value)
+{
+	if(key == NULL || value == NULL)
+		return;
+	
+	set_copy(key, strlen(key), value, strlen(value));
+}
+
+libAPI void WTDictionary::set_copy(const char *key, size_t key_len,
+				   const char *value, size_t value_len)
+{
+	if(key == NULL || value == NULL)
+		return;
+	
+	write_lock();
+	detach();
+	store_copy(key, key_len, value, value_len);
+	write_unlock();
+}
+
+libAPI void WTDictionary::set_copy_many(const char *const *keys, const char *const *values,
+					size_t count)
+{
+	write_lock();
+	detach();
+	for(size_t next = 0; next < count; next++)
+	{
+		if(keys[next] == NULL || values[next] == NULL) continue;
+		store_copy(keys[next], strlen(keys[next]), values[next], strlen(values[next]));
+	}
+	write_unlock();
+}
+
+/* Called under the write lock, after detach. */
+void WTDictionary::store_copy(const char *key, size_t key_len,
+			      const char *value, size_t value_len)
+{
+	WTDictionaryStore *store = this->store;
+	WTDictionaryEntry *fresh, *entry;
+	WTDictionaryDestructor destructor;
+	char *copy;
+	
+	
+	if(store->arena != NULL)
+	{
+		copy = store->arena->strndup(value, value_len);
+		destructor = NULL;
+	} else {
+		copy = static_cast<char *>(malloc(value_len + 1));
+		if(copy == NULL) alloc_error("dictionary value", value_len + 1);
+		memcpy(copy, value, value_len);
+		copy[value_len] = '\0';
+		destructor = &free;
+	}
+	
+	/* key needn't be terminated, so build the entry first and look up
+	   its (terminated) copy of the key. */
+	fresh = new_entry(store, key, key_len, copy, destructor);
+	if((entry = find_entry(store, fresh->key)) == NULL)
+	{
+		insert_entry(store, fresh);
+	} else {
+		release_value(entry);
+		entry->value = copy;
+		entry->destructor = destructor;
+		store->value_array[entry->index] = copy;
+		free_entry(store, fresh);
+	}
+}
+
 libAPI const void *WTDictionary::get(const char *key)
 {
-	void *value;
+	WTDictionaryEntry *entry;
+	const void *value;
 	
 	if(key == NULL)
 		return NULL;
 	
-	/* Only one thread shall read at a time */
-	mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-	value = mowgli_patricia_retrieve(this->dict, key);
-	mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));
+	/* Any number of readers may look at once */
+	read_lock();
+	entry = find_entry(this->store, key);
+	value = (entry == NULL ? NULL : entry->value);
+	read_unlock();
 	
 	return value;
 }
 
-int fill_my_vector(const char *key, void *data, void *privdata)
+libAPI const char **WTDictionary::allKeys(void)
 {
-	WTDictionary *dict = reinterpret_cast<WTDictionary *>(privdata);
-	if(!key || !data) return -1;
-	dict->keys.push_back(key);
-	dict->values.push_back(data);
-	return 0;
+	return this->store->key_array;
 }
 
-void WTDictionary::reloadVectors(void)
+libAPI const void **WTDictionary::allValues(void)
 {
-	if(!this->vectors_valid)
-	{
-		keys.clear();
-		values.clear();
-		mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-		mowgli_patricia_foreach(this->dict, &fill_my_vector, this);
-		mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));	
-		this->vectors_valid = true;
-	};
-	
-	return;
+	return this->store->value_array;
 }
 
-libAPI const char **WTDictionary::allKeys(void)
+libAPI WTDictionary::iterator WTDictionary::begin(void)
 {
-	key_array = static_cast<const char **>(realloc(key_array, _count * sizeof(const char *)));
-	if(key_array == NULL) alloc_error("dictionary key array", _count * sizeof(const char *));
-	reloadVectors();
-	for(unsigned int key = 0; key < _count; key++)
-		key_array[key] = keys.at(key);
-	return key_array;
+	return iterator(this->store->entry_array);
 }
 
-libAPI const void **WTDictionary::allValues(void)
+libAPI WTDictionary::iterator WTDictionary::end(void)
 {
-	value_array = static_cast<const void **>(realloc(value_array, _count * sizeof(const void *)));
-	if(value_array == NULL) alloc_error("dictionary value array", _count * sizeof(const void *));
-	reloadVectors();
-	for(unsigned int value = 0; value < _count; value++)
-		value_array[value] = values.at(value);
-	return value_array;
+	return iterator(this->store->entry_array + this->store->count);
 }
 
 libAPI const size_t WTDictionary::count(void)
 {
-	return this->_count;
+	return this->store->count;
 }
 
-int add_to_buffer(const char *key, void *data, void *privdata)
+/*
+ * A format for ::all, split around its two %s conversions.  The pieces
+ * point into the caller's format string and may still contain %% escapes;
+ * piece_len is the raw length and out_len what it expands to.
+ */
+struct all_format
+{
+	const char *piece[3];
+	size_t piece_len[3];
+	size_t out_len[3];
+};
+
+static void split_format(const char *fmt, all_format *format)
 {
-	assert(key != NULL);
-	assert(data != NULL);
+	const char *next = fmt;
+	int piece = 0;
 	
-	if(key == NULL)
+	format->piece[0] = fmt;
+	format->piece_len[0] = format->out_len[0] = 0;
+	while(*next != '\0')
 	{
-		nonfatal_error("NULL key in add_to_buffer");
-		return -1;
-	};
+		if(*next == '%' && *(next + 1) == '%')
+		{
+			next += 2;
+			++(format->out_len[piece]);
+			continue;
+		}
+		if(*next == '%' && *(next + 1) == 's' && piece < 2)
+		{
+			format->piece_len[piece] = next - format->piece[piece];
+			next += 2;
+			++piece;
+			format->piece[piece] = next;
+			format->piece_len[piece] = format->out_len[piece] = 0;
+			continue;
+		}
+		++next;
+		++(format->out_len[piece]);
+	}
+	format->piece_len[piece] = next - format->piece[piece];
 	
-	if(data == NULL)
+	assert(piece == 2);
+	while(piece < 2)
 	{
-		nonfatal_error("NULL data in add_to_buffer");
-		return -1;
-	};
-	
-	WTSizedBuffer *dict = static_cast<WTSizedBuffer *>(privdata);
-	const char *next = static_cast<char *>(data);
-	if(next == NULL) next = "";
-	char *temp_buffer = NULL;
-	const char *fmt = dict->fmt;
-	size_t next_len = strlen(key) + strlen(next) + strlen(fmt) - 4; /*%s%s*/
-	size_t old_len = dict->buffer_len;
+		++piece;
+		format->piece[piece] = next;
+		format->piece_len[piece] = format->out_len[piece] = 0;
+	}
+}
+
+/* Bounded output, as for snprintf: everything is counted, but only as much
+   as fits (leaving room for the NUL) is written. */
+struct all_writer
+{
+	char *out;
+	size_t room;
+	size_t total;
+};
+
+static inline void write_bytes(all_writer *writer, const char *bytes, size_t len)
+{
+	size_t fits = (len < writer->room ? len : writer->room);
+	memcpy(writer->out, bytes, fits);
+	writer->out += fits;
+	writer->room -= fits;
+	writer->total += len;
+}
 
-	dict->buffer_len += next_len;
+static void write_literal(all_writer *writer, const char *piece, size_t len)
+{
+	const char *end = piece + len;
+	const char *escape;
 	
-	if(old_len == 0)
+	while((escape = static_cast<const char *>(memchr(piece, '%', end - piece))) != NULL)
 	{
-		++(dict->buffer_len);
-		dict->buffer = static_cast<char *>(calloc(dict->buffer_len, sizeof(char)));
-		snprintf(dict->buffer, dict->buffer_len, fmt, key, next);
+		// write up to and including the first % of a %%, then skip the second
+		write_bytes(writer, piece, escape - piece + 1);
+		piece = escape + 1;
+		if(piece < end && *piece == '%') ++piece;
 	}
-	 else
+	write_bytes(writer, piece, end - piece);
+}
+
+size_t WTDictionary::serialise(char *buffer, size_t size, const char *fmt)
+{
+	all_format format;
+	all_writer writer;
+	size_t literal_len;
+	bool escaped;
+	
+	split_format(fmt, &format);
+	literal_len = format.out_len[0] + format.out_len[1] + format.out_len[2];
+	escaped = (literal_len != format.piece_len[0] + format.piece_len[1] + format.piece_len[2]);
+	
+	writer.out = buffer;
+	writer.room = (size == 0 ? 0 : size - 1);
+	writer.total = 0;
+	
+	for(size_t next = 0; next < this->store->count; next++)
 	{
-		dict->buffer = static_cast<char *>(realloc(dict->buffer, dict->buffer_len * sizeof(char)));
-		++next_len; // for the nul byte
-		temp_buffer = static_cast<char *>(calloc(next_len, sizeof(char)));
-		if(temp_buffer == NULL) alloc_error("Temporary dictionary buffer", next_len);
-		snprintf(temp_buffer, next_len, fmt, key, next);
-		strncat(dict->buffer, const_cast<const char *>(temp_buffer), dict->buffer_len);
-		free(temp_buffer);
-	};
+		const WTDictionaryEntry *entry = this->store->entry_array[next];
+		const char *value = static_cast<const char *>(entry->value);
 		
-	return 0;
+		if(writer.room == 0)
+		{
+			// Nothing more will fit; just count the rest.
+			writer.total += literal_len + entry->key_len + strlen(value);
+			continue;
+		}
+		
+		if(escaped) write_literal(&writer, format.piece[0], format.piece_len[0]);
+		else write_bytes(&writer, format.piece[0], format.piece_len[0]);
+		write_bytes(&writer, entry->key, entry->key_len);
+		if(escaped) write_literal(&writer, format.piece[1], format.piece_len[1]);
+		else write_bytes(&writer, format.piece[1], format.piece_len[1]);
+		write_bytes(&writer, value, strlen(value));
+		if(escaped) write_literal(&writer, format.piece[2], format.piece_len[2]);
+		else write_bytes(&writer, format.piece[2], format.piece_len[2]);
+	}
+	
+	if(size != 0) *(writer.out) = '\0';
+	
+	return writer.total;
+}
+
+libAPI size_t WTDictionary::allInto(char *buffer, size_t size, const char *fmt)
+{
+	size_t length;
+	
+	read_lock();
+	length = serialise(buffer, size, (fmt == NULL ? "\r\n%s: %s" : fmt));
+	read_unlock();
+	
+	return length;
 }
 
 libAPI WTSizedBuffer *WTDictionary::all(const char *fmt)
@@ -277,9 +721,14 @@ libAPI WTSizedBuffer *WTDictionary::all(const char *fmt)
 	else
 		all_buffer->fmt = fmt;
 	
-	mtex_do_or_die(mowgli_mutex_lock(&(this->access_mutex)));
-	mowgli_patricia_foreach(this->dict, &add_to_buffer, all_buffer);
-	mtex_do_or_die(mowgli_mutex_unlock(&(this->access_mutex)));
+	/* Measure, then write into a buffer of exactly the right size; both
+	   passes happen under one lock so the size can't go stale. */
+	read_lock();
+	all_buffer->buffer_len = serialise(NULL, 0, all_buffer->fmt);
+	all_buffer->buffer = static_cast<char *>(malloc(all_buffer->buffer_len + 1));
+	if(all_buffer->buffer == NULL) alloc_error("dictionary buffer", all_buffer->buffer_len + 1);
+	serialise(all_buffer->buffer, all_buffer->buffer_len + 1, all_buffer->fmt);
+	read_unlock();
 	
 	return all_buffer;
 }
@@ -13,6 +13,7 @@
 
 #include <libmowgli/mowgli.h> // the mowgli_patricia backend.
 #include <Utility.h> //libAPI
+#include "WTRWLock.h" // WTRWLock
 #include <vector>
 
 #ifndef MOWGLI_PATRICIA_ALLOWS_NULL_CANONIZE
@@ -31,6 +32,59 @@ enum WTDictionaryMemoryPolicy
 	WTDICT_KEY_DEFAULT
 };
 
+/*! Options for constructing a WTDictionary; these may be OR'd together. */
+enum WTDictionaryOption
+{
+	/*! Readers share the dictionary; writers have it to themselves. */
+	WTDICT_OPT_DEFAULT = 0x0,
+	/*! Do no locking at all.  The dictionary must only be used by one
+	    thread at a time; this is for short-lived, private dictionaries. */
+	WTDICT_OPT_UNLOCKED = 0x1,
+	/*! Keep keys in a hash table rather than a patricia tree.  Lookups
+	    take a single probe in the common case and keys are compared
+	    without regard to case, but ::allKeys, ::allValues and ::all
+	    are no longer sorted. */
+	WTDICT_OPT_HASHED = 0x2,
+	/*! Allocate entries, and values stored with ::set_copy, from an
+	    arena which is released in one go by ::clear or on deletion.
+	    Removing or replacing a key gives nothing back until then, so
+	    this is for short-lived dictionaries that are built and read.
+	    Only the entries and copied values come from the arena: the
+	    patricia tree's nodes, the hash table's slots and the arrays
+	    behind ::allKeys and ::allValues are still allocated from the
+	    heap. */
+	WTDICT_OPT_ARENA = 0x4
+};
+
+struct WTDictionaryStore;
+
+/*!
+	@brief		Releases a value when it leaves a WTDictionary.
+	@details	Called when the value is replaced, its key is removed
+			or the dictionary is cleared or destroyed.
+ */
+typedef void (*WTDictionaryDestructor)(void *value);
+
+/*!
+	@brief		A key/value pair in a WTDictionary.
+	@details	Entries belong to their dictionary.  An entry stays put
+			when its value is replaced; it is freed when its key is
+			removed or the dictionary is cleared.
+ */
+struct WTDictionaryEntry
+{
+	/*! The key; stored with the entry */
+	const char *key;
+	/*! The length of key */
+	size_t key_len;
+	/*! The value associated with key */
+	const void *value;
+	/*! Releases value; NULL if the dictionary doesn't own it */
+	WTDictionaryDestructor destructor;
+	/*! The position of this entry in ::allKeys and ::allValues */
+	size_t index;
+};
+
 /*!
 	@brief		sized buffer
 	@details	a buffer with its current size
@@ -50,6 +104,10 @@ typedef struct buf_struct
 	@details	This class implements a C++ interface to a dictionary
 			library with alphabetical sorting using the standard C
 			strcasecmp (or platform equivalent).
+
+			Dictionaries created with WTDICT_OPT_HASHED trade the
+			sorting for a hash table, which is cheaper for point
+			lookups (HTTP headers, form parameters and the like).
  */
 class WTDictionary
 {
@@ -58,9 +116,30 @@ public:
 	@brief		Construct a new, empty dictionary.
 	@param		manage_memory	If this is set, all values will be
 					free()d upon deletion of the dictionary.
+	@param		options		WTDictionaryOption flags.
 	@result		A new, empty WTDictionary object.
+	@note		By default, any number of threads may ::get at once
+			without waiting on each other; only writers take the
+			dictionary exclusively.
 	 */
-	libAPI WTDictionary(bool manage_memory = true);
+	libAPI WTDictionary(bool manage_memory = true,
+			    unsigned int options = WTDICT_OPT_DEFAULT);
+	/*!
+	@brief		Construct a new dictionary from arrays of keys and
+			values.
+	@param		keys		The keys.  If these are sorted (by
+					strcmp), each is simply appended.
+	@param		values		The value for each key, as for ::set.
+	@param		count		The number of keys.
+	@param		manage_memory	As for the default constructor.
+	@param		options		WTDictionaryOption flags.
+	@result		A new WTDictionary containing the keys and values.
+			Unsorted keys work too, just more slowly; a repeated
+			key takes the last value given for it.
+	 */
+	libAPI WTDictionary(const char *const *keys, const void *const *values,
+			    size_t count, bool manage_memory = true,
+			    unsigned int options = WTDICT_OPT_DEFAULT);
 	/*!
 	@brief		Construct a new dictionary, copying the contents of an
 			old dictionary.
@@ -70,8 +149,18 @@ public:
 			dictionary.  Note that this dictionary will
 			automatically inherit the old dictionary's memory
 			management flag.
+	@details	Copying is O(1): the two dictionaries share their
+			contents until either is changed, and only then does
+			the changed one take a copy of the entries (never of
+			the values).  Values set before the copy are released
+			when the last dictionary sharing them lets go.
 	 */
 	libAPI WTDictionary(const WTDictionary &old);
+	/*!
+	@brief		Replace the contents of this dictionary with those of
+			another, sharing them as the copy constructor does.
+	 */
+	libAPI WTDictionary &operator=(const WTDictionary &old);
 	libAPI ~WTDictionary();
 	
 	/*!
@@ -94,6 +183,60 @@ public:
 	 */
 	libAPI void set(const char *key, const void *data,
 			WTDictionaryMemoryPolicy managed = WTDICT_KEY_DEFAULT);
+	/*!
+	@brief		Set the value of a specified key, with a function to
+			release it.
+	@param		key		The key to set the value for.
+	@param		data		The new value of the key.
+	@param		destructor	Called on data when it leaves the
+					dictionary.  If this is NULL, the
+					dictionary does not own data.
+	@details	Otherwise identical to the other form of ::set, which
+			uses free (or nothing) as the destructor.  The policy
+			is kept with the key, so it costs nothing to look up.
+	 */
+	libAPI void set(const char *key, const void *data,
+			WTDictionaryDestructor destructor);
+	/*!
+	@brief		Set the values of several keys at once.
+	@param		keys		The keys to set.
+	@param		values		The new value of each key; NULL removes
+					the key, as for ::set.
+	@param		count		The number of keys.
+	@param		managed		The management policy of these keys.
+	@details	All the changes are made under a single lock, so
+			readers see either none or all of them.
+	 */
+	libAPI void set_many(const char *const *keys, const void *const *values,
+			     size_t count,
+			     WTDictionaryMemoryPolicy managed = WTDICT_KEY_DEFAULT);
+	/*!
+	@brief		Set the value of a specified key to a copy of a string.
+	@param		key		The key to set the value for.
+	@param		value		The string to copy.
+	@details	The dictionary always owns the copy, whatever its
+			memory management flag.  With WTDICT_OPT_ARENA the copy
+			comes from the arena; otherwise it is free()d as usual.
+	 */
+	libAPI void set_copy(const char *key, const char *value);
+	/*!
+	@brief		Set the value of a specified key to a copy of a string,
+			where neither key nor value need be NUL-terminated.
+	@param		key		The key to set the value for.
+	@param		key_len		The length of key.
+	@param		value		The string to copy.
+	@param		value_len	The length of value.
+	 */
+	libAPI void set_copy(const char *key, size_t key_len,
+			     const char *value, size_t value_len);
+	/*!
+	@brief		Set several keys to copies of strings at once, under a
+			single lock.
+	@details	As ::set_copy for each key.  Keys or values which are
+			NULL are skipped.
+	 */
+	libAPI void set_copy_many(const char *const *keys, const char *const *values,
+				  size_t count);
 	
 	/*!
 	@brief		Remove all keys from the dictionary.
@@ -107,10 +250,9 @@ public:
 	@result		An array of the keys from this dictionary.  Use the
 			::count method to determine the number of keys in the
 			dictionary for iteration.
-	 @note		The allKeys and allValues methods will cache their
-			results for future calls to avoid overhead.  Subsequent
-			calls will return immediately as long as the dictionary
-			is not modified.
+	@note		The array is kept up to date as the dictionary changes,
+			so this never copies.  It belongs to the dictionary and
+			is invalidated when a key is added or removed.
 	 */
 	libAPI const char **allKeys(void);
 	/*!
@@ -118,13 +260,41 @@ public:
 	@result		An array of the values from this dictionary.  As long as
 			no other thread modifies the dictionary between calls,
 			these values will match the keys found in ::allKeys.
-	@note		The allKeys and allValues methods will cache their
-			results for future calls to avoid overhead.  Subsequent
-			calls will return immediately as long as the dictionary
-			is not modified.
+	@note		As with ::allKeys, the array belongs to the dictionary
+			and is invalidated when a key is added or removed.
 	 */
 	libAPI const void **allValues(void);
 	
+	/*!
+	@brief		Forward iterator over the entries in a dictionary.
+	@details	Entries come in the same order as ::allKeys.  Like
+			::allKeys, iterating takes no lock; the iterator is
+			invalidated when a key is added or removed.
+	 */
+	class iterator
+	{
+	public:
+		iterator(WTDictionaryEntry **position = NULL) : position(position) {}
+		
+		const WTDictionaryEntry &operator*(void) const { return **position; }
+		const WTDictionaryEntry *operator->(void) const { return *position; }
+		iterator &operator++(void) { ++position; return *this; }
+		iterator operator++(int) { iterator old = *this; ++position; return old; }
+		bool operator==(const iterator &other) const { return position == other.position; }
+		bool operator!=(const iterator &other) const { return position != other.position; }
+	private:
+		WTDictionaryEntry **position;
+	};
+	
+	/*!
+	@brief		Retrieve an iterator to the first entry.
+	 */
+	libAPI iterator begin(void);
+	/*!
+	@brief		Retrieve an iterator past the last entry.
+	 */
+	libAPI iterator end(void);
+	
 	/*!
 	@brief		Retrieve a string concatenation of all keys and values
 			in the dictionary.
@@ -135,8 +305,25 @@ public:
 			concatenation of the keys and values in this dictionary.
 			Note that the buffer returned must be free()d to avoid
 			a memory leak.
+	@note		fmt must contain exactly two %s conversions (the key,
+			then the value); the only other escape allowed is %%.
 	 */
 	libAPI WTSizedBuffer *all(const char *fmt = NULL);
+	/*!
+	@brief		Write the string concatenation of all keys and values
+			into a buffer supplied by the caller.
+	@param		buffer		The buffer to write into.  May be NULL
+						if size is 0.
+	@param		size		The size of buffer, including room for
+						the \0 terminator.
+	@param		fmt		As for ::all.
+	@result		The length of the full concatenation, not including
+			the \0 terminator.  As with snprintf, if this is not
+			less than size the output was truncated; nothing is
+			allocated either way, so call with a size of 0 to
+			measure.
+	 */
+	libAPI size_t allInto(char *buffer, size_t size, const char *fmt = NULL);
 	
 	/*!
 	@brief		Retrieve the number of key/value pairs in the dictionary.
@@ -145,21 +332,24 @@ public:
 	libAPI const size_t count();
 	
 protected:
-	size_t _count;
 	bool manager;
-	bool vectors_valid;
-	mowgli_patricia_t *dict;
-	vector<const char *> keys;
-	vector<const char *> special_keys;
-	vector<const void *> values;
-	const char **key_array;
-	const void **value_array;
+	bool locking;
+	/* The keys and values; shared with copies until one changes */
+	WTDictionaryStore *store;
 	
-	mowgli_mutex_t access_mutex;
-	friend int fill_my_vector(const char *,void*,void*);
-	friend void tear_down(const char *, void *, void *);
+	WTRWLock access_lock;
 	
-	void reloadVectors();
+	void detach(void);
+	WTDictionaryDestructor policy_destructor(WTDictionaryMemoryPolicy managed);
+	void store_value(const char *key, const void *value,
+			 WTDictionaryDestructor destructor);
+	void store_copy(const char *key, size_t key_len,
+			const char *value, size_t value_len);
+	size_t serialise(char *buffer, size_t size, const char *fmt);
+	void read_lock(void);
+	void read_unlock(void);
+	void write_lock(void);
+	void write_unlock(void);
 };
 
 /*!
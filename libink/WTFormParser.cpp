@@ -10,45 +10,203 @@
 
 #include "WTFormParser.h"	// Self
 #include "WTDictionary.h"	// WTDictionary
-#include <Utility.h>		// nonfatal_error
-#include <uriparser/Uri.h>	// Used for decoding urlencoded forms
-#include <string.h>			// strdup
+#include "WTURLEncoder.h"	// WTURLEncoder
+#include <Utility.h>		// alloc_error
+#include <stdlib.h>		// realloc, free
+#include <string.h>			// memchr, memcpy, strdup
 
-libAPI WTDictionary * WTFormParser::get_params(const char *urlencoded_form)
+libAPI size_t WTFormParser::decode(char *str, size_t length)
 {
-	if(urlencoded_form == NULL) return NULL;
+	return WTURLEncoder::decode(str, length, str, true);
+}
+
+/* Split one field (no '&' in it) at its first '=', decode and report it. */
+static bool emit_field(char *field, size_t length,
+		       WTFormCallback callback, void *privdata)
+{
+	WTFormField found;
+	char *equals;
+	size_t name_len;
 	
-	WTDictionary *dict = new WTDictionary;
-	char *form;
-	char *next_param = form = strdup(urlencoded_form);
+	if(length == 0) return true;	// "a=1&&b=2"
 	
-	while(next_param != NULL)
+	equals = static_cast<char *>(memchr(field, '=', length));
+	if(equals == NULL)
+	{
+		found.name = WTStringView(field, WTFormParser::decode(field, length));
+	} else {
+		name_len = equals - field;
+		found.name = WTStringView(field, WTFormParser::decode(field, name_len));
+		found.value = WTStringView(equals + 1,
+					   WTFormParser::decode(equals + 1, length - name_len - 1));
+	}
+	
+	return (callback(&found, privdata) == 0);
+}
+
+/* View part of a field, decoding it into arena only if it has escapes */
+static WTStringView view_decoded(const char *part, size_t length, WTArena *arena)
+{
+	for(size_t next = 0; next < length; next++)
 	{
-		char *name, *value, *next;
+		if(part[next] != '%' && part[next] != '+') continue;
 		
-		name = next_param;
+		char *copy = arena->strndup(part, length);
+		return WTStringView(copy, WTFormParser::decode(copy, length));
+	}
+	
+	return WTStringView(part, length);
+}
+
+libAPI size_t WTFormParser::scan(const char *form, size_t length, WTArena *arena,
+				 WTFormCallback callback, void *privdata)
+{
+	const char *next = form, *end = form + length;
+	size_t fields = 0;
+	
+	while(next < end)
+	{
+		const char *amp = static_cast<const char *>(memchr(next, '&', end - next));
+		const char *field_end = (amp == NULL ? end : amp);
+		const char *equals = static_cast<const char *>(memchr(next, '=', field_end - next));
+		WTFormField found;
 		
-		next = strchr(next_param, static_cast<int>('&'));
-		if(next != NULL)
+		if(field_end != next)	// "a=1&&b=2"
 		{
-			next[0] = '\0';	// Terminate the value (or name)
-			next++;
+			fields++;
+			if(equals == NULL)
+				found.name = view_decoded(next, field_end - next, arena);
+			else
+			{
+				found.name = view_decoded(next, equals - next, arena);
+				found.value = view_decoded(equals + 1, field_end - equals - 1, arena);
+			}
+			if(callback(&found, privdata) != 0) break;
 		}
 		
-		value = strchr(next_param, static_cast<int>('='));
-		if(value != NULL)
+		next = field_end + 1;
+	}
+	
+	return fields;
+}
+
+libAPI size_t WTFormParser::scan(char *form, size_t length,
+				 WTFormCallback callback, void *privdata)
+{
+	char *next = form, *end = form + length;
+	size_t fields = 0;
+	
+	while(next < end)
+	{
+		char *amp = static_cast<char *>(memchr(next, '&', end - next));
+		char *field_end = (amp == NULL ? end : amp);
+		
+		if(field_end != next) fields++;
+		if(!emit_field(next, field_end - next, callback, privdata)) break;
+		
+		next = field_end + 1;
+	}
+	
+	return fields;
+}
+
+static int add_to_dictionary(const WTFormField *field, void *privdata)
+{
+	WTDictionary *dict = static_cast<WTDictionary *>(privdata);
+	dict->set_copy(field->name.data(), field->name.length(),
+		       field->value.data(), field->value.length());
+	return 0;
+}
+
+libAPI WTDictionary * WTFormParser::get_params(const char *urlencoded_form)
+{
+	if(urlencoded_form == NULL) return NULL;
+	
+	// Everything in here is copied in, so it can all come from one arena
+	WTDictionary *dict = new WTDictionary(true, WTDICT_OPT_ARENA);
+	size_t length = strlen(urlencoded_form);
+	char *form = strdup(urlencoded_form);
+	if(form == NULL) alloc_error("form buffer", length + 1);
+	
+	scan(form, length, &add_to_dictionary, dict);
+	free(form);
+	
+	return dict;
+}
+
+libAPI WTFormParser::WTFormParser()
+{
+	this->pending = NULL;
+	this->pending_len = 0;
+	this->pending_size = 0;
+	this->stopped = false;
+}
+
+libAPI WTFormParser::~WTFormParser()
+{
+	free(this->pending);
+}
+
+void WTFormParser::hold(const char *data, size_t length)
+{
+	if(this->pending_len + length > this->pending_size)
+	{
+		size_t new_size = (this->pending_size == 0 ? 256 : this->pending_size);
+		while(new_size < this->pending_len + length) new_size *= 2;
+		
+		this->pending = static_cast<char *>(realloc(this->pending, new_size));
+		if(this->pending == NULL) alloc_error("form field buffer", new_size);
+		this->pending_size = new_size;
+	}
+	
+	memcpy(this->pending + this->pending_len, data, length);
+	this->pending_len += length;
+}
+
+libAPI bool WTFormParser::feed(char *data, size_t length,
+			       WTFormCallback callback, void *privdata)
+{
+	char *next = data, *end = data + length;
+	
+	if(this->stopped) return false;
+	
+	if(this->pending_len > 0)
+	{
+		// Finish off the field the last piece cut short
+		char *amp = static_cast<char *>(memchr(next, '&', end - next));
+		if(amp == NULL)
 		{
-			value[0] = '\0';	// Replace = with \0 for name
-			value++;
-			uriUnescapeInPlaceA(value);
+			hold(next, length);
+			return true;
 		}
 		
-		dict->set(strdup(name), (value == NULL ? strdup("") : strdup(value)));
-		if(value != NULL) value[-1] = '=';
-		if(next_param != NULL) next_param[-1] = '&';
+		hold(next, amp - next);
+		this->stopped = !emit_field(this->pending, this->pending_len, callback, privdata);
+		this->pending_len = 0;
+		next = amp + 1;
+	}
+	
+	while(next < end && !this->stopped)
+	{
+		char *amp = static_cast<char *>(memchr(next, '&', end - next));
+		if(amp == NULL)
+		{
+			hold(next, end - next);
+			break;
+		}
 		
-		next_param = next;
+		this->stopped = !emit_field(next, amp - next, callback, privdata);
+		next = amp + 1;
 	}
 	
-	return dict;
+	return !this->stopped;
+}
+
+libAPI bool WTFormParser::finish(WTFormCallback callback, void *privdata)
+{
+	if(!this->stopped && this->pending_len > 0)
+		this->stopped = !emit_field(this->pending, this->pending_len, callback, privdata);
+	this->pending_len = 0;
+	
+	return !this->stopped;
 }
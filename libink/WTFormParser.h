@@ -12,12 +12,105 @@
 #define __WTFORMPARSER_H__
 
 #include "WTDictionary.h"
+#include "WTString.h" // WTStringView
+#include "WTArena.h" // WTArena
 
+/*!
+	@brief		A name/value pair from a urlencoded form.
+	@details	Both views point into the buffer being parsed, and are
+			already decoded.  A field with no '=' has an empty
+			value.
+ */
+struct WTFormField
+{
+	WTStringView name;
+	WTStringView value;
+};
+
+/*!
+	@brief		Called for each field found in a form.
+	@result		Non-zero to stop parsing.
+ */
+typedef int (*WTFormCallback)(const WTFormField *field, void *privdata);
+
+/*!
+	@brief		Parser for application/x-www-form-urlencoded data.
+	@details	'+' and percent escapes are decoded the same way in
+			names and values.  Repeated names are all reported by
+			::scan and ::feed; ::get_params keeps the last value.
+ */
 class WTFormParser
 {
 public:
+	libAPI WTFormParser();
+	libAPI ~WTFormParser();
+	
+	/*!
+	@brief		Parse a form into a new dictionary.
+	@param		urlencoded_form	The form to parse.  It is not modified.
+	@result		A new dictionary of the fields, which the caller must
+			delete, or NULL if urlencoded_form is NULL.
+	 */
 	libAPI static WTDictionary *get_params(const char *urlencoded_form);
+	/*!
+	@brief		Parse a whole form without copying it.
+	@param		form		The form.  It is decoded in place, so the
+					views handed to callback point into it.
+	@param		length		The length of form.
+	@param		callback	Called for each field, in order.
+	@result		The number of fields reported.
+	 */
+	libAPI static size_t scan(char *form, size_t length,
+				  WTFormCallback callback, void *privdata);
+	/*!
+	@brief		Parse a whole form that can't be changed.
+	@param		form		The form.  Names and values with no
+					escapes in them are viewed where they
+					are; only those with '+' or '%' are
+					copied, to be decoded.
+	@param		length		The length of form.
+	@param		arena		Where decoded names and values go.
+	@param		callback	Called for each field, in order.
+	@result		The number of fields reported.
+	 */
+	libAPI static size_t scan(const char *form, size_t length, WTArena *arena,
+				  WTFormCallback callback, void *privdata);
+	/*!
+	@brief		Decode '+' and percent escapes in place.
+	@result		The decoded length.  Malformed escapes are left alone.
+	 */
+	libAPI static size_t decode(char *str, size_t length);
+	
+	/*!
+	@brief		Parse the next piece of a form that arrives in pieces.
+	@param		data		The next piece.  Whole fields in it are
+					decoded in place; a field that runs off
+					the end is held back until the rest
+					arrives.
+	@param		length		The length of data.
+	@param		callback	Called for each field completed by data.
+	@result		false if a callback has asked to stop.
+	@note		Views are only valid during the callback, since a held
+			back field lives in a buffer of the parser's.
+	 */
+	libAPI bool feed(char *data, size_t length,
+			 WTFormCallback callback, void *privdata);
+	/*!
+	@brief		Report any held back field, at the end of the form.
+	@result		false if a callback has asked to stop.
+	 */
+	libAPI bool finish(WTFormCallback callback, void *privdata);
+private:
+	/*! The start of a field that a previous ::feed cut off */
+	char *pending;
+	size_t pending_len;
+	size_t pending_size;
+	bool stopped;
+	
+	void hold(const char *data, size_t length);
 	
+	WTFormParser(const WTFormParser &);
+	WTFormParser &operator=(const WTFormParser &);
 };
 
 #endif /*!__WTFORMPARSER_H__*/
@@ -0,0 +1,200 @@
+/*
+ * WTHashTable.cpp - implementation of open-addressing string hash table
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "WTHashTable.h"
+#include <Utility.h> // alloc_error
+#include <stdlib.h> // calloc, free
+
+#define INITIAL_SLOTS 8
+
+static inline unsigned char fold_case(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? (c + ('a' - 'A')) : c;
+}
+
+libAPI uint32_t WTHashKey(const char *key, size_t *length)
+{
+	// 32-bit FNV-1a over the case-folded key
+	const unsigned char *next = reinterpret_cast<const unsigned char *>(key);
+	uint32_t hash = 2166136261U;
+
+	while(*next)
+	{
+		hash ^= fold_case(*next++);
+		hash *= 16777619U;
+	}
+
+	if(length != NULL)
+		*length = next - reinterpret_cast<const unsigned char *>(key);
+
+	return hash;
+}
+
+libAPI bool WTKeyEqual(const char *key1, const char *key2)
+{
+	const unsigned char *a = reinterpret_cast<const unsigned char *>(key1);
+	const unsigned char *b = reinterpret_cast<const unsigned char *>(key2);
+
+	while(*a && fold_case(*a) == fold_case(*b))
+	{
+		a++;
+		b++;
+	}
+
+	return (fold_case(*a) == fold_case(*b));
+}
+
+libAPI WTHashTable::WTHashTable()
+{
+	this->slots = NULL;
+	this->mask = 0;
+	this->used = 0;
+}
+
+libAPI WTHashTable::~WTHashTable()
+{
+	free(this->slots);
+}
+
+libAPI size_t WTHashTable::count(void) const
+{
+	return this->used;
+}
+
+void WTHashTable::grow(void)
+{
+	WTHashSlot *old_slots = this->slots;
+	size_t old_size = (old_slots == NULL ? 0 : this->mask + 1);
+	size_t new_size = (old_size == 0 ? INITIAL_SLOTS : old_size * 2);
+
+	this->slots = static_cast<WTHashSlot *>(calloc(new_size, sizeof(WTHashSlot)));
+	if(this->slots == NULL) alloc_error("hash table slots", new_size * sizeof(WTHashSlot));
+	this->mask = new_size - 1;
+
+	for(size_t old = 0; old < old_size; old++)
+	{
+		if(old_slots[old].key == NULL) continue;
+
+		size_t slot = old_slots[old].hash & this->mask;
+		while(this->slots[slot].key != NULL)
+			slot = (slot + 1) & this->mask;
+		this->slots[slot] = old_slots[old];
+	}
+
+	free(old_slots);
+}
+
+libAPI WTHashSlot *WTHashTable::find(const char *key)
+{
+	if(this->used == 0) return NULL;
+
+	uint32_t hash = WTHashKey(key);
+	size_t slot = hash & this->mask;
+
+	while(this->slots[slot].key != NULL)
+	{
+		if(this->slots[slot].hash == hash &&
+		   WTKeyEqual(this->slots[slot].key, key))
+			return &(this->slots[slot]);
+		slot = (slot + 1) & this->mask;
+	}
+
+	return NULL;
+}
+
+libAPI WTHashSlot *WTHashTable::insert(const char *key, void *value)
+{
+	// Keep the load factor at or under 3/4
+	if(this->slots == NULL || (this->used + 1) * 4 > (this->mask + 1) * 3)
+		grow();
+
+	uint32_t hash = WTHashKey(key);
+	size_t slot = hash & this->mask;
+
+	while(this->slots[slot].key != NULL)
+	{
+		if(this->slots[slot].hash == hash &&
+		   WTKeyEqual(this->slots[slot].key, key))
+			return NULL;
+		slot = (slot + 1) & this->mask;
+	}
+
+	this->slots[slot].hash = hash;
+	this->slots[slot].key = key;
+	this->slots[slot].value = value;
+	++(this->used);
+
+	return &(this->slots[slot]);
+}
+
+libAPI bool WTHashTable::remove(const char *key, WTHashSlot *removed)
+{
+	WTHashSlot *found = find(key);
+	if(found == NULL) return false;
+
+	if(removed != NULL) *removed = *found;
+
+	// Shift back any entries that probed past the hole, so that every
+	// entry stays reachable from its home slot without tombstones.
+	size_t hole = found - this->slots;
+	size_t next = hole;
+	while(true)
+	{
+		next = (next + 1) & this->mask;
+		if(this->slots[next].key == NULL) break;
+
+		size_t home = this->slots[next].hash & this->mask;
+		bool stays = (hole <= next) ? (hole < home && home <= next)
+					    : (hole < home || home <= next);
+		if(stays) continue;
+
+		this->slots[hole] = this->slots[next];
+		hole = next;
+	}
+
+	this->slots[hole].key = NULL;
+	this->slots[hole].value = NULL;
+	--(this->used);
+
+	return true;
+}
+
+libAPI void WTHashTable::foreach(int (*callback)(const char *, void *, void *),
+				 void *privdata)
+{
+	if(this->slots == NULL) return;
+
+	for(size_t slot = 0; slot <= this->mask; slot++)
+	{
+		if(this->slots[slot].key == NULL) continue;
+		if(callback(this->slots[slot].key, this->slots[slot].value, privdata) != 0)
+			break;
+	}
+}
+
+libAPI void WTHashTable::clear(void (*callback)(const char *, void *, void *),
+			       void *privdata)
+{
+	if(this->slots == NULL) return;
+
+	if(callback != NULL)
+	{
+		for(size_t slot = 0; slot <= this->mask; slot++)
+		{
+			if(this->slots[slot].key == NULL) continue;
+			callback(this->slots[slot].key, this->slots[slot].value, privdata);
+		}
+	}
+
+	free(this->slots);
+	this->slots = NULL;
+	this->mask = 0;
+	this->used = 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * WTHashTable.h - interface for open-addressing string hash table
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTHASHTABLE_H__
+#define __LIBINK_WTHASHTABLE_H__
+
+#include <Utility.h> // libAPI
+#include <stdlib.h> // size_t
+
+#ifndef _WIN32
+#	include <stdint.h>
+#endif
+
+/*!
+	@brief		Hash a key, ignoring ASCII case.
+	@param		key		The NUL-terminated key to hash.
+	@param		length		Receives the length of key. (Optional)
+	@result		The hash of key.  Keys which compare equal with
+			::WTKeyEqual always hash the same.
+ */
+libAPI uint32_t WTHashKey(const char *key, size_t *length = NULL);
+/*!
+	@brief		Compare two keys for equality, ignoring ASCII case.
+	@details	Unlike strcasecmp, this does not depend on the
+			current locale.
+ */
+libAPI bool WTKeyEqual(const char *key1, const char *key2);
+
+/*!
+	@brief		A slot in a WTHashTable.
+	@details	The key, its hash and the value share a slot, so a
+			probe that doesn't match never touches another cache
+			line.  key is NULL if the slot is empty.
+ */
+struct WTHashSlot
+{
+	/*! The cached hash of key */
+	uint32_t hash;
+	/*! The key, or NULL if this slot is empty */
+	const char *key;
+	/*! The value associated with key */
+	void *value;
+};
+
+/*!
+	@brief		Case-insensitive string hash table.
+	@details	An open-addressing (linear probing) hash table mapping
+			NUL-terminated strings to pointers.  Deletions shift
+			later entries back rather than leaving tombstones, so
+			lookups never slow down as a table churns.
+
+			The table does not own (or copy) keys or values; keys
+			must stay valid for as long as they are in the table.
+			This is the storage behind WTDICT_OPT_HASHED.
+	@note		This class does no locking.
+ */
+class WTHashTable
+{
+public:
+	libAPI WTHashTable();
+	libAPI ~WTHashTable();
+
+	/*!
+	@brief		Find a key.
+	@param		key		The key to look for.
+	@result		The slot containing key, or NULL if it isn't present.
+			The slot is valid until the table is next modified.
+	 */
+	libAPI WTHashSlot *find(const char *key);
+	/*!
+	@brief		Add a key.
+	@param		key		The key to add.  It is not copied.
+	@param		value		The value for key.
+	@result		The new slot, or NULL if key was already present.
+			The slot is valid until the table is next modified.
+	 */
+	libAPI WTHashSlot *insert(const char *key, void *value);
+	/*!
+	@brief		Remove a key.
+	@param		key		The key to remove.
+	@param		removed		Receives a copy of the removed slot, so
+					the caller can release the key and
+					value. (Optional)
+	@result		true if the key was removed; false if it wasn't there.
+	 */
+	libAPI bool remove(const char *key, WTHashSlot *removed = NULL);
+	/*!
+	@brief		Call a function for each key in the table.
+	@details	Keys are visited in no particular order.  Return
+			non-zero from callback to stop early.  The table must
+			not be modified during the walk.
+	 */
+	libAPI void foreach(int (*callback)(const char *, void *, void *),
+			    void *privdata);
+	/*!
+	@brief		Remove all keys from the table.
+	@param		callback	Called for each key/value before the
+					table is emptied. (Optional)
+	 */
+	libAPI void clear(void (*callback)(const char *, void *, void *) = NULL,
+			  void *privdata = NULL);
+	/*!
+	@brief		Retrieve the number of keys in the table.
+	 */
+	libAPI size_t count(void) const;
+private:
+	/*! The slots; there are always a power of two of them */
+	WTHashSlot *slots;
+	/*! The number of slots, less one */
+	size_t mask;
+	/*! The number of occupied slots */
+	size_t used;
+
+	void grow(void);
+
+	WTHashTable(const WTHashTable &);
+	WTHashTable &operator=(const WTHashTable &);
+};
+
+#endif/*!__LIBINK_WTHASHTABLE_H__*/
@@ -0,0 +1,87 @@
+/*
+ * WTRWLock.cpp - implementation of reader/writer locks
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifdef _WIN32
+#	include <windows.h>	// SRWLOCK (Vista or higher)
+#endif
+
+#include "WTRWLock.h"
+#include <Utility.h> // fatal_error
+#include <stdlib.h> // abort
+
+#ifdef _WIN32
+
+#define native_rwlock reinterpret_cast<PSRWLOCK>(&(this->rwlock))
+
+libAPI WTRWLock::WTRWLock()
+{
+	InitializeSRWLock(native_rwlock);
+}
+
+libAPI WTRWLock::~WTRWLock()
+{
+	// SRW locks need no cleanup.
+}
+
+libAPI void WTRWLock::lock_shared(void)
+{
+	AcquireSRWLockShared(native_rwlock);
+}
+
+libAPI void WTRWLock::unlock_shared(void)
+{
+	ReleaseSRWLockShared(native_rwlock);
+}
+
+libAPI void WTRWLock::lock(void)
+{
+	AcquireSRWLockExclusive(native_rwlock);
+}
+
+libAPI void WTRWLock::unlock(void)
+{
+	ReleaseSRWLockExclusive(native_rwlock);
+}
+
+#else
+
+#define rwlock_do_or_die(x) { int i = x; if(i != 0) {fprintf(stderr, "%d\n", i); fatal_error("rwlock operation error")} }
+
+libAPI WTRWLock::WTRWLock()
+{
+	rwlock_do_or_die(pthread_rwlock_init(&(this->rwlock), NULL));
+}
+
+libAPI WTRWLock::~WTRWLock()
+{
+	pthread_rwlock_destroy(&(this->rwlock));
+}
+
+libAPI void WTRWLock::lock_shared(void)
+{
+	rwlock_do_or_die(pthread_rwlock_rdlock(&(this->rwlock)));
+}
+
+libAPI void WTRWLock::unlock_shared(void)
+{
+	rwlock_do_or_die(pthread_rwlock_unlock(&(this->rwlock)));
+}
+
+libAPI void WTRWLock::lock(void)
+{
+	rwlock_do_or_die(pthread_rwlock_wrlock(&(this->rwlock)));
+}
+
+libAPI void WTRWLock::unlock(void)
+{
+	rwlock_do_or_die(pthread_rwlock_unlock(&(this->rwlock)));
+}
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * WTRWLock.h - interface for reader/writer locks
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTRWLOCK_H__
+#define __LIBINK_WTRWLOCK_H__
+
+#include <Utility.h> // libAPI
+
+#ifndef _WIN32
+#	include <pthread.h>	// pthread_rwlock_t
+#endif
+
+/*!
+	@brief		Reader/writer lock.
+	@details	Any number of readers may hold the lock at once;
+			a writer holds it alone.  libmowgli only provides
+			mutexes, so this wraps the platform's native rwlock.
+			The lock is not recursive.
+ */
+class WTRWLock
+{
+public:
+	libAPI WTRWLock();
+	libAPI ~WTRWLock();
+
+	/*!
+	@brief		Acquire the lock for reading.
+	 */
+	libAPI void lock_shared(void);
+	/*!
+	@brief		Release a read lock.
+	 */
+	libAPI void unlock_shared(void);
+	/*!
+	@brief		Acquire the lock for writing.
+	 */
+	libAPI void lock(void);
+	/*!
+	@brief		Release a write lock.
+	 */
+	libAPI void unlock(void);
+private:
+#ifdef _WIN32
+	/*! Really an SRWLOCK; kept opaque so this header doesn't pull in
+	    windows.h ahead of winsock2.h */
+	void *rwlock;
+#else
+	pthread_rwlock_t rwlock;
+#endif
+
+	WTRWLock(const WTRWLock &);
+	WTRWLock &operator=(const WTRWLock &);
+};
+
+#endif/*!__LIBINK_WTRWLOCK_H__*/
@@ -0,0 +1,166 @@
+/*
+ * WTString.h - string views and small-string-optimised strings
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTSTRING_H__
+#define __LIBINK_WTSTRING_H__
+
+#include <Utility.h> // alloc_error
+#include <stdlib.h> // size_t, malloc, free
+#include <string.h> // memcpy, strlen
+
+/*!
+	@brief		A borrowed run of characters.
+	@details	A view is a pointer and a length; it owns nothing and
+			need not be NUL-terminated.  It is only valid for as
+			long as the memory it points into.
+ */
+class WTStringView
+{
+public:
+	WTStringView() : view_data(""), view_length(0) {}
+	WTStringView(const char *str) : view_data(str), view_length(strlen(str)) {}
+	WTStringView(const char *str, size_t length) : view_data(str), view_length(length) {}
+
+	/*! The first character; not necessarily NUL-terminated */
+	const char *data(void) const { return view_data; }
+	/*! The number of characters */
+	size_t length(void) const { return view_length; }
+	bool empty(void) const { return (view_length == 0); }
+
+	bool operator==(const WTStringView &other) const
+	{
+		return (view_length == other.view_length &&
+			memcmp(view_data, other.view_data, view_length) == 0);
+	}
+	bool operator!=(const WTStringView &other) const { return !(*this == other); }
+private:
+	const char *view_data;
+	size_t view_length;
+};
+
+/*!
+	@brief		An owned string which keeps short values inline.
+	@details	Strings of up to WTSmallString::INLINE_LENGTH
+			characters are stored in the object itself, so the
+			header names and values that make up most of a typical
+			dictionary cost no allocation at all.  Longer strings
+			are copied to the heap.  The string is always
+			NUL-terminated.
+ */
+class WTSmallString
+{
+public:
+	enum { INLINE_LENGTH = 23 };
+
+	WTSmallString() { set_inline(0); }
+	WTSmallString(const char *str) { init(str, strlen(str)); }
+	WTSmallString(const char *str, size_t length) { init(str, length); }
+	WTSmallString(const WTStringView &view) { init(view.data(), view.length()); }
+	WTSmallString(const WTSmallString &other) { init(other.c_str(), other.str_length); }
+#if __cplusplus >= 201103L
+	WTSmallString(WTSmallString &&other)
+	{
+		steal(other);
+	}
+	WTSmallString &operator=(WTSmallString &&other)
+	{
+		if(&other != this)
+		{
+			release();
+			steal(other);
+		}
+		return *this;
+	}
+#endif
+	~WTSmallString() { release(); }
+
+	WTSmallString &operator=(const WTSmallString &other)
+	{
+		if(&other != this) assign(other.c_str(), other.str_length);
+		return *this;
+	}
+	WTSmallString &operator=(const char *str)
+	{
+		assign(str, strlen(str));
+		return *this;
+	}
+
+	/*!
+	@brief		Replace the contents with a copy of length characters
+			of str.
+	 */
+	void assign(const char *str, size_t length)
+	{
+		// str may point into this string, so don't free it first
+		WTSmallString fresh(str, length);
+		swap(fresh);
+	}
+	void swap(WTSmallString &other)
+	{
+		WTSmallString *a = this, *b = &other;
+		char temp[sizeof(WTSmallString)];
+
+		// Inline strings point at themselves; fix those up after
+		memcpy(temp, a, sizeof(WTSmallString));
+		memcpy(static_cast<void *>(a), b, sizeof(WTSmallString));
+		memcpy(static_cast<void *>(b), temp, sizeof(WTSmallString));
+		if(a->is_inline()) a->str = a->local;
+		if(b->is_inline()) b->str = b->local;
+	}
+
+	const char *c_str(void) const { return str; }
+	size_t length(void) const { return str_length; }
+	WTStringView view(void) const { return WTStringView(str, str_length); }
+
+	bool operator==(const WTStringView &other) const { return (view() == other); }
+	bool operator!=(const WTStringView &other) const { return (view() != other); }
+private:
+	/* Points at local for inline strings */
+	char *str;
+	size_t str_length;
+	char local[INLINE_LENGTH + 1];
+
+	bool is_inline(void) const { return (str_length <= INLINE_LENGTH); }
+	void set_inline(size_t length)
+	{
+		str = local;
+		str_length = length;
+		str[length] = '\0';
+	}
+	void init(const char *from, size_t length)
+	{
+		if(length <= INLINE_LENGTH)
+		{
+			memcpy(local, from, length);
+			set_inline(length);
+			return;
+		}
+
+		str = static_cast<char *>(malloc(length + 1));
+		if(str == NULL) alloc_error("string", length + 1);
+		memcpy(str, from, length);
+		str[length] = '\0';
+		str_length = length;
+	}
+	void release(void)
+	{
+		if(!is_inline()) free(str);
+	}
+#if __cplusplus >= 201103L
+	void steal(WTSmallString &other)
+	{
+		memcpy(static_cast<void *>(this), &other, sizeof(WTSmallString));
+		if(is_inline()) str = local;
+		other.set_inline(0);
+	}
+#endif
+};
+
+#endif/*!__LIBINK_WTSTRING_H__*/
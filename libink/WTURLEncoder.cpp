@@ -0,0 +1,244 @@
+/*
+ * WTURLEncoder.cpp - implementation of URL percent-encoding routines
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#include "WTURLEncoder.h"	// Self
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define WT_URL_SSE2 1
+#	include <emmintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#	endif
+#endif
+
+/* 1 for the RFC 3986 unreserved characters, which pass through as they are */
+static const unsigned char unreserved[256] = {
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0,  1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,	// - . 0-9
+	0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,  1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,	// A-Z _
+	0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,  1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0,	// a-z ~
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static inline int hex_value(unsigned char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+#ifdef WT_URL_SSE2
+/* One bit per byte of chunk, set for the bytes that pass through */
+static inline unsigned unreserved_mask(__m128i chunk)
+{
+	// Bytes over 0x7F are negative, so fall outside every range
+	__m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+				      _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+	__m128i mark = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('-')),
+						 _mm_cmpeq_epi8(chunk, _mm_set1_epi8('.'))),
+				    _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')),
+						 _mm_cmpeq_epi8(chunk, _mm_set1_epi8('~'))));
+	
+	return static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, alpha), mark)));
+}
+
+static inline unsigned lowest_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static inline unsigned count_bits(unsigned mask)
+{
+	unsigned count = 0;
+	for(; mask != 0; mask &= mask - 1) count++;
+	return count;
+}
+#endif
+
+libAPI size_t WTURLEncoder::encoded_length(const char *str, size_t length)
+{
+	const unsigned char *in = reinterpret_cast<const unsigned char *>(str);
+	size_t escapes = 0, pos = 0;
+	
+#ifdef WT_URL_SSE2
+	for(; pos + 16 <= length; pos += 16)
+	{
+		unsigned mask = unreserved_mask(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos)));
+		if(mask != 0xFFFF) escapes += count_bits(~mask & 0xFFFF);
+	}
+#endif
+	for(; pos < length; pos++)
+		escapes += !unreserved[in[pos]];
+	
+	return length + (2 * escapes);
+}
+
+/* Encode into out, which the caller has checked is big enough */
+static size_t encode_unchecked(const unsigned char *in, size_t length, char *out)
+{
+	char *start = out;
+	size_t pos = 0;
+	
+#ifdef WT_URL_SSE2
+	while(pos + 16 <= length)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos));
+		unsigned mask = unreserved_mask(chunk);
+		
+		// The rest of the input needs at least 16 more bytes, so this
+		// store stays inside the buffer even when it is overwritten.
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), chunk);
+		if(mask == 0xFFFF)
+		{
+			out += 16;
+			pos += 16;
+			continue;
+		}
+		
+		// Keep the run before the first reserved byte, then escape it
+		unsigned run = lowest_bit(~mask);
+		out += run;
+		pos += run;
+		*out++ = '%';
+		*out++ = hex_digits[in[pos] >> 4];
+		*out++ = hex_digits[in[pos] & 0xF];
+		pos++;
+	}
+#endif
+	for(; pos < length; pos++)
+	{
+		if(unreserved[in[pos]])
+		{
+			*out++ = in[pos];
+		} else {
+			*out++ = '%';
+			*out++ = hex_digits[in[pos] >> 4];
+			*out++ = hex_digits[in[pos] & 0xF];
+		}
+	}
+	
+	return out - start;
+}
+
+libAPI size_t WTURLEncoder::encode(const char *str, size_t length,
+				   char *buffer, size_t size)
+{
+	const unsigned char *in = reinterpret_cast<const unsigned char *>(str);
+	size_t needed, used = 0;
+	
+	if(size > length * 3)
+	{
+		used = encode_unchecked(in, length, buffer);
+		buffer[used] = '\0';
+		return used;
+	}
+	
+	needed = encoded_length(str, length);
+	if(needed < size)
+	{
+		used = encode_unchecked(in, length, buffer);
+		buffer[used] = '\0';
+		return used;
+	}
+	if(size == 0) return needed;
+	
+	// Truncated: as much as fits, without splitting an escape
+	for(size_t pos = 0; pos < length; pos++)
+	{
+		size_t width = (unreserved[in[pos]] ? 1 : 3);
+		if(used + width >= size) break;
+		if(width == 1)
+		{
+			buffer[used++] = in[pos];
+		} else {
+			buffer[used++] = '%';
+			buffer[used++] = hex_digits[in[pos] >> 4];
+			buffer[used++] = hex_digits[in[pos] & 0xF];
+		}
+	}
+	buffer[used] = '\0';
+	
+	return needed;
+}
+
+libAPI size_t WTURLEncoder::decode(const char *str, size_t length,
+				   char *buffer, bool plus_as_space)
+{
+	const unsigned char *in = reinterpret_cast<const unsigned char *>(str);
+	char *out = buffer;
+	size_t pos = 0;
+	
+#ifdef WT_URL_SSE2
+	// Skip to the next '%' (or '+') sixteen bytes at a time.  out never
+	// gets ahead of in, so this is safe when decoding in place.
+	__m128i percent = _mm_set1_epi8('%');
+	__m128i plus = _mm_set1_epi8(plus_as_space ? '+' : '%');
+	while(pos + 16 <= length)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + pos));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, plus))));
+		
+		if(mask == 0)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out), chunk);
+			out += 16;
+			pos += 16;
+			continue;
+		}
+		
+		// A byte loop beats memmove for runs this short
+		for(unsigned run = lowest_bit(mask); run > 0; run--)
+			*out++ = in[pos++];
+		if(in[pos] == '+')
+		{
+			*out++ = ' ';
+			pos++;
+		} else if(pos + 2 < length && hex_value(in[pos + 1]) >= 0 && hex_value(in[pos + 2]) >= 0) {
+			*out++ = static_cast<char>((hex_value(in[pos + 1]) << 4) | hex_value(in[pos + 2]));
+			pos += 3;
+		} else {
+			*out++ = '%';
+			pos++;
+		}
+	}
+#endif
+	while(pos < length)
+	{
+		if(plus_as_space && in[pos] == '+')
+		{
+			*out++ = ' ';
+			pos++;
+		} else if(in[pos] == '%' && pos + 2 < length &&
+			  hex_value(in[pos + 1]) >= 0 && hex_value(in[pos + 2]) >= 0) {
+			*out++ = static_cast<char>((hex_value(in[pos + 1]) << 4) | hex_value(in[pos + 2]));
+			pos += 3;
+		} else {
+			*out++ = in[pos++];
+		}
+	}
+	
+	return out - buffer;
+}
@@ -0,0 +1,71 @@
+/*
+ * WTURLEncoder.h - interface for URL percent-encoding routines
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ */
+
+#ifndef __LIBINK_WTURLENCODER_H__
+#define __LIBINK_WTURLENCODER_H__
+
+#include <Utility.h> // libAPI
+#include <stdlib.h> // size_t
+
+/*!
+	@brief		RFC 3986 percent-encoding and decoding.
+	@details	Every byte except the unreserved set (A-Z, a-z, 0-9,
+			'-', '.', '_' and '~') is encoded as %XX with upper
+			case hex digits, which is what OAuth requires.  The
+			result does not depend on the locale.  None of these
+			routines allocate; they write into memory the caller
+			supplies.
+ */
+class WTURLEncoder
+{
+public:
+	/*!
+	@brief		Measure the encoding of a string.
+	@param		str		The string to measure.
+	@param		length		The length of str.
+	@result		The length of the encoded string, not including the
+			\0 terminator.
+	 */
+	libAPI static size_t encoded_length(const char *str, size_t length);
+	/*!
+	@brief		Percent-encode a string.
+	@param		str		The string to encode.
+	@param		length		The length of str.
+	@param		buffer		The buffer to write into.  May be NULL
+						if size is 0.
+	@param		size		The size of buffer, including room for
+						the \0 terminator.  3 * length + 1 is
+						always enough.
+	@result		The length of the full encoding, not including the \0
+			terminator.  As with snprintf, if this is not less than
+			size the output was truncated (never part-way through
+			an escape).
+	 */
+	libAPI static size_t encode(const char *str, size_t length,
+				    char *buffer, size_t size);
+	/*!
+	@brief		Decode percent escapes.
+	@param		str		The string to decode.
+	@param		length		The length of str.
+	@param		buffer		The buffer to write into; it needs room
+						for the decoded string, so length
+						bytes is always enough.  It may be str
+						itself, to decode in place.  It is not
+						terminated.
+	@param		plus_as_space	Whether to decode '+' as a space, as
+						forms do.
+	@result		The decoded length.  Malformed escapes are copied as
+			they are.
+	 */
+	libAPI static size_t decode(const char *str, size_t length,
+				    char *buffer, bool plus_as_space = false);
+};
+
+#endif/*!__LIBINK_WTURLENCODER_H__*/
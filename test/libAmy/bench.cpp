@@ -0,0 +1,132 @@
+/*
+ * bench.cpp - libAmy microbenchmarks
+ * libAmy, the Web as seen by
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ *
+ * Prints one CSV row per measurement:
+ *	operation,params,threads,ops,ns_per_op,per_core_per_sec
+ * where params is the number of query parameters signed besides the
+ * oauth_* ones, and each thread signs with its own WTOAuthSigner.
+ * per_core_per_sec is signatures per second per thread.  Run with -q for
+ * a quick pass.
+ */
+
+#include <libAmy/OAuth.h>
+#include <libmowgli/mowgli.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <time.h>
+#endif
+
+static double now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (static_cast<double>(count.QuadPart) * 1e9) / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9) + ts.tv_nsec;
+#endif
+}
+
+/* Keep the optimiser from dropping work whose result we don't use */
+static volatile size_t sink;
+
+struct signer_args
+{
+	const char *query;
+	size_t rounds;
+};
+
+static void *sign_loop(mowgli_thread_t *thread, void *userdata)
+{
+	signer_args *args = static_cast<signer_args *>(userdata);
+	WTOAuthSigner signer;
+	char header[512];
+	size_t total = 0, query_len = strlen(args->query);
+
+	signer.set_credentials("dpf43f3p2l4k3l03", "kd94hf93k423kf44",
+			       "nnch734d00sl2jdk", "pfkkdhi9sl3r4s00", OAUTH_SIG_HMAC_SHA1);
+	for(size_t round = 0; round < args->rounds; round++)
+		total += signer.sign("GET", "https", "api.example.com", "/1/statuses/home_timeline.json", 30,
+				     (query_len > 0 ? args->query : NULL), query_len, NULL, 0,
+				     header, sizeof(header));
+
+	sink = total;
+	return NULL;
+}
+
+/* count parameters, some of which need escaping */
+static char *make_query(size_t count)
+{
+	char *query = static_cast<char *>(calloc(count * 40 + 1, 1));
+	size_t used = 0;
+	for(size_t next = 0; next < count; next++)
+		used += sprintf(query + used, "%sparam%lu=value+%lu%%2Cwith%%20escapes",
+				(next == 0 ? "" : "&"), static_cast<unsigned long>(next),
+				static_cast<unsigned long>(next));
+	return query;
+}
+
+int main(int argc, char *argv[])
+{
+	bool quick = (argc > 1 && strcmp(argv[1], "-q") == 0);
+	const size_t param_counts[] = { 0, 4, 16 };
+	const int thread_counts[] = { 1, 2, 4 };
+	size_t rounds = (quick ? 20000 : 200000);
+
+	mowgli_init();
+	printf("operation,params,threads,ops,ns_per_op,per_core_per_sec\n");
+
+	for(size_t params = 0; params < 3; params++)
+	{
+		char *query = make_query(param_counts[params]);
+
+		for(size_t count = 0; count < 3; count++)
+		{
+			int threads = thread_counts[count];
+			std::vector<mowgli_thread_t> handles(threads);
+			signer_args args;
+			double start, elapsed;
+
+			args.query = query;
+			args.rounds = rounds;
+
+			start = now_ns();
+			if(threads == 1)
+			{
+				sign_loop(NULL, &args);
+			} else {
+				for(int thread = 0; thread < threads; thread++)
+					mowgli_thread_create(&handles[thread], &sign_loop, &args);
+				for(int thread = 0; thread < threads; thread++)
+					mowgli_thread_join(&handles[thread]);
+			}
+			elapsed = now_ns() - start;
+
+			printf("sign,%lu,%d,%lu,%.2f,%.0f\n",
+			       static_cast<unsigned long>(param_counts[params]), threads,
+			       static_cast<unsigned long>(rounds * threads),
+			       elapsed / (rounds * threads),
+			       (rounds * 1e9) / elapsed);
+			fflush(stdout);
+		}
+
+		free(query);
+	}
+
+	return 0;
+}
@@ -0,0 +1,288 @@
+#include <libAmy/WTChunkedDecoder.h>
+#include <libAmy/OAuth2.h>
+#include <libink/WTDictionary.h>
+#include <libmowgli/mowgli.h>
+#include <string>
+#include <unistd.h>
+#include "../test.h"
+
+/*
+ * Decode body piece bytes at a time, the way it would arrive from a socket.
+ * Returns the number of bytes the decoder used.
+ */
+static size_t dechunk(WTChunkedDecoder *decoder, const char *body, size_t len,
+		      size_t piece, std::string *payload)
+{
+	char buffer[256];
+	size_t offset = 0, consumed = 0, used;
+
+	while(offset < len)
+	{
+		size_t size = (len - offset < piece ? len - offset : piece);
+		memcpy(buffer, body + offset, size);
+
+		// In place, as connections do it
+		size_t written = decoder->decode(buffer, size, buffer, &used);
+		payload->append(buffer, written);
+		consumed += used;
+		if(used < size) break;
+		offset += size;
+	}
+
+	return consumed;
+}
+
+bool splits_sizes(void)
+{
+	const char *body = "1A\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+			   "5\r\nhello\r\n0\r\n\r\n";
+	size_t len = strlen(body);
+
+	// Every piece size, so the size lines are cut everywhere
+	for(size_t piece = 1; piece <= len; piece++)
+	{
+		WTChunkedDecoder decoder;
+		std::string payload;
+
+		if(dechunk(&decoder, body, len, piece, &payload) != len ||
+		   !decoder.finished() ||
+		   payload != "abcdefghijklmnopqrstuvwxyzhello")
+			return false;
+	}
+
+	return true;
+}
+
+bool skips_extensions(void)
+{
+	const char *body = "4;name=value\r\nWiki\r\n"
+			   "5 ; quoted=\"a;b\"\r\npedia\r\n0;last\r\n\r\n";
+	WTChunkedDecoder decoder;
+	std::string payload;
+
+	return (dechunk(&decoder, body, strlen(body), 3, &payload) == strlen(body) &&
+		decoder.finished() && payload == "Wikipedia");
+}
+
+bool keeps_trailers(void)
+{
+	const char *body = "4\r\nWiki\r\n0\r\nExpires: never\r\nX-Sum:\t42\r\n\r\n";
+	WTDictionary *trailers = new WTDictionary(true);
+	WTChunkedDecoder decoder(trailers);
+	std::string payload;
+	bool result;
+
+	dechunk(&decoder, body, strlen(body), 5, &payload);
+	result = (decoder.finished() && payload == "Wiki" &&
+		  trailers->get("Expires") != NULL &&
+		  strcmp(static_cast<const char *>(trailers->get("Expires")), "never") == 0 &&
+		  trailers->get("X-Sum") != NULL &&
+		  strcmp(static_cast<const char *>(trailers->get("X-Sum")), "42") == 0);
+
+	delete trailers;
+	return result;
+}
+
+bool rejects_bad_size(void)
+{
+	const char *body = "4\r\nWiki\r\nzz\r\npedia\r\n0\r\n\r\n";
+	WTChunkedDecoder decoder;
+	std::string payload;
+	size_t consumed = dechunk(&decoder, body, strlen(body), 64, &payload);
+
+	// What came before the bad line is still handed over, and the
+	// decoder stops at it
+	return (decoder.failed() && !decoder.finished() && consumed == 9 &&
+		payload == "Wiki" && decoder.decode("0\r\n\r\n", 5, NULL) == 0);
+}
+
+bool stops_after_last_chunk(void)
+{
+	const char *body = "4\r\nWiki\r\n0\r\n\r\nHTTP/1.1 200 OK\r\n";
+	WTChunkedDecoder decoder;
+	std::string payload;
+	size_t consumed = dechunk(&decoder, body, strlen(body), 7, &payload);
+
+	return (decoder.finished() && consumed == 14 && payload == "Wiki");
+}
+
+void test_chunked(void)
+{
+	DO_TEST(
+		"Decode chunk sizes split across feeds",
+		splits_sizes(),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Skip chunk extensions",
+		skips_extensions(),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Store trailer fields",
+		keeps_trailers(),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Fail on a bad chunk size",
+		rejects_bad_size(),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Leave bytes after the last chunk",
+		stops_after_last_chunk(),
+		NOTHING,
+		NOTHING
+		)
+};
+
+
+/* Hands out numbered tokens without going near a network */
+class FakeTokenSource : public WTOAuth2TokenSource
+{
+public:
+	int fetches, attempts;
+	long lifetime;
+	bool fail;
+	/* How long each fetch takes, in seconds */
+	unsigned int delay;
+
+	FakeTokenSource(long _lifetime) : fetches(0), attempts(0),
+		lifetime(_lifetime), fail(false), delay(0) {}
+
+	virtual bool fetch_token(const char *account, char **access_token,
+				 long *expires_in)
+	{
+		char token[64];
+
+		this->attempts++;
+		if(this->delay > 0) sleep(this->delay);
+		if(this->fail) return false;
+		snprintf(token, sizeof(token), "%s-%d", account, ++this->fetches);
+		*access_token = strdup(token);
+		*expires_in = this->lifetime;
+		return true;
+	}
+};
+
+/* Whether the manager's header for account is "Bearer " and token */
+static bool bearer_is(WTOAuth2TokenManager *manager, const char *account,
+		      const char *token)
+{
+	char *header = manager->authorization(account);
+	bool result = (header != NULL && strncmp(header, "Bearer ", 7) == 0 &&
+		       strcmp(header + 7, token) == 0);
+
+	free(header);
+	return result;
+}
+
+bool caches_tokens(void)
+{
+	FakeTokenSource source(3600);
+	WTOAuth2TokenManager manager(&source);
+
+	// Fetched once, then reused until thrown away
+	if(!bearer_is(&manager, "alice", "alice-1") ||
+	   !bearer_is(&manager, "alice", "alice-1") || source.fetches != 1)
+		return false;
+
+	manager.invalidate("alice");
+	if(!bearer_is(&manager, "alice", "alice-2")) return false;
+
+	// No token to be had is no header, not an old one
+	source.fail = true;
+	manager.invalidate("alice");
+	return (manager.authorization("alice") == NULL && source.fetches == 2);
+}
+
+bool refreshes_short_tokens(void)
+{
+	// Shorter-lived than refresh_ahead, with the thread checking every second
+	FakeTokenSource source(4);
+	WTOAuth2TokenManager manager(&source, 300, 1);
+
+	if(!manager.start() || !bearer_is(&manager, "bob", "bob-1")) return false;
+
+	// It's refreshed once, two or three seconds in, and the new token
+	// still has a second or more left at the end.  The new token is never
+	// used, so it's left alone after that.
+	sleep(4);
+	manager.stop();
+
+	return (source.fetches == 2 && bearer_is(&manager, "bob", "bob-2"));
+}
+
+static void *authorize_bob(mowgli_thread_t *thread, void *privdata)
+{
+	WTOAuth2TokenManager *manager = static_cast<WTOAuth2TokenManager *>(privdata);
+
+	free(manager->authorization("bob"));
+	return NULL;
+}
+
+bool coalesces_failures(void)
+{
+	// The endpoint is down, and slow to say so
+	FakeTokenSource source(3600);
+	WTOAuth2TokenManager manager(&source);
+	mowgli_thread_t threads[4];
+
+	source.fail = true;
+	source.delay = 1;
+	for(int next = 0; next < 4; next++)
+		if(mowgli_thread_create(&threads[next], authorize_bob, &manager) != 0)
+			return false;
+	for(int next = 0; next < 4; next++)
+		mowgli_thread_join(&threads[next]);
+
+	// Whoever queued up behind the first fetch failed with it
+	return (source.attempts == 1);
+}
+
+void test_oauth2(void)
+{
+	DO_TEST(
+		"Cache OAuth 2.0 tokens per account",
+		caches_tokens(),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Refresh short-lived OAuth 2.0 tokens once, and only in use",
+		refreshes_short_tokens(),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Fail requests queued behind a failed OAuth 2.0 fetch",
+		coalesces_failures(),
+		NOTHING,
+		NOTHING
+		)
+};
+
+
+int main(void)
+{
+	print_header("libAmy");
+
+	mowgli_init();
+
+	test_chunked();
+	test_oauth2();
+
+	PRINT_STATS
+
+	return 0;
+};
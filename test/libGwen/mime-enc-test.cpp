@@ -1,4 +1,8 @@
 #include <libGwen/WTMIMEEncoder.h>
+#include <libink/WTBase64.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "../test.h"
 
 bool single(WTMIMEAttachment *attach)
@@ -17,6 +21,292 @@ bool multiple(vector <WTMIMEAttachment *> multi)
 	return true;
 }
 
+/* Read a whole streamed body, size bytes at a time, splicing like uploads */
+static std::string drain(vector <WTMIMEAttachment *> multi, size_t size,
+			 bool splice = false)
+{
+	WTMIMEBody body(multi, "boundary");
+	std::string result;
+	char *buffer = new char[size];
+	size_t used;
+	int pipe_fds[2];
+	
+	if(splice && pipe(pipe_fds) != 0) return result;
+	
+	while(1)
+	{
+		if(splice && body.can_splice())
+		{
+			if(!body.splice_to(pipe_fds[1], size, &used)) break;
+			if(read(pipe_fds[0], buffer, used) != (ssize_t)used) break;
+		}
+		else if(!body.read(buffer, size, &used) || used == 0)
+			break;
+		result.append(buffer, used);
+	}
+	
+	if(splice)
+	{
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+	}
+	
+	delete[] buffer;
+	// The planned length must be exact, or the upload is refused
+	if(body.length() != WTBODY_LENGTH_UNKNOWN && body.length() != result.size())
+		result.clear();
+	return result;
+}
+
+bool streamed(vector <WTMIMEAttachment *> multi)
+{
+	std::string whole = drain(multi, 65536);
+	
+	// Small reads can't fit a line of base64, so they take another path
+	if(drain(multi, 7) != whole || drain(multi, 1000) != whole) return false;
+	
+	return (!whole.empty() &&
+		whole.compare(0, 12, "--boundary\r\n") == 0 &&
+		whole.compare(whole.size() - 14, 14, "--boundary--\r\n") == 0);
+}
+
+/* Read attach's data from test.png (or a pipe) rather than its buffer */
+static std::string drain_file(vector <WTMIMEAttachment *> multi,
+			      WTMIMEAttachment *attach, bool pipe, size_t size)
+{
+	const void *buffer = attach->data.buffer;
+	size_t length = attach->length;
+	std::string result;
+	FILE *f = (pipe ? popen("cat test.png", "r") : fopen("test.png", "rb"));
+	if(f == NULL) return result;
+	
+	attach->datatype = MIME_DATATYPE_FILE;
+	attach->data.file = f;
+	attach->length = 0;
+	result = drain(multi, size);
+	
+	// The whole-message encoder must manage files too
+	if(!pipe)
+	{
+		rewind(f);
+		if(!multiple(multi)) result.clear();
+	}
+	
+	if(pipe) pclose(f); else fclose(f);
+	attach->datatype = MIME_DATATYPE_BUFFER;
+	attach->data.buffer = buffer;
+	attach->length = length;
+	return result;
+}
+
+bool from_file(vector <WTMIMEAttachment *> multi, WTMIMEAttachment *attach)
+{
+	for(char enc = MIME_TRANSFER_BASE64; enc <= MIME_TRANSFER_BINARY; enc++)
+	{
+		attach->transfer_enc = enc;
+		std::string whole = drain(multi, 65536);
+		
+		if(drain_file(multi, attach, false, 65536) != whole ||
+		   drain_file(multi, attach, false, 7) != whole ||
+		   drain_file(multi, attach, true, 1000) != whole)
+			return false;
+	}
+	
+	return true;
+}
+
+/* Spool a message to a file and read it back */
+static std::string spool(vector <WTMIMEAttachment *> multi)
+{
+	std::string result;
+	char buffer[4096];
+	size_t got, written;
+	FILE *f = tmpfile();
+	if(f == NULL) return result;
+	
+	written = WTMIMEEncoder::encode_multiple_to_file(multi, f);
+	rewind(f);
+	while((got = fread(buffer, 1, sizeof buffer, f)) > 0)
+		result.append(buffer, got);
+	fclose(f);
+	
+	// It must say exactly how much it wrote
+	if(written != result.size()) result.clear();
+	return result;
+}
+
+/* Whether a message with attach's data failing to read is nothing written */
+static bool unreadable_to_file(vector <WTMIMEAttachment *> multi,
+			       WTMIMEAttachment *attach)
+{
+	const void *buffer = attach->data.buffer;
+	size_t length = attach->length, written;
+	int fds[2];
+	FILE *f;
+	
+	if(pipe(fds) != 0) return false;
+	if((f = tmpfile()) == NULL)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	attach->datatype = MIME_DATATYPE_SOCKET;
+	attach->data.socket = fds[0];
+	attach->length = 0;
+	written = WTMIMEEncoder::encode_multiple_to_file(multi, f);
+	
+	close(fds[0]);
+	close(fds[1]);
+	fclose(f);
+	attach->datatype = MIME_DATATYPE_BUFFER;
+	attach->data.buffer = buffer;
+	attach->length = length;
+	return (written == 0);
+}
+
+bool to_file(vector <WTMIMEAttachment *> multi)
+{
+	std::string message = spool(multi), body = drain(multi, 65536);
+	vector <WTMIMEAttachment *> single(multi.begin(), multi.begin() + 1);
+	std::string alone = spool(single);
+	size_t start = body.find("\r\n"), end = body.find("\r\n--", start);
+	
+	// A multipart message is its headers and then a body like an upload's
+	// (but with its own boundary)
+	if(message.empty() || message.compare(0, 19, "MIME-Version: 1.0\r\n") != 0 ||
+	   message.compare(message.size() - 4, 4, "--\r\n") != 0 ||
+	   message.find(body.substr(start, end - start)) == std::string::npos)
+		return false;
+	
+	// A single attachment is the whole message
+	start = alone.find("\r\n\r\n");
+	if(start == std::string::npos || alone.find("--") != std::string::npos ||
+	   alone.size() - start - 4 !=
+	   WTBase64::encoded_length(multi.at(0)->length, WTBASE64_MIME_LINE))
+		return false;
+	
+	// Nor is one whose data couldn't be read (a pipe isn't a socket)
+	if(!unreadable_to_file(multi, multi.at(1))) return false;
+	
+	// A message that didn't fit (stdio takes it, then fails to flush
+	// it) isn't counted as written
+	FILE *full = fopen("/dev/full", "w");
+	if(full == NULL) return true;
+	size_t written = WTMIMEEncoder::encode_multiple_to_file(single, full);
+	fclose(full);
+	return (written == 0);
+}
+
+/* Read attach's data from a socket the PNG is sent down */
+static std::string drain_socket(vector <WTMIMEAttachment *> multi,
+				WTMIMEAttachment *attach, bool splice)
+{
+	const void *buffer = attach->data.buffer;
+	size_t length = attach->length;
+	std::string result;
+	int pair[2];
+	
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) return result;
+	// It fits in the socket's buffer, so there's no need for a writer
+	if(write(pair[0], buffer, length) == (ssize_t)length)
+	{
+		shutdown(pair[0], SHUT_WR);
+		
+		attach->datatype = MIME_DATATYPE_SOCKET;
+		attach->data.socket = pair[1];
+		attach->length = 0;
+		result = drain(multi, 4096, splice);
+	}
+	
+	close(pair[0]);
+	close(pair[1]);
+	attach->datatype = MIME_DATATYPE_BUFFER;
+	attach->data.buffer = buffer;
+	attach->length = length;
+	return result;
+}
+
+bool from_socket(vector <WTMIMEAttachment *> multi, WTMIMEAttachment *attach)
+{
+	for(char enc = MIME_TRANSFER_BASE64; enc <= MIME_TRANSFER_BINARY; enc++)
+	{
+		attach->transfer_enc = enc;
+		std::string whole = drain(multi, 65536);
+		
+		if(drain_socket(multi, attach, false) != whole ||
+		   drain_socket(multi, attach, true) != whole)
+			return false;
+	}
+	
+	return true;
+}
+
+/*
+ * Read the first length bytes of attach's data from a pipe or a socket, size
+ * bytes at a time, and check it matches reading them from the buffer
+ */
+static bool drain_stream(vector <WTMIMEAttachment *> multi,
+			 WTMIMEAttachment *attach, bool socket, size_t length,
+			 size_t size)
+{
+	const void *buffer = attach->data.buffer;
+	size_t saved = attach->length;
+	std::string whole, result;
+	FILE *f = NULL;
+	int fds[2];
+	
+	attach->length = length;
+	whole = drain(multi, 65536);
+	
+	if((socket ? socketpair(AF_UNIX, SOCK_STREAM, 0, fds) : pipe(fds)) != 0)
+		return false;
+	// Small enough to sit in the pipe's buffer until it's read
+	if(write(fds[1], buffer, length) == (ssize_t)length)
+	{
+		if(socket)
+		{
+			shutdown(fds[1], SHUT_WR);
+			attach->datatype = MIME_DATATYPE_SOCKET;
+			attach->data.socket = fds[0];
+		} else {
+			close(fds[1]);
+			fds[1] = -1;
+			f = fdopen(fds[0], "rb");
+			attach->datatype = MIME_DATATYPE_FILE;
+			attach->data.file = f;
+		}
+		attach->length = 0;
+		if(socket || f != NULL) result = drain(multi, size);
+	}
+	
+	if(f != NULL) fclose(f); else close(fds[0]);
+	if(fds[1] != -1) close(fds[1]);
+	attach->datatype = MIME_DATATYPE_BUFFER;
+	attach->data.buffer = buffer;
+	attach->length = saved;
+	return (!whole.empty() && result == whole);
+}
+
+bool small_reads(vector <WTMIMEAttachment *> multi, WTMIMEAttachment *attach)
+{
+	// One line of base64, a part of a line, and whole 1000-byte reads'
+	// worth (684 bytes is twelve lines)
+	const size_t lengths[] = { 57, 684, 1000 }, sizes[] = { 7, 60, 1000 };
+	
+	for(char enc = MIME_TRANSFER_BASE64; enc <= MIME_TRANSFER_BINARY; enc++)
+	{
+		attach->transfer_enc = enc;
+		for(size_t l = 0; l < 3; l++)
+			for(size_t s = 0; s < 3; s++)
+				if(!drain_stream(multi, attach, false, lengths[l], sizes[s]) ||
+				   !drain_stream(multi, attach, true, lengths[l], sizes[s]))
+					return false;
+	}
+	
+	return true;
+}
+
 int main(void)
 {
 	WTMIMEAttachment *attach, *attach2;
@@ -100,6 +390,31 @@ int main(void)
 		NOTHING,
 		NOTHING)
 	
+	DO_TEST("Streamed multipart body",
+		streamed(multi),
+		NOTHING,
+		NOTHING)
+	
+	DO_TEST("Multipart body with a file attachment",
+		from_file(multi, attach2),
+		NOTHING,
+		NOTHING)
+	
+	DO_TEST("Multipart body with a socket attachment",
+		from_socket(multi, attach2),
+		NOTHING,
+		NOTHING)
+	
+	DO_TEST("Pipe and socket attachments read in small pieces",
+		small_reads(multi, attach2),
+		NOTHING,
+		NOTHING)
+	
+	DO_TEST("MIME message written to a file",
+		to_file(multi),
+		NOTHING,
+		NOTHING)
+	
 	free((void *)attach2->data.buffer);
 	delete attach2;
 	delete attach;
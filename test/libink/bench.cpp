@@ -0,0 +1,518 @@
+/*
+ * bench.cpp - libink microbenchmarks
+ * libInk, the glue holding together
+ * eScape
+ * Wilcox Technologies, LLC
+ *
+ * Copyright (C) 2011 Wilcox Technologies, LLC.  Some rights reserved.
+ * License: NCSA-WT
+ *
+ * Prints one CSV row per measurement:
+ *	container,operation,size,key_length,threads,ops,ns_per_op
+ * where ns_per_op is wall-clock time over the operations done by all
+ * threads together, so it falls as reads scale.  Run with -q for a quick
+ * pass over smaller sizes.
+ *
+ * The URL encoding rows compare WTURLEncoder against URLEncode from
+ * Utility.h and uriparser's unescaping; there size is the input length and
+ * ns_per_op is per call.
+ *
+ * The base64 rows compare WTBase64 against libb64, which it replaced in the
+ * MIME encoder and the OAuth signer; size is the length of the raw data, so
+ * size / ns_per_op is the throughput in GB/s.
+ */
+
+#include <libink/WTDictionary.h>
+#include <libink/WTDict.h>
+#include <libink/WTURLEncoder.h>
+#include <libink/WTBase64.h>
+#include <b64/encode.h>
+#include <b64/decode.h>
+#include <uriparser/Uri.h>
+#include <libmowgli/mowgli.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#	include <unordered_map>
+#endif
+
+#ifdef _WIN32
+#	include <windows.h>
+#else
+#	include <time.h>
+#endif
+
+static double now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (static_cast<double>(count.QuadPart) * 1e9) / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9) + ts.tv_nsec;
+#endif
+}
+
+/* Keep the optimiser from dropping work whose result we don't use */
+static volatile size_t sink;
+
+struct workload
+{
+	size_t size;
+	size_t key_length;
+	size_t rounds;
+	std::vector<char *> keys;
+	std::vector<char *> values;
+	std::vector<char *> new_values;
+};
+
+static char *make_string(const char *prefix, size_t number, size_t length)
+{
+	char *str = static_cast<char *>(malloc(length + 1));
+	int used = snprintf(str, length + 1, "%s%lu-", prefix, static_cast<unsigned long>(number));
+	for(size_t fill = used; fill < length; fill++)
+		str[fill] = 'a' + ((number + fill) % 26);
+	str[length] = '\0';
+	return str;
+}
+
+static void make_workload(workload *work, size_t size, size_t key_length, size_t rounds)
+{
+	work->size = size;
+	work->key_length = key_length;
+	work->rounds = rounds;
+	for(size_t next = 0; next < size; next++)
+	{
+		// Spread the keys out so sorted containers don't get them in order
+		size_t number = (next * 2654435761UL) % 1000003;
+		work->keys.push_back(make_string("Key-", number, key_length));
+		work->values.push_back(make_string("value-", next, 16));
+		work->new_values.push_back(make_string("other-", next, 16));
+	}
+}
+
+static void free_workload(workload *work)
+{
+	for(size_t next = 0; next < work->size; next++)
+	{
+		free(work->keys[next]);
+		free(work->values[next]);
+		free(work->new_values[next]);
+	}
+}
+
+static void report(const char *container, const char *operation,
+		   const workload *work, int threads, size_t ops, double elapsed)
+{
+	printf("%s,%s,%lu,%lu,%d,%lu,%.2f\n", container, operation,
+	       static_cast<unsigned long>(work->size),
+	       static_cast<unsigned long>(work->key_length), threads,
+	       static_cast<unsigned long>(ops), elapsed / ops);
+	fflush(stdout);
+}
+
+/*
+ * Adapters giving each container the same face:
+ *	set, get, remove, enumerate (walk every key and value) and all
+ *	(serialise as "%s=%s&", the OAuth parameter format).
+ */
+class dictionary_adapter
+{
+public:
+	dictionary_adapter(unsigned int options) : options(options), dict(NULL) {}
+	~dictionary_adapter() { delete dict; }
+	void reset(void) { delete dict; dict = new WTDictionary(false, options); }
+	void set(const char *key, const char *value) { dict->set(key, value); }
+	const char *get(const char *key) { return static_cast<const char *>(dict->get(key)); }
+	void remove(const char *key) { dict->set(key, NULL); }
+	size_t enumerate(void)
+	{
+		const char **keys = dict->allKeys();
+		const void **values = dict->allValues();
+		size_t total = 0;
+		for(size_t next = 0; next < dict->count(); next++)
+			total += keys[next][0] + static_cast<const char *>(values[next])[0];
+		return total;
+	}
+	size_t all(void)
+	{
+		WTSizedBuffer *buff = dict->all("%s=%s&");
+		size_t length = buff->buffer_len;
+		WTSizedBufferFree(buff);
+		return length;
+	}
+private:
+	unsigned int options;
+	WTDictionary *dict;
+};
+
+class typed_adapter
+{
+public:
+	void reset(void) { dict = WTDict<const char *>(); }
+	void set(const char *key, const char *value) { dict.set(key, value); }
+	const char *get(const char *key) { const char **value = dict.get(key); return (value == NULL ? NULL : *value); }
+	void remove(const char *key) { dict.remove(key); }
+	size_t enumerate(void)
+	{
+		size_t total = 0;
+		for(WTDict<const char *>::iterator entry = dict.begin(); entry != dict.end(); ++entry)
+			total += entry->key.c_str()[0] + entry->value[0];
+		return total;
+	}
+	size_t all(void)
+	{
+		std::string out;
+		for(WTDict<const char *>::iterator entry = dict.begin(); entry != dict.end(); ++entry)
+		{
+			out.append(entry->key.c_str(), entry->key.length());
+			out += '=';
+			out += entry->value;
+			out += '&';
+		}
+		return out.length();
+	}
+private:
+	WTDict<const char *> dict;
+};
+
+template <typename M>
+class std_adapter
+{
+public:
+	void reset(void) { map.clear(); }
+	void set(const char *key, const char *value) { map[key] = value; }
+	const char *get(const char *key)
+	{
+		typename M::const_iterator found = map.find(key);
+		return (found == map.end() ? NULL : found->second);
+	}
+	void remove(const char *key) { map.erase(key); }
+	size_t enumerate(void)
+	{
+		size_t total = 0;
+		for(typename M::const_iterator entry = map.begin(); entry != map.end(); ++entry)
+			total += entry->first[0] + entry->second[0];
+		return total;
+	}
+	size_t all(void)
+	{
+		std::string out;
+		for(typename M::const_iterator entry = map.begin(); entry != map.end(); ++entry)
+		{
+			out += entry->first;
+			out += '=';
+			out += entry->second;
+			out += '&';
+		}
+		return out.length();
+	}
+private:
+	M map;
+};
+
+template <typename A>
+struct reader_args
+{
+	A *adapter;
+	const workload *work;
+	size_t start;
+};
+
+template <typename A>
+static void *reader(mowgli_thread_t *thread, void *userdata)
+{
+	reader_args<A> *args = static_cast<reader_args<A> *>(userdata);
+	size_t found = 0;
+
+	for(size_t round = 0; round < args->work->rounds; round++)
+		for(size_t next = 0; next < args->work->size; next++)
+			found += (args->adapter->get(args->work->keys[(next + args->start) % args->work->size]) != NULL);
+
+	sink = found;
+	return NULL;
+}
+
+template <typename A>
+static void run(const char *name, A &adapter, const workload *work,
+		const std::vector<int> &thread_counts)
+{
+	size_t size = work->size, rounds = work->rounds;
+	double start;
+	size_t total = 0;
+
+	// set: build the whole container, rounds times over
+	start = now_ns();
+	for(size_t round = 0; round < rounds; round++)
+	{
+		adapter.reset();
+		for(size_t next = 0; next < size; next++)
+			adapter.set(work->keys[next], work->values[next]);
+	}
+	report(name, "set", work, 1, size * rounds, now_ns() - start);
+
+	start = now_ns();
+	for(size_t round = 0; round < rounds; round++)
+		for(size_t next = 0; next < size; next++)
+			adapter.set(work->keys[next], (round & 1) ? work->values[next] : work->new_values[next]);
+	report(name, "replace", work, 1, size * rounds, now_ns() - start);
+
+	start = now_ns();
+	for(size_t round = 0; round < rounds; round++)
+		total += adapter.enumerate();
+	report(name, "enumerate", work, 1, size * rounds, now_ns() - start);
+
+	start = now_ns();
+	for(size_t round = 0; round < rounds; round++)
+		total += adapter.all();
+	report(name, "all", work, 1, size * rounds, now_ns() - start);
+
+	// get: every key, from each of a number of threads at once
+	for(size_t count = 0; count < thread_counts.size(); count++)
+	{
+		int threads = thread_counts[count];
+		std::vector<mowgli_thread_t> handles(threads);
+		std::vector<reader_args<A> > args(threads);
+
+		start = now_ns();
+		for(int thread = 0; thread < threads; thread++)
+		{
+			args[thread].adapter = &adapter;
+			args[thread].work = work;
+			args[thread].start = thread * (size / threads);
+			if(threads == 1)
+				reader<A>(NULL, &args[thread]);
+			else
+				mowgli_thread_create(&handles[thread], &reader<A>, &args[thread]);
+		}
+		if(threads > 1)
+			for(int thread = 0; thread < threads; thread++)
+				mowgli_thread_join(&handles[thread]);
+		report(name, "get", work, threads, size * rounds * threads, now_ns() - start);
+	}
+
+	// delete: only the removals are timed, not the refills
+	double elapsed = 0;
+	for(size_t round = 0; round < rounds; round++)
+	{
+		if(round > 0)
+			for(size_t next = 0; next < size; next++)
+				adapter.set(work->keys[next], work->values[next]);
+		start = now_ns();
+		for(size_t next = 0; next < size; next++)
+			adapter.remove(work->keys[next]);
+		elapsed += now_ns() - start;
+	}
+	report(name, "delete", work, 1, size * rounds, elapsed);
+
+	sink = total;
+}
+
+/* Something like an OAuth parameter string: mostly unreserved, some not */
+static char *make_url_input(size_t length)
+{
+	const char *sample = "oauth_consumer_key=dpf43f3p2l4k3l03&oauth_nonce=kllo9940pd9333jh&status=Hello Ladies + Gentlemen, a signed OAuth request!&";
+	size_t sample_len = strlen(sample);
+	char *str = static_cast<char *>(malloc(length + 1));
+	for(size_t next = 0; next < length; next++)
+		str[next] = sample[next % sample_len];
+	str[length] = '\0';
+	return str;
+}
+
+static void run_url(bool quick)
+{
+	const size_t lengths[] = { 16, 128, 1024, 16384 };
+	
+	for(size_t size = 0; size < 4; size++)
+	{
+		workload work;
+		size_t length = lengths[size];
+		size_t rounds = (quick ? 2000000 : 20000000) / length;
+		char *input = make_url_input(length);
+		char *encoded = static_cast<char *>(malloc(length * 3 + 1));
+		char *scratch = static_cast<char *>(malloc(length * 3 + 1));
+		size_t encoded_len, total = 0;
+		double start;
+		
+		work.size = length;
+		work.key_length = 0;
+		
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			char *out = URLEncode(input);
+			total += out[0];
+			free(out);
+		}
+		report("URLEncode", "encode", &work, 1, rounds, now_ns() - start);
+		
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+			total += WTURLEncoder::encode(input, length, encoded, length * 3 + 1);
+		report("WTURLEncoder", "encode", &work, 1, rounds, now_ns() - start);
+		
+		encoded_len = strlen(encoded);
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			memcpy(scratch, encoded, encoded_len + 1);
+			// Returns the new terminator
+			total += uriUnescapeInPlaceA(scratch) - scratch;
+		}
+		report("uriparser", "decode", &work, 1, rounds, now_ns() - start);
+		
+		// The same copy first, so the two decode rows are comparable
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			memcpy(scratch, encoded, encoded_len + 1);
+			total += WTURLEncoder::decode(scratch, encoded_len, scratch);
+		}
+		report("WTURLEncoder", "decode", &work, 1, rounds, now_ns() - start);
+		
+		sink = total;
+		free(input);
+		free(encoded);
+		free(scratch);
+	}
+}
+
+static void run_base64(bool quick)
+{
+	const size_t lengths[] = { 57, 1024, 65536, 1048576 };
+	
+	for(size_t size = 0; size < 4; size++)
+	{
+		workload work;
+		size_t length = lengths[size];
+		size_t rounds = (quick ? 20000000 : 200000000) / length;
+		char *input = static_cast<char *>(malloc(length));
+		// libb64 breaks lines with a bare \n, we use \r\n
+		size_t room = WTBase64::encoded_length(length, WTBASE64_MIME_LINE) + 4;
+		char *encoded = static_cast<char *>(malloc(room));
+		char *decoded = static_cast<char *>(malloc(length + 4));
+		size_t encoded_len, total = 0;
+		double start;
+		
+		for(size_t next = 0; next < length; next++)
+			input[next] = static_cast<char>(rand());
+		work.size = length;
+		work.key_length = 0;
+		
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			base64::base64_encodestate state;
+			base64::base64_init_encodestate(&state);
+			encoded_len = base64::base64_encode_block(input, length, encoded, &state);
+			total += encoded_len + base64::base64_encode_blockend(encoded + encoded_len, &state);
+		}
+		report("libb64", "encode", &work, 1, rounds, now_ns() - start);
+		
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+			total += WTBase64::encode(input, length, encoded);
+		report("WTBase64", "encode", &work, 1, rounds, now_ns() - start);
+		
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+			total += WTBase64::encode(input, length, encoded, WTBASE64_MIME_LINE);
+		report("WTBase64", "encode-wrapped", &work, 1, rounds, now_ns() - start);
+		
+		encoded_len = WTBase64::encode(input, length, encoded);
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			base64::base64_decodestate state;
+			base64::base64_init_decodestate(&state);
+			total += base64::base64_decode_block(encoded, encoded_len, decoded, &state);
+		}
+		report("libb64", "decode", &work, 1, rounds, now_ns() - start);
+		
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			size_t used;
+			WTBase64::decode(encoded, encoded_len, decoded, &used);
+			total += used;
+		}
+		report("WTBase64", "decode", &work, 1, rounds, now_ns() - start);
+		
+		encoded_len = WTBase64::encode(input, length, encoded, WTBASE64_MIME_LINE);
+		start = now_ns();
+		for(size_t round = 0; round < rounds; round++)
+		{
+			size_t used;
+			WTBase64::decode(encoded, encoded_len, decoded, &used);
+			total += used;
+		}
+		report("WTBase64", "decode-wrapped", &work, 1, rounds, now_ns() - start);
+		
+		sink = total;
+		free(input);
+		free(encoded);
+		free(decoded);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	bool quick = (argc > 1 && strcmp(argv[1], "-q") == 0);
+	const size_t full_sizes[] = { 8, 64, 1024, 16384, 131072 };
+	const size_t quick_sizes[] = { 8, 64, 1024 };
+	const size_t key_lengths[] = { 8, 24, 96 };
+	const size_t *sizes = (quick ? quick_sizes : full_sizes);
+	size_t size_count = (quick ? 3 : 5);
+	std::vector<int> thread_counts;
+
+	thread_counts.push_back(1);
+	thread_counts.push_back(2);
+	thread_counts.push_back(4);
+	if(!quick) thread_counts.push_back(8);
+
+	mowgli_init();
+	printf("container,operation,size,key_length,threads,ops,ns_per_op\n");
+
+	for(size_t size = 0; size < size_count; size++)
+	{
+		for(size_t length = 0; length < 3; length++)
+		{
+			workload work;
+			// Roughly the same number of operations for every size
+			size_t rounds = (quick ? 20000 : 200000) / sizes[size];
+			make_workload(&work, sizes[size], key_lengths[length], (rounds == 0 ? 1 : rounds));
+
+			dictionary_adapter patricia(WTDICT_OPT_DEFAULT);
+			dictionary_adapter hashed(WTDICT_OPT_HASHED);
+			dictionary_adapter unlocked(WTDICT_OPT_HASHED | WTDICT_OPT_UNLOCKED);
+			typed_adapter typed;
+			std_adapter<std::map<std::string, const char *> > ordered;
+
+			run("WTDictionary", patricia, &work, thread_counts);
+			run("WTDictionary-hashed", hashed, &work, thread_counts);
+			// No lock means one thread at a time
+			run("WTDictionary-hashed-unlocked", unlocked, &work, std::vector<int>(1, 1));
+			run("WTDict", typed, &work, std::vector<int>(1, 1));
+			run("std::map", ordered, &work, thread_counts);
+#if __cplusplus >= 201103L
+			std_adapter<std::unordered_map<std::string, const char *> > unordered;
+			run("std::unordered_map", unordered, &work, thread_counts);
+#endif
+
+			free_workload(&work);
+		}
+	}
+
+	run_url(quick);
+	run_base64(quick);
+
+	return 0;
+}
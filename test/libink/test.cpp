@@ -1,5 +1,10 @@
 #include <libink/WTDictionary.h>
+#include <libink/WTDict.h>
 #include <libink/WTFormParser.h>
+#include <libink/WTURLEncoder.h>
+#include <libink/WTBase64.h>
+#include <algorithm>
+#include <string>
 #include "../test.h"
 
 bool insert_into_managed(WTDictionary *dict)
@@ -77,6 +82,180 @@ bool managed_in_nonmanaged(WTDictionary *dict)
 	return true;
 }
 
+bool iterate_matches_arrays(WTDictionary *dict)
+{
+	const char **keys = dict->allKeys();
+	const void **values = dict->allValues();
+	size_t seen = 0;
+	
+	for(WTDictionary::iterator entry = dict->begin(); entry != dict->end(); ++entry, ++seen)
+	{
+		if(entry->key != keys[seen] || entry->value != values[seen]) return false;
+		// The default backend keeps keys sorted
+		if(seen > 0 && strcmp(keys[seen - 1], keys[seen]) >= 0) return false;
+	}
+	
+	return (seen == dict->count());
+}
+
+bool all_into_matches_all(WTDictionary *dict)
+{
+	WTSizedBuffer *buff = dict->all("%s=%s&");
+	char small[16];
+	char *exact = static_cast<char *>(malloc(buff->buffer_len + 1));
+	bool ok = true;
+	
+	// Measuring, filling and truncating all agree with ::all
+	if(dict->allInto(NULL, 0, "%s=%s&") != buff->buffer_len) ok = false;
+	if(dict->allInto(exact, buff->buffer_len + 1, "%s=%s&") != buff->buffer_len ||
+	   strcmp(exact, buff->buffer) != 0) ok = false;
+	if(dict->allInto(small, sizeof(small), "%s=%s&") != buff->buffer_len ||
+	   strlen(small) != sizeof(small) - 1 ||
+	   strncmp(small, buff->buffer, sizeof(small) - 1) != 0) ok = false;
+	
+	free(exact);
+	WTSizedBufferFree(buff);
+	return ok;
+}
+
+static int destroyed = 0;
+static void count_destroyed(void *value)
+{
+	++destroyed;
+	free(value);
+}
+
+bool destructors_in_nonmanaged(WTDictionary *dict)
+{
+	destroyed = 0;
+	dict->set("Destroyed 1", strdup("Replaced"), &count_destroyed);
+	dict->set("Destroyed 1", strdup("Removed"), &count_destroyed);
+	dict->set("Destroyed 2", strdup("Cleared"), &count_destroyed);
+	dict->set("Destroyed 1", NULL);
+	if(destroyed != 2) return false;
+	
+	dict->clear();
+	return (destroyed == 3 && dict->count() == 0);
+}
+
+bool copy_diverges(WTDictionary *dict)
+{
+	WTDictionary *copy = new WTDictionary(*dict);
+	size_t count = dict->count();
+	bool ok = true;
+	
+	// Until one is changed the two share everything
+	if(copy->count() != count || copy->allKeys() != dict->allKeys()) ok = false;
+	
+	copy->set("Key 1", strdup("Copy's value"));
+	copy->set("Key 2", NULL);
+	copy->set("Copy only", strdup("Hi!"));
+	
+	if(strcmp(static_cast<const char *>(dict->get("Key 1")), "Value 1") != 0 ||
+	   dict->get("Key 2") == NULL || dict->get("Copy only") != NULL ||
+	   dict->count() != count) ok = false;
+	if(strcmp(static_cast<const char *>(copy->get("Key 1")), "Copy's value") != 0 ||
+	   copy->get("Key 2") != NULL || copy->count() != count) ok = false;
+	
+	// Values the copy inherited stay valid after it is gone
+	delete copy;
+	return (ok && strcmp(static_cast<const char *>(dict->get("Key 3")), "Value 3") == 0);
+}
+
+bool copy_shares_values(void)
+{
+	WTDictionary *dict = new WTDictionary(true);
+	char *value = strdup("Shared");
+	dict->set("Key", value);
+	
+	WTDictionary *copy = new WTDictionary(*dict);
+	
+	// Setting what's already there (or removing what isn't) is no change,
+	// so it mustn't copy the store or take the value from its owner
+	copy->set("Key", value);
+	copy->set("Missing", NULL);
+	bool ok = (copy->allKeys() == dict->allKeys());
+	
+	// A real change copies; the copy's inherited value stays the original's
+	copy->set("Other", strdup("Mine"));
+	copy->set("Key", value);
+	ok = ok && (copy->allKeys() != dict->allKeys());
+	
+	delete copy;
+	ok = ok && (dict->get("Key") == value);
+	delete dict;
+	return ok;
+}
+
+/* Copy the dictionary, change the copy and throw it away, over and over */
+static void *copy_and_change(mowgli_thread_t *thread, void *privdata)
+{
+	WTDictionary *dict = static_cast<WTDictionary *>(privdata);
+	
+	for(int round = 0; round < 2000; round++)
+	{
+		WTDictionary *copy = new WTDictionary(*dict);
+		copy->set_copy("Key", "Copy's value");
+		copy->set_copy("Copy only", "Hi!");
+		delete copy;
+	}
+	
+	return NULL;
+}
+
+bool copies_across_threads(void)
+{
+	WTDictionary *dict = new WTDictionary(true);
+	mowgli_thread_t threads[2];
+	char key[32];
+	
+	dict->set_copy("Key", "Value");
+	
+	for(int next = 0; next < 2; next++)
+		if(mowgli_thread_create(&threads[next], copy_and_change, dict) != 0)
+			return false;
+	
+	// Meanwhile the original changes, which detaches it from (or
+	// changes it alongside) whichever copies still share its store
+	for(int round = 0; round < 2000; round++)
+	{
+		snprintf(key, sizeof(key), "Key %d", round % 16);
+		dict->set_copy(key, "Original's value");
+		if(round % 3 == 0) dict->set(key, NULL);
+	}
+	
+	for(int next = 0; next < 2; next++)
+		mowgli_thread_join(&threads[next]);
+	
+	bool ok = (strcmp(static_cast<const char *>(dict->get("Key")), "Value") == 0 &&
+		   dict->get("Copy only") == NULL);
+	delete dict;
+	return ok;
+}
+
+bool batched_changes(void)
+{
+	const char *keys[] = { "Alpha", "Bravo", "Charlie", "Delta" };
+	const void *values[] = { "1", "2", "3", "4" };
+	WTDictionary sorted(keys, values, 4, false);
+	
+	if(sorted.count() != 4 || strcmp(sorted.allKeys()[3], "Delta") != 0) return false;
+	
+	// Replace one, remove one and add one in a single batch
+	const char *change_keys[] = { "Bravo", "Charlie", "Echo" };
+	const void *change_values[] = { "two", NULL, "5" };
+	sorted.set_many(change_keys, change_values, 3);
+	
+	const char *copy_keys[] = { "Foxtrot", "Golf" };
+	const char *copy_values[] = { "6", NULL };
+	sorted.set_copy_many(copy_keys, copy_values, 2);
+	
+	return (sorted.count() == 5 && sorted.get("Charlie") == NULL &&
+		strcmp(static_cast<const char *>(sorted.get("Bravo")), "two") == 0 &&
+		strcmp(static_cast<const char *>(sorted.get("Foxtrot")), "6") == 0 &&
+		sorted.get("Golf") == NULL);
+}
+
 void test_dict(void)
 {
 	WTDictionary *dict1, *dict2;
@@ -130,6 +309,27 @@ void test_dict(void)
 	buff = dict1->all();
 	printf("%s\n",buff->buffer);
 	
+	DO_TEST(
+		"Iterate over managed dictionary",
+		iterate_matches_arrays(dict1),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Copy managed dictionary and change the copy",
+		copy_diverges(dict1),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Serialise managed dictionary into a caller buffer",
+		all_into_matches_all(dict1),
+		NOTHING,
+		NOTHING
+		)
+	
 	DO_TEST(
 		"Add some non-managed values to managed dictionary and remove them",
 		nonmanaged_in_managed(dict1),
@@ -143,6 +343,34 @@ void test_dict(void)
 		NOTHING,
 		NOTHING
 		)
+	
+	DO_TEST(
+		"Release values with a destructor in non-managed dictionary",
+		destructors_in_nonmanaged(dict2),
+		NOTHING,
+		NOTHING
+		)
+
+	DO_TEST(
+		"Set a copy's inherited key to the same value",
+		copy_shares_values(),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Copy and change a dictionary across threads",
+		copies_across_threads(),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Build a dictionary from sorted arrays and change it in batches",
+		batched_changes(),
+		NOTHING,
+		NOTHING
+		)
 
 	DO_TEST(
 		"Deallocate managed dictionary",
@@ -162,8 +390,368 @@ void test_dict(void)
 };
 
 
+bool hashed_lookups(WTDictionary *dict)
+{
+	const char *value;
+	
+	// Keys in the hashed backend are not case-sensitive
+	value = static_cast<const char *>(dict->get("KEY 4A"));
+	if(value == NULL || strcmp(value, "New value") != 0) return false;
+	
+	if(dict->get("to delete 1") != NULL) return false;
+	
+	return (dict->count() == 13);
+}
+
+void test_hashed_dict(void)
+{
+	WTDictionary *dict;
+	WTSizedBuffer *buff;
+	
+	DO_TEST(
+		"Create hashed dictionary",
+		(dict = new WTDictionary(true, WTDICT_OPT_HASHED)),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Insert, remove and replace values in hashed dictionary",
+		(insert_into_managed(dict) && remove_managed(dict) && replace_managed(dict)),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Look up values in hashed dictionary",
+		hashed_lookups(dict),
+		NOTHING,
+		NOTHING
+		)
+	
+	printf("Values:");
+	buff = dict->all();
+	printf("%s\n",buff->buffer);
+	WTSizedBufferFree(buff);
+	
+	DO_TEST(
+		"Deallocate hashed dictionary",
+		true,
+		NOTHING,
+		NOTHING
+		)
+	delete dict;
+};
+
+
+bool copies_in_arena(WTDictionary *dict)
+{
+	const char *value;
+	
+	dict->set_copy("Content-Length: 42", 14, "42\r\n", 2);
+	dict->set_copy("Connection", "keep-alive");
+	dict->set_copy("connection", "close");	// replaces, ignoring case
+	dict->set("Owned", strdup("Freed as usual"));
+	
+	value = static_cast<const char *>(dict->get("content-length"));
+	if(value == NULL || strcmp(value, "42") != 0) return false;
+	value = static_cast<const char *>(dict->get("Connection"));
+	if(value == NULL || strcmp(value, "close") != 0) return false;
+	if(dict->count() != 3) return false;
+	
+	// Clearing releases the arena; the dictionary is usable afterwards
+	dict->clear();
+	dict->set_copy("After", "clear");
+	return (dict->count() == 1 && dict->get("Connection") == NULL);
+}
+
+void test_arena_dict(void)
+{
+	WTDictionary *dict;
+	
+	DO_TEST(
+		"Create arena dictionary",
+		(dict = new WTDictionary(true, WTDICT_OPT_HASHED | WTDICT_OPT_ARENA)),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Copy values into arena dictionary",
+		copies_in_arena(dict),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Deallocate arena dictionary",
+		true,
+		NOTHING,
+		NOTHING
+		)
+	delete dict;
+};
+
+
+bool typed_values(void)
+{
+	WTDict<WTSmallString> headers;
+	WTDict<long> numbers;
+	const char *long_value = "A value too long to be kept inside the string";
+	
+	headers.set("Connection", "Close");
+	headers.set("User-Agent", long_value);
+	headers.set("connection", "keep-alive");	// replaces, ignoring case
+	numbers.set("Content-Length", 42);
+	
+	if(headers.count() != 2 || numbers.count() != 1) return false;
+	if(strcmp(headers.get("CONNECTION")->c_str(), "keep-alive") != 0) return false;
+	if(strcmp(headers.get("user-agent")->c_str(), long_value) != 0) return false;
+	if(*(numbers.get("content-length")) != 42) return false;
+	
+	// Removing the first key moves the last one into its place
+	if(!headers.remove("Connection") || headers.get("Connection") != NULL) return false;
+	return (headers.count() == 1 && headers.begin()->key == WTStringView("User-Agent"));
+}
+
+void test_typed_dict(void)
+{
+	DO_TEST(
+		"Store values inline in typed dictionaries",
+		typed_values(),
+		NOTHING,
+		NOTHING
+		)
+};
+
+
+bool parses_form(void)
+{
+	WTDictionary *dict = WTFormParser::get_params("name=J+Random%20User&empty=&flag&a%2Bb=1%3D1&&name=last");
+	bool ok = (dict != NULL && dict->count() == 4 &&
+		   strcmp(static_cast<const char *>(dict->get("name")), "last") == 0 &&
+		   strcmp(static_cast<const char *>(dict->get("empty")), "") == 0 &&
+		   strcmp(static_cast<const char *>(dict->get("flag")), "") == 0 &&
+		   strcmp(static_cast<const char *>(dict->get("a+b")), "1=1") == 0);
+	delete dict;
+	return ok;
+}
+
+/* Append each field to privdata as "name=value;" */
+static int collect_field(const WTFormField *field, void *privdata)
+{
+	std::string *out = static_cast<std::string *>(privdata);
+	out->append(field->name.data(), field->name.length());
+	*out += '=';
+	out->append(field->value.data(), field->value.length());
+	*out += ';';
+	return 0;
+}
+
+bool feeds_in_pieces(void)
+{
+	const char *form = "a=1&b=two+words&a=%41%zz&&last";
+	size_t length = strlen(form);
+	std::string whole;
+	char *copy = strdup(form);
+	
+	// Duplicates are all reported, and a bad escape is left alone
+	if(WTFormParser::scan(copy, length, &collect_field, &whole) != 4) return false;
+	free(copy);
+	if(whole != "a=1;b=two words;a=A%zz;last=;") return false;
+	
+	// Splitting the form anywhere must give the same fields
+	for(size_t split = 0; split <= length; split++)
+	{
+		WTFormParser parser;
+		std::string pieces;
+		copy = strdup(form);
+		parser.feed(copy, split, &collect_field, &pieces);
+		parser.feed(copy + split, length - split, &collect_field, &pieces);
+		parser.finish(&collect_field, &pieces);
+		free(copy);
+		if(pieces != whole) return false;
+	}
+	
+	return true;
+}
+
+/* Note the first field's value, as it was handed over */
+static int first_value(const WTFormField *field, void *privdata)
+{
+	*static_cast<const char **>(privdata) = field->value.data();
+	return 1;
+}
+
+bool scans_without_copying(void)
+{
+	const char form[] = "a=1&b=two+words&a=%41%zz&&last";
+	size_t length = strlen(form);
+	std::string fields;
+	const char *value = NULL;
+	WTArena arena;
+	
+	// The same fields as decoding in place gives, and the form untouched
+	if(WTFormParser::scan(form, length, &arena, &collect_field, &fields) != 4 ||
+	   fields != "a=1;b=two words;a=A%zz;last=;" ||
+	   strcmp(form, "a=1&b=two+words&a=%41%zz&&last") != 0)
+		return false;
+	
+	// With nothing to decode, a value is the form's own
+	WTFormParser::scan(form, length, &arena, &first_value, &value);
+	return (value == form + 2);
+}
+
 void test_form_parser(void)
 {
+	DO_TEST(
+		"Parse a form into a dictionary",
+		parses_form(),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Parse a form fed in pieces",
+		feeds_in_pieces(),
+		NOTHING,
+		NOTHING
+		)
+	
+	DO_TEST(
+		"Parse a form without changing it",
+		scans_without_copying(),
+		NOTHING,
+		NOTHING
+		)
+};
+
+
+bool encodes_like_rfc3986(void)
+{
+	const char *unreserved = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-._~";
+	char input[80], expected[241], encoded[241], decoded[80];
+	size_t used;
+	
+	// Every length across the vector/scalar boundary, with every kind of byte
+	for(size_t length = 0; length < sizeof(input); length++)
+	{
+		used = 0;
+		for(size_t pos = 0; pos < length; pos++)
+		{
+			unsigned char c = static_cast<unsigned char>((pos * 37 + length * 11) & 0xFF);
+			input[pos] = static_cast<char>(c);
+			if(c != 0 && strchr(unreserved, c) != NULL)
+			{
+				expected[used++] = c;
+			} else {
+				used += sprintf(expected + used, "%%%02X", c);
+			}
+		}
+		expected[used] = '\0';
+		
+		if(WTURLEncoder::encoded_length(input, length) != used) return false;
+		if(WTURLEncoder::encode(input, length, encoded, sizeof(encoded)) != used) return false;
+		if(strcmp(encoded, expected) != 0) return false;
+		if(WTURLEncoder::decode(encoded, used, decoded) != length) return false;
+		if(memcmp(decoded, input, length) != 0) return false;
+	}
+	
+	// Truncation never splits an escape
+	if(WTURLEncoder::encode("a b", 3, encoded, 4) != 5 || strcmp(encoded, "a") != 0) return false;
+	
+	// In place, with '+' and a malformed escape
+	strcpy(input, "one+two%2Bthree%zz%4");
+	used = WTURLEncoder::decode(input, strlen(input), input, true);
+	return (used == 18 && memcmp(input, "one two+three%zz%4", 18) == 0);
+}
+
+void test_url_encoder(void)
+{
+	DO_TEST(
+		"Percent-encode and decode",
+		encodes_like_rfc3986(),
+		NOTHING,
+		NOTHING
+		)
+};
+
+bool encodes_base64(void)
+{
+	const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char input[200], decoded[200];
+	char expected[280], encoded[320];
+	size_t used, length;
+	
+	// Every length across the vector/scalar boundaries, against the
+	// obvious bit-at-a-time encoding
+	for(length = 0; length < sizeof(input); length++)
+	{
+		used = 0;
+		for(size_t pos = 0; pos < length; pos++)
+			input[pos] = static_cast<unsigned char>((pos * 37 + length * 11) & 0xFF);
+		for(size_t bit = 0; bit < length * 8; bit += 6)
+		{
+			unsigned value = 0;
+			for(size_t next = bit; next < bit + 6; next++)
+			{
+				value <<= 1;
+				if(next < length * 8) value |= (input[next / 8] >> (7 - next % 8)) & 1;
+			}
+			expected[used++] = alphabet[value];
+		}
+		while(used % 4 != 0) expected[used++] = '=';
+		
+		if(WTBase64::encoded_length(length) != used) return false;
+		if(WTBase64::encode(input, length, encoded) != used) return false;
+		if(memcmp(encoded, expected, used) != 0) return false;
+		if(!WTBase64::decode(encoded, used, decoded, &used) || used != length) return false;
+		if(memcmp(decoded, input, length) != 0) return false;
+		
+		// Wrapped, every line ends in CRLF
+		used = WTBase64::encode(input, length, encoded, 16);
+		if(used != WTBase64::encoded_length(length, 16)) return false;
+		if(length > 0 && memcmp(encoded + used - 2, "\r\n", 2) != 0) return false;
+		if(length > 12 && memcmp(encoded + 16, "\r\n", 2) != 0) return false;
+		if(!WTBase64::decode(encoded, used, decoded, &used) || used != length) return false;
+		if(memcmp(decoded, input, length) != 0) return false;
+	}
+	
+	// Long enough to be wrapped in more than one batch
+	{
+		std::string big(5000, '\0'), plain(WTBase64::encoded_length(5000), '\0'),
+			    wrapped(WTBase64::encoded_length(5000, WTBASE64_MIME_LINE), '\0');
+		for(size_t pos = 0; pos < big.size(); pos++)
+			big[pos] = static_cast<char>(pos * 7);
+		WTBase64::encode(big.data(), big.size(), &plain[0]);
+		if(WTBase64::encode(big.data(), big.size(), &wrapped[0], WTBASE64_MIME_LINE) != wrapped.size())
+			return false;
+		for(size_t line = 0; line * 76 < plain.size(); line++)
+		{
+			size_t width = std::min(static_cast<size_t>(76), plain.size() - line * 76);
+			if(wrapped.compare(line * 78, width, plain, line * 76, width) != 0) return false;
+			if(wrapped.compare(line * 78 + width, 2, "\r\n") != 0) return false;
+		}
+	}
+	
+	if(!WTBase64::decode("Zm9vYg", 6, decoded, &used) || used != 4) return false;
+	if(memcmp(decoded, "foob", 4) != 0) return false;
+	
+	// Bad characters, half padding and data after padding
+	return (!WTBase64::decode("Zm9v!mFy", 8, decoded, &used) &&
+		!WTBase64::decode("Zm9vYg=", 7, decoded, &used) &&
+		!WTBase64::decode("Zg==Zm9v", 8, decoded, &used) &&
+		!WTBase64::decode("Z", 1, decoded, &used));
+}
+
+void test_base64(void)
+{
+	DO_TEST(
+		"Base64 encoding",
+		encodes_base64(),
+		NOTHING,
+		NOTHING
+		)
 };
 
 
@@ -174,7 +762,12 @@ int main(void)
 	mowgli_init();
 	
 	test_dict();
+	test_hashed_dict();
+	test_arena_dict();
+	test_typed_dict();
 	test_form_parser();
+	test_url_encoder();
+	test_base64();
 	
 	PRINT_STATS
 	